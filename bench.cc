@@ -0,0 +1,390 @@
+// Copyright (c) 2017, Robert Escriva
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of pocdb nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// Microbenchmarks of the daemon's hot paths.  Each runs in isolation against
+// a daemon whose messages go to a loopback transport, and reports the time
+// and heap allocations it takes per operation.
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+
+// POSIX
+#include <unistd.h>
+
+// e
+#include <e/popt.h>
+
+// pocdb
+#include "daemon.h"
+
+// every heap allocation in the process, including those of other threads
+static uint64_t s_allocs = 0;
+
+void*
+operator new(size_t sz)
+{
+    e::atomic::increment_64_nobarrier(&s_allocs, 1);
+    void* p = malloc(sz ? sz : 1);
+
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void*
+operator new[](size_t sz)
+{
+    return operator new(sz);
+}
+
+void
+operator delete(void* p) throw ()
+{
+    free(p);
+}
+
+void
+operator delete[](void* p) throw ()
+{
+    free(p);
+}
+
+// Stands in for busybee.  What the daemon sends is counted and then recycled,
+// as the receiving end of a real network would recycle it.  The group commit
+// thread sends too, so the counts are atomic.
+class loopback : public transport
+{
+    public:
+        loopback() : messages(), bytes() {}
+        virtual ~loopback() throw () {}
+
+    public:
+        virtual void send(uint64_t, std::auto_ptr<e::buffer> msg)
+        {
+            e::atomic::increment_64_nobarrier(&messages, 1);
+            e::atomic::increment_64_nobarrier(&bytes, msg->size());
+            release_buffer(msg.release());
+        }
+
+        virtual busybee_returncode recv(e::garbage_collector::thread_state*, int,
+                                        uint64_t*, std::auto_ptr<e::buffer>*)
+        { return BUSYBEE_TIMEOUT; }
+
+    public:
+        uint64_t messages;
+        uint64_t bytes;
+};
+
+struct bench_context
+{
+    bench_context(pocdaemon* d, size_t value_size);
+
+    pocdaemon* const d;
+    e::garbage_collector::thread_state ts;
+    // keys the daemon replicates, each used once by benchmarks that need
+    // fresh state; the value is for puts
+    std::vector<std::string> keys;
+    std::string value;
+    buffer_ref value_buf;
+    uint64_t next_key;
+};
+
+bench_context :: bench_context(pocdaemon* _d, size_t value_size)
+    : d(_d)
+    , ts()
+    , keys()
+    , value(value_size, 'v')
+    , value_buf(e::buffer::create(value_size))
+    , next_key(0)
+{
+    value_buf->resize(value_size);
+    memset(value_buf->data(), 'v', value_size);
+}
+
+static const std::string&
+fresh_key(bench_context* ctx)
+{
+    return ctx->keys[ctx->next_key++ % ctx->keys.size()];
+}
+
+typedef void (*bench_func)(bench_context* ctx, uint64_t i);
+
+static void
+report(const char* name, uint64_t iterations, uint64_t nanos, uint64_t allocs)
+{
+    printf("%-28s %10.1f ns/op %8.2f allocs/op\n", name,
+           double(nanos) / iterations, double(allocs) / iterations);
+}
+
+static void
+run(bench_context* ctx, const char* name, bench_func f, uint64_t iterations)
+{
+    const uint64_t allocs = e::atomic::load_64_nobarrier(&s_allocs);
+    const uint64_t start = po6::monotonic_time();
+
+    for (uint64_t i = 0; i < iterations; ++i)
+    {
+        f(ctx, i);
+
+        if (i % 1024 == 0)
+        {
+            ctx->d->gc.quiescent_state(&ctx->ts);
+        }
+    }
+
+    const uint64_t nanos = po6::monotonic_time() - start;
+    report(name, iterations, nanos, e::atomic::load_64_nobarrier(&s_allocs) - allocs);
+}
+
+// wait until every staged acceptor and learner write is in leveldb
+static void
+wait_for_commit(bench_context* ctx)
+{
+    while (true)
+    {
+        {
+            po6::threads::mutex::hold hold(&ctx->d->commit.mtx);
+
+            if (ctx->d->commit.pending.empty() && !ctx->d->commit.flushing)
+            {
+                return;
+            }
+        }
+
+        po6::sleep(PO6_MILLIS);
+    }
+}
+
+static void
+bench_pack_pvalue(bench_context* ctx, uint64_t)
+{
+    static e::buffer* buf = NULL;
+    pvalue v;
+    v.b.number = 0x1234567890ULL;
+    v.b.leader = ctx->d->host;
+    v.v = e::slice(ctx->value);
+
+    if (!buf)
+    {
+        buf = e::buffer::create(pack_size(v.b) + pack_size(v));
+    }
+
+    buf->pack_at(0) << v.b << v;
+    ballot b;
+    pvalue u;
+    e::unpacker up = buf->unpack_from(0) >> b >> u;
+
+    if (up.error() || u.v.size() != v.v.size())
+    {
+        abort();
+    }
+}
+
+static void
+bench_save_acceptor(bench_context* ctx, uint64_t i)
+{
+    const std::string& k(fresh_key(ctx));
+    ballot b;
+    b.number = i + 1;
+    b.leader = ctx->d->host;
+    pvalue v;
+    v.b = b;
+    v.v = e::slice(ctx->value);
+    ctx->d->save_acceptor_state(e::slice(k), i, b, v);
+}
+
+static void
+bench_get_acceptor(bench_context* ctx, uint64_t)
+{
+    const std::string& k(fresh_key(ctx));
+    uint64_t ver;
+    ballot b;
+    pvalue v;
+    po6::threads::mutex::hold hold(ctx->d->acceptor_lock(e::slice(k)));
+
+    if (ctx->d->get_acceptor_state(e::slice(k), &ver, &b, &v) != POCDB_SUCCESS)
+    {
+        abort();
+    }
+}
+
+// one put through Phase 1, Phase 2 and its commit, with peers' replies
+// delivered by hand
+static void
+bench_paxos_round(bench_context* ctx, uint64_t)
+{
+    pocdaemon* d = ctx->d;
+    const std::string& key(fresh_key(ctx));
+    const e::slice k(key);
+    const unsigned slot = key_slot(k);
+    pocdaemon::write_map_t::state_reference sr;
+    write_state_machine* sm = d->write_map(key_hash(k)).get_or_create_state(key, &sr);
+    d->admit(ctx->value_buf->size());
+    sm->write(1, 1, ctx->value_buf,
+              e::slice(ctx->value_buf->data(), ctx->value_buf->size()), 0, d);
+
+    for (unsigned i = 0; i < QUORUM; ++i)
+    {
+        sm->phase1b(slot_replica(slot, i), sm->version, sm->leading, pvalue(), d);
+    }
+
+    const uint64_t ver = sm->version;
+    const ballot b = sm->leading;
+    const std::vector<std::pair<uint64_t, uint64_t> > no_holders;
+
+    for (unsigned i = 0; i < QUORUM; ++i)
+    {
+        sm->phase2b(slot_replica(slot, i), ver, b, no_holders, d);
+    }
+}
+
+static void
+bench_process_get(bench_context* ctx, uint64_t i)
+{
+    static buffer_ref msg;
+
+    if (!msg)
+    {
+        const std::string& key(ctx->keys[0]);
+        const size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint64_t) + pack_size(e::slice(key));
+        msg = buffer_ref(e::buffer::create(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('G') << uint64_t(0) << e::slice(key);
+        ctx->d->learn(e::slice(key), 1, e::slice(ctx->value));
+        wait_for_commit(ctx);
+    }
+
+    msg->pack_at(BUSYBEE_HEADER_SIZE + 1) << i;
+    uint8_t type;
+    e::unpacker up = msg->unpack_from(BUSYBEE_HEADER_SIZE) >> type;
+    ctx->d->process_get(1, msg, up);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    long iterations = 100000;
+    long value_size = 100;
+    const char* dir = "/tmp";
+    e::argparser ap;
+    ap.autohelp();
+    ap.option_string("[OPTIONS]");
+    ap.arg().name('n', "iterations")
+            .description("operations per benchmark (default: 100000)")
+            .metavar("N")
+            .as_long(&iterations);
+    ap.arg().name('v', "value-size")
+            .description("bytes per value (default: 100)")
+            .metavar("B")
+            .as_long(&value_size);
+    ap.arg().long_name("dir")
+            .description("where to make the scratch leveldb (default: /tmp)")
+            .metavar("DIR")
+            .as_string(&dir);
+
+    if (!ap.parse(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (ap.args_sz() != 0 || iterations <= 0 || value_size < 0)
+    {
+        ap.usage();
+        return EXIT_FAILURE;
+    }
+
+    std::string path(dir);
+    path += "/pocdb-bench.XXXXXX";
+
+    if (!mkdtemp(&path[0]))
+    {
+        perror("could not make a scratch directory");
+        return EXIT_FAILURE;
+    }
+
+    // the benchmarks handle messages on this thread, as a network thread would
+    start_buffer_pool();
+    // one round per put, no tracing, anti-entropy, backoff or leases, and a cache
+    // big enough that gets never miss
+    daemon_options dopts;
+    dopts.stable_ballots = false;
+    dopts.coalesce = 1;
+    dopts.trace_sample = 0;
+    dopts.max_queued = ~0ULL;
+    dopts.ae_interval = 0;
+    dopts.retry_backoff = 0;
+    dopts.lease_term = 0;
+    dopts.lease_skew = 0;
+    dopts.client_queue = ~0ULL;
+    pocdaemon d(HOSTA, dopts);
+    loopback net;
+    d.net = &net;
+    store_config cfg;
+
+    if (!d.open_store(cfg, path.c_str(), 1024, &d.db))
+    {
+        return EXIT_FAILURE;
+    }
+
+    d.learned_db = d.db;
+    d.commit.start();
+    bench_context ctx(&d, value_size);
+    d.gc.register_thread(&ctx.ts);
+
+    for (uint64_t i = 0; ctx.keys.size() < uint64_t(iterations); ++i)
+    {
+        char key[32];
+        const int sz = snprintf(key, sizeof(key), "key%llu", (unsigned long long)i);
+
+        if (is_replica(key_slot(e::slice(key, sz)), d.host))
+        {
+            ctx.keys.push_back(std::string(key, sz));
+        }
+    }
+
+    run(&ctx, "pack/unpack pvalue", bench_pack_pvalue, iterations);
+    run(&ctx, "save_acceptor_state", bench_save_acceptor, iterations);
+    wait_for_commit(&ctx);
+    run(&ctx, "get_acceptor_state", bench_get_acceptor, iterations);
+    run(&ctx, "paxos round (loopback)", bench_paxos_round, iterations / 8 + 1);
+    wait_for_commit(&ctx);
+    run(&ctx, "process_get (cached)", bench_process_get, iterations);
+    printf("%llu messages, %llu bytes sent to the loopback\n",
+           (unsigned long long)net.messages, (unsigned long long)net.bytes);
+
+    d.commit.shutdown();
+    d.gc.deregister_thread(&ctx.ts);
+    delete d.db;
+    leveldb::Options opts;
+    opts.comparator = &d.comparator;
+    leveldb::DestroyDB(path, opts);
+    rmdir(path.c_str());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+// Copyright (c) 2017, Robert Escriva
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of pocdb nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef pocdb_chunk_h_
+#define pocdb_chunk_h_
+
+// C
+#include <stdint.h>
+
+// STL
+#include <algorithm>
+#include <memory>
+#include <string>
+
+// e
+#include <e/buffer.h>
+#include <e/serialization.h>
+#include <e/slice.h>
+
+// A value larger than CHUNK_SIZE is split into chunks, each put under a key
+// of its own, and once every chunk is stored the key itself is put with a
+// manifest naming them.  Each chunk is a Paxos round of its own, but no
+// message carries more than a chunk, and chunk keys scatter over every slot.
+// Chunk keys are written once with their chunk and once more, emptied, when
+// the value is overwritten, so any replica that has a chunk has the right
+// one.
+#define CODEC_CHUNKED 2
+#define CHUNK_SIZE (256U << 10)
+// chunks one operation has in flight at once
+#define CHUNK_WINDOW 8
+
+struct chunk_manifest
+{
+    chunk_manifest() : size(), count(), id() {}
+    chunk_manifest(uint64_t s, uint64_t i)
+        : size(s), count((s + CHUNK_SIZE - 1) / CHUNK_SIZE), id(i) {}
+
+    // bytes of chunk "i"
+    size_t chunk_size(uint32_t i) const
+    { return std::min(size - uint64_t(i) * CHUNK_SIZE, uint64_t(CHUNK_SIZE)); }
+
+    uint64_t size;
+    uint32_t count;
+    uint64_t id;
+};
+
+#define MANIFEST_SIZE (1 + 2 * sizeof(uint64_t) + sizeof(uint32_t))
+
+inline void
+encode_manifest(const chunk_manifest& m, std::string* enc)
+{
+    std::auto_ptr<e::buffer> buf(e::buffer::create(MANIFEST_SIZE));
+    buf->pack_at(0) << uint8_t(CODEC_CHUNKED) << m.size << m.count << m.id;
+    enc->assign(reinterpret_cast<const char*>(buf->data()), buf->size());
+}
+
+inline bool
+is_manifest(const e::slice& v)
+{
+    return v.size() == MANIFEST_SIZE && v.data()[0] == CODEC_CHUNKED;
+}
+
+inline bool
+decode_manifest(const e::slice& v, chunk_manifest* m)
+{
+    uint8_t tag;
+
+    if (!is_manifest(v) ||
+        (e::unpacker(v) >> tag >> m->size >> m->count >> m->id).error())
+    {
+        return false;
+    }
+
+    return m->count == chunk_manifest(m->size, m->id).count;
+}
+
+// the key of chunk "i" of "key"'s value; the NUL keeps it apart from keys
+// that clients choose
+inline std::string
+chunk_key(const std::string& key, uint64_t id, uint32_t i)
+{
+    std::string ck(key);
+    ck.push_back('\0');
+
+    for (int shift = 56; shift >= 0; shift -= 8)
+    {
+        ck.push_back(char(id >> shift));
+    }
+
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        ck.push_back(char(i >> shift));
+    }
+
+    return ck;
+}
+
+#endif // pocdb_chunk_h_
@@ -25,57 +25,1753 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+// C
+#include <errno.h>
+#include <string.h>
+
+// POSIX
+#include <unistd.h>
+
+// STL
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// po6
+#include <po6/time.h>
+
 // e
+#include <e/compat.h>
 #include <e/serialization.h>
 
 // BusyBee
 #include <busybee.h>
 
+// snappy
+#include <snappy.h>
+
 // pocdb
 #include <pocdb.h>
+#include "chunk.h"
 #include "common.h"
+#include "histogram.h"
+
+// An operation awaiting replies from one or more servers.  Every message an
+// operation sends carries a nonce the client routes the reply back with.
+struct pending
+{
+    pending(int64_t i, pocdb_returncode* s) : id(i), status(s), nonces(), internal(false) {}
+    virtual ~pending() throw () {}
+
+    // send the first messages; false if they could not be sent
+    virtual bool start(pocdb_client* cl) = 0;
+    // true once the operation is done and *status final
+    virtual bool handle(pocdb_client* cl, uint64_t server, e::unpacker up) = 0;
+    virtual bool disrupted(pocdb_client* cl, uint64_t server) = 0;
+    // a timer the operation armed fired; true once the operation is done
+    virtual bool expired(pocdb_client*) { return false; }
+
+    const int64_t id;
+    pocdb_returncode* const status;
+    std::vector<uint64_t> nonces;
+    // issued by the client for itself, e.g. a reader's prefetch; only a
+    // wait for its id returns it, never a loop over any operation
+    bool internal;
+
+    private:
+        pending(const pending&);
+        pending& operator = (const pending&);
+};
+
+// what the client has seen of each server's replies
+struct server_health
+{
+    server_health() : latency(), outstanding(), down_until() {}
+
+    // moving average of reply latency, in nanoseconds; zero until measured
+    uint64_t latency;
+    // requests sent that have not been answered
+    uint64_t outstanding;
+    // a disrupted server is avoided until then
+    uint64_t down_until;
+};
+
+// one in ROUTE_EXPLORE requests is sent round robin, so that the latency of
+// replicas that lose out keeps being measured
+#define ROUTE_EXPLORE 16
+#define DOWN_PERIOD PO6_SECONDS
+// the hedge delay before enough gets have been timed, the fewest gets that
+// set it, and the least it may be
+#define HEDGE_INITIAL (10 * PO6_MILLIS)
+#define HEDGE_SAMPLES 1024
+#define HEDGE_MIN (100 * PO6_MICROS)
 
 struct pocdb_client
 {
     pocdb_client();
 
+    // the replica of "slot", other than "avoid", expected to answer first:
+    // the live one with the least latency for its outstanding requests
+    unsigned next_replica(unsigned slot, uint64_t avoid = 0);
+    uint64_t next_host(unsigned slot, uint64_t avoid = 0)
+    { return slot_replica(slot, next_replica(slot, avoid)); }
+    server_health* health_of(uint64_t server);
+    bool send(uint64_t server, std::auto_ptr<e::buffer> msg);
+    // sends between the two calls share one message per server, with keys
+    // that share replicas sent to the same one
+    void begin_batch();
+    void end_batch();
+    // a fresh nonce whose replies are routed to p
+    uint64_t route(pending* p);
+    // call p->expired once "delay" nanoseconds pass
+    void arm(pending* p, uint64_t delay);
+    bool fire_timers();
+    void record_get(uint64_t latency);
+    int64_t issue(pending* p);
+    void finish(pending* p);
+    void forget(pending* p);
+    int64_t loop(int64_t id, int timeout, pocdb_returncode* status);
+    // the id of a put whose chunks no other put's could be mistaken for
+    uint64_t chunk_id();
+    void handle(uint64_t server, std::auto_ptr<e::buffer> msg);
+    void handle(uint64_t server, e::unpacker up);
+    void disrupted(uint64_t server);
+
     unsigned reqno;
+    uint64_t nonce;
+    // the nonce of the reply being handled
+    uint64_t replying;
+    int64_t next_id;
     controller control;
     const std::auto_ptr<busybee_client> busybee;
+    typedef std::map<int64_t, e::compat::shared_ptr<pending> > op_map_t;
+    op_map_t ops;
+    // nonce -> (operation, time sent)
+    std::map<uint64_t, std::pair<int64_t, uint64_t> > routes;
+    std::set<int64_t> completed;
+    // internal operations outstanding, and those completed
+    size_t internal_ops;
+    std::set<int64_t> completed_internal;
+    bool batching;
+    unsigned batch_replica;
+    outbox batch;
+    server_health health[NUM_HOSTS];
+    // (deadline, operation)
+    std::set<std::pair<uint64_t, int64_t> > timers;
+    bool hedging;
+    // gets not answered within hedge_delay are also sent to another replica
+    uint64_t hedge_delay;
+    histogram get_latency;
+    // whether values carry a codec tag, and, if they do, the size from
+    // which they are compressed (zero compresses none)
+    bool tagged;
+    size_t compress_min;
 };
 
 pocdb_client :: pocdb_client()
     : reqno(0)
+    , nonce(0)
+    , replying(0)
+    , next_id(1)
     , control()
     , busybee(busybee_client::create(&control))
+    , ops()
+    , routes()
+    , completed()
+    , internal_ops(0)
+    , completed_internal()
+    , batching(false)
+    , batch_replica()
+    , batch()
+    , health()
+    , timers()
+    , hedging(false)
+    , hedge_delay(HEDGE_INITIAL)
+    , get_latency()
+    , tagged(false)
+    , compress_min(0)
 {
 }
 
+unsigned
+pocdb_client :: next_replica(unsigned slot, uint64_t avoid)
+{
+    if (batching && slot_replica(slot, batch_replica) != avoid)
+    {
+        return batch_replica;
+    }
+
+    const bool explore = reqno % ROUTE_EXPLORE == 0;
+    const unsigned first = reqno++ % REPLICAS;
+    const uint64_t now = po6::monotonic_time();
+    bool found = false;
+    unsigned best = first;
+    bool best_live = false;
+    uint64_t best_score = 0;
+
+    for (unsigned i = 0; i < REPLICAS; ++i)
+    {
+        const unsigned r = (first + i) % REPLICAS;
+        const uint64_t server = slot_replica(slot, r);
+
+        if (server == avoid)
+        {
+            continue;
+        }
+
+        const server_health* h = health_of(server);
+        const bool live = h->down_until <= now;
+        const uint64_t score = (h->latency + 1) * (h->outstanding + 1);
+
+        // exploring takes the first live replica in rotation
+        if (!found || (live && !best_live) ||
+            (!explore && live == best_live && score < best_score))
+        {
+            found = true;
+            best = r;
+            best_live = live;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+server_health*
+pocdb_client :: health_of(uint64_t server)
+{
+    for (unsigned i = 0; i < NUM_HOSTS; ++i)
+    {
+        if (HOSTS[i] == server)
+        {
+            return &health[i];
+        }
+    }
+
+    return NULL;
+}
+
+bool
+pocdb_client :: send(uint64_t server, std::auto_ptr<e::buffer> msg)
+{
+    server_health* h = health_of(server);
+
+    if (h)
+    {
+        ++h->outstanding;
+    }
+
+    if (batching)
+    {
+        batch.add(server, msg);
+        return true;
+    }
+
+    return busybee->send(server, msg) == BUSYBEE_SUCCESS;
+}
+
+void
+pocdb_client :: begin_batch()
+{
+    batching = true;
+    // keys with the same replicas go to the same one, so their peer
+    // messages batch too
+    batch_replica = reqno++ % REPLICAS;
+}
+
+void
+pocdb_client :: end_batch()
+{
+    uint64_t server;
+    std::auto_ptr<e::buffer> msg;
+    batching = false;
+
+    while (batch.next(&server, &msg))
+    {
+        if (busybee->send(server, msg) != BUSYBEE_SUCCESS)
+        {
+            disrupted(server);
+        }
+    }
+}
+
+uint64_t
+pocdb_client :: route(pending* p)
+{
+    const uint64_t n = nonce++;
+    routes[n] = std::make_pair(p->id, po6::monotonic_time());
+    p->nonces.push_back(n);
+    return n;
+}
+
+void
+pocdb_client :: arm(pending* p, uint64_t delay)
+{
+    timers.insert(std::make_pair(po6::monotonic_time() + delay, p->id));
+}
+
+bool
+pocdb_client :: fire_timers()
+{
+    const uint64_t now = po6::monotonic_time();
+    bool fired = false;
+
+    while (!timers.empty() && timers.begin()->first <= now)
+    {
+        op_map_t::iterator it = ops.find(timers.begin()->second);
+        timers.erase(timers.begin());
+        fired = true;
+
+        // the operation may have completed since it armed the timer
+        if (it == ops.end())
+        {
+            continue;
+        }
+
+        e::compat::shared_ptr<pending> p = it->second;
+
+        if (p->expired(this))
+        {
+            finish(p.get());
+        }
+    }
+
+    return fired;
+}
+
+void
+pocdb_client :: record_get(uint64_t latency)
+{
+    get_latency.record(latency);
+
+    // the delay tracks this client's recent 95th percentile
+    if (get_latency.total >= HEDGE_SAMPLES)
+    {
+        hedge_delay = std::max(get_latency.percentile(0.95), uint64_t(HEDGE_MIN));
+        get_latency = histogram();
+    }
+}
+
+int64_t
+pocdb_client :: issue(pending* _p)
+{
+    e::compat::shared_ptr<pending> p(_p);
+    ops[p->id] = p;
+    internal_ops += p->internal ? 1 : 0;
+
+    if (!p->start(this))
+    {
+        forget(p.get());
+        *p->status = POCDB_SERVER_ERROR;
+        return -1;
+    }
+
+    return p->id;
+}
+
+void
+pocdb_client :: finish(pending* p)
+{
+    (p->internal ? completed_internal : completed).insert(p->id);
+    forget(p);
+}
+
+void
+pocdb_client :: forget(pending* p)
+{
+    for (size_t i = 0; i < p->nonces.size(); ++i)
+    {
+        routes.erase(p->nonces[i]);
+    }
+
+    internal_ops -= p->internal ? 1 : 0;
+    ops.erase(p->id);
+}
+
+int64_t
+pocdb_client :: loop(int64_t id, int timeout, pocdb_returncode* status)
+{
+    const uint64_t deadline = po6::monotonic_time() + uint64_t(timeout) * PO6_MILLIS;
+
+    while (true)
+    {
+        // a timer may complete an operation, so look again before waiting
+        if (fire_timers())
+        {
+            continue;
+        }
+
+        std::set<int64_t>::iterator it = id < 0 ? completed.begin() : completed.find(id);
+
+        if (it != completed.end())
+        {
+            const int64_t ret = *it;
+            completed.erase(it);
+            *status = POCDB_SUCCESS;
+            return ret;
+        }
+
+        if (id >= 0 && (it = completed_internal.find(id)) != completed_internal.end())
+        {
+            completed_internal.erase(it);
+            *status = POCDB_SUCCESS;
+            return id;
+        }
+
+        // internal operations make progress here, but are not waited for
+        if (id < 0 ? ops.size() == internal_ops : ops.find(id) == ops.end())
+        {
+            *status = POCDB_NONE_PENDING;
+            return -1;
+        }
+
+        uint64_t server;
+        std::auto_ptr<e::buffer> msg;
+        const uint64_t now = po6::monotonic_time();
+        // round up, so as to not spin just short of a deadline
+        int wait = timeout < 0 ? -1
+                 : deadline > now ? int((deadline - now + PO6_MILLIS - 1) / PO6_MILLIS) : 0;
+
+        // wake for the next timer too
+        if (!timers.empty())
+        {
+            const uint64_t next = timers.begin()->first;
+            const int until = next > now ? int((next - now + PO6_MILLIS - 1) / PO6_MILLIS) : 0;
+            wait = wait < 0 ? until : std::min(wait, until);
+        }
+
+        switch (busybee->recv(wait, &server, &msg))
+        {
+            case BUSYBEE_SUCCESS:
+                handle(server, msg);
+                break;
+            case BUSYBEE_DISRUPTED:
+                disrupted(server);
+                break;
+            case BUSYBEE_TIMEOUT:
+                if (timeout >= 0 && po6::monotonic_time() >= deadline)
+                {
+                    *status = POCDB_TIMEOUT;
+                    return -1;
+                }
+
+                break;
+            default:
+                *status = POCDB_SERVER_ERROR;
+                return -1;
+        }
+    }
+}
+
+uint64_t
+pocdb_client :: chunk_id()
+{
+    // two clients share neither a process and a time, nor a time and an
+    // address within one process
+    uint64_t id = po6::wallclock_time();
+    id ^= uint64_t(getpid()) << 40;
+    id ^= uint64_t(uintptr_t(this)) << 8;
+    return id ^ nonce++;
+}
+
+void
+pocdb_client :: handle(uint64_t server, std::auto_ptr<e::buffer> msg)
+{
+    e::unpacker up = msg->unpack_from(BUSYBEE_HEADER_SIZE);
+    uint64_t n;
+    uint32_t count;
+
+    if (!(up >> n).error() && n == BATCH_NONCE)
+    {
+        up = up >> n >> count;
+
+        for (uint32_t i = 0; !up.error() && i < count; ++i)
+        {
+            e::slice m;
+            up = up >> m;
+
+            if (!up.error())
+            {
+                handle(server, e::unpacker(m));
+            }
+        }
+
+        return;
+    }
+
+    handle(server, up);
+}
+
+void
+pocdb_client :: handle(uint64_t server, e::unpacker up)
+{
+    uint64_t n;
+    up = up >> n;
+    server_health* h = health_of(server);
+
+    if (h && h->outstanding > 0)
+    {
+        --h->outstanding;
+    }
+
+    std::map<uint64_t, std::pair<int64_t, uint64_t> >::iterator r = routes.find(n);
+
+    // replies beyond those an operation waited for find no route
+    if (up.error() || r == routes.end())
+    {
+        return;
+    }
+
+    // an average over roughly the last eight replies
+    if (h)
+    {
+        const uint64_t latency = po6::monotonic_time() - r->second.second;
+        h->latency = h->latency ? h->latency - h->latency / 8 + latency / 8 : latency;
+        h->down_until = 0;
+    }
+
+    e::compat::shared_ptr<pending> p = ops[r->second.first];
+    replying = n;
+
+    if (p->handle(this, server, up))
+    {
+        finish(p.get());
+    }
+}
+
+void
+pocdb_client :: disrupted(uint64_t server)
+{
+    std::vector<e::compat::shared_ptr<pending> > failed;
+    server_health* h = health_of(server);
+
+    if (h)
+    {
+        h->outstanding = 0;
+        h->down_until = po6::monotonic_time() + DOWN_PERIOD;
+    }
+
+    for (op_map_t::iterator it = ops.begin(); it != ops.end(); ++it)
+    {
+        if (it->second->disrupted(this, server))
+        {
+            failed.push_back(it->second);
+        }
+    }
+
+    for (size_t i = 0; i < failed.size(); ++i)
+    {
+        finish(failed[i].get());
+    }
+}
+
+// A client that tags values begins every value it stores with a codec tag
+// saying how the rest of it is encoded.  Servers never look inside values, so
+// a value crosses the network, goes through Paxos, and sits in leveldb just
+// as the client encoded it, and only gets decode it.  Untagged values, which
+// clients store by default, are the bytes the caller gave; the two cannot be
+// told apart, so every client of a store must agree on which it uses.
+#define CODEC_RAW 0
+#define CODEC_SNAPPY 1
+// CODEC_CHUNKED, in chunk.h, tags the manifest of a chunked value
+
+static void
+encode_value(const e::slice& v, bool tagged, size_t compress_min, std::string* enc)
+{
+    enc->clear();
+
+    if (!tagged)
+    {
+        enc->assign(v.cdata(), v.size());
+        return;
+    }
+
+    if (compress_min > 0 && v.size() >= compress_min)
+    {
+        enc->resize(1 + snappy::MaxCompressedLength(v.size()));
+        size_t sz;
+        snappy::RawCompress(v.cdata(), v.size(), &(*enc)[1], &sz);
+
+        // data that does not compress is stored as is
+        if (sz < v.size())
+        {
+            (*enc)[0] = char(CODEC_SNAPPY);
+            enc->resize(1 + sz);
+            return;
+        }
+    }
+
+    enc->reserve(1 + v.size());
+    enc->push_back(char(CODEC_RAW));
+    enc->append(v.cdata(), v.size());
+}
+
+static pocdb_returncode
+copy_value(const e::slice& v, char** val, size_t* val_sz)
+{
+    *val_sz = v.size();
+    *val = NULL;
+
+    if (v.size() == 0)
+    {
+        return POCDB_SUCCESS;
+    }
+
+    *val = (char*)malloc(v.size());
+
+    if (!*val)
+    {
+        *val_sz = 0;
+        return POCDB_SEE_ERRNO;
+    }
+
+    memcpy(*val, v.data(), v.size());
+    return POCDB_SUCCESS;
+}
+
+static pocdb_returncode
+decode_value(const e::slice& v, bool tagged, char** val, size_t* val_sz)
+{
+    const e::slice body(v.data() + 1, v.size() ? v.size() - 1 : 0);
+    size_t sz;
+
+    if (!tagged)
+    {
+        return copy_value(v, val, val_sz);
+    }
+
+    if (v.size() == 0)
+    {
+        return POCDB_SERVER_ERROR;
+    }
+
+    switch (v.data()[0])
+    {
+        case CODEC_RAW:
+            return copy_value(body, val, val_sz);
+        case CODEC_SNAPPY:
+            if (!snappy::GetUncompressedLength(body.cdata(), body.size(), &sz))
+            {
+                return POCDB_SERVER_ERROR;
+            }
+
+            *val_sz = sz;
+            *val = NULL;
+
+            if (sz == 0)
+            {
+                return POCDB_SUCCESS;
+            }
+
+            *val = (char*)malloc(sz);
+
+            if (!*val)
+            {
+                *val_sz = 0;
+                return POCDB_SEE_ERRNO;
+            }
+
+            if (!snappy::RawUncompress(body.cdata(), body.size(), *val))
+            {
+                free(*val);
+                *val = NULL;
+                *val_sz = 0;
+                return POCDB_SERVER_ERROR;
+            }
+
+            return POCDB_SUCCESS;
+        default:
+            return POCDB_SERVER_ERROR;
+    }
+}
+
+// decode a value known to be "sz" bytes straight into "out"
+static bool
+decode_into(const e::slice& v, char* out, size_t sz)
+{
+    const e::slice body(v.data() + 1, v.size() ? v.size() - 1 : 0);
+    size_t usz;
+
+    if (v.size() == 0)
+    {
+        return false;
+    }
+
+    switch (v.data()[0])
+    {
+        case CODEC_RAW:
+            if (body.size() != sz)
+            {
+                return false;
+            }
+
+            memcpy(out, body.data(), sz);
+            return true;
+        case CODEC_SNAPPY:
+            return snappy::GetUncompressedLength(body.cdata(), body.size(), &usz) && usz == sz &&
+                   snappy::RawUncompress(body.cdata(), body.size(), out);
+        default:
+            return false;
+    }
+}
+
+// Gets chunks [first, last) of a chunked value into "out" for operation
+// "owner", whose replies it handles until every chunk is in.  A replica that
+// has not learned a chunk yet passes the request on to the next replica.
+struct chunk_fetch
+{
+    chunk_fetch() : key(), m(), first(), last(), next(), remaining(), out(), asked() {}
+
+    bool active() const { return out != NULL; }
+    bool start(pocdb_client* cl, pending* owner, const std::string& k,
+               const chunk_manifest& m, uint32_t first, uint32_t last, char* out);
+    // true once the chunks are in or the fetch failed, with *rc saying which
+    bool handle(pocdb_client* cl, pending* owner, uint64_t server, e::unpacker up,
+                pocdb_returncode* rc);
+    bool disrupted(pocdb_client* cl, pending* owner, uint64_t server, pocdb_returncode* rc);
+    bool ask(pocdb_client* cl, pending* owner, uint32_t i, unsigned replica, unsigned attempt);
+
+    struct request
+    {
+        uint32_t chunk;
+        uint64_t server;
+        // the replica first asked, and how many have been asked since
+        unsigned replica;
+        unsigned attempt;
+    };
+
+    std::string key;
+    chunk_manifest m;
+    uint32_t first;
+    uint32_t last;
+    uint32_t next;
+    uint32_t remaining;
+    char* out;
+    // nonce -> request
+    std::map<uint64_t, request> asked;
+};
+
+bool
+chunk_fetch :: start(pocdb_client* cl, pending* owner, const std::string& k,
+                     const chunk_manifest& _m, uint32_t _first, uint32_t _last, char* _out)
+{
+    key = k;
+    m = _m;
+    first = _first;
+    last = _last;
+    next = first;
+    remaining = last - first;
+    out = _out;
+    asked.clear();
+
+    while (next < last && next - first < CHUNK_WINDOW)
+    {
+        const uint32_t i = next++;
+
+        if (!ask(cl, owner, i, cl->next_replica(key_slot(e::slice(chunk_key(key, m.id, i)))), 0))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+chunk_fetch :: ask(pocdb_client* cl, pending* owner, uint32_t i, unsigned replica, unsigned attempt)
+{
+    const std::string ck(chunk_key(key, m.id, i));
+    const e::slice k(ck);
+    const size_t sz = BUSYBEE_HEADER_SIZE
+                    + 1 + sizeof(uint64_t)
+                    + pack_size(k);
+    const uint64_t n = cl->route(owner);
+    request r;
+    r.chunk = i;
+    r.server = slot_replica(key_slot(k), (replica + attempt) % REPLICAS);
+    r.replica = replica;
+    r.attempt = attempt;
+    asked[n] = r;
+    std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
+    msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('G') << n << k;
+    return cl->send(r.server, msg);
+}
+
+bool
+chunk_fetch :: handle(pocdb_client* cl, pending* owner, uint64_t, e::unpacker up,
+                      pocdb_returncode* rc)
+{
+    std::map<uint64_t, request>::iterator it = asked.find(cl->replying);
+
+    // a reply to a request already passed on
+    if (it == asked.end())
+    {
+        return false;
+    }
+
+    const request r = it->second;
+    asked.erase(it);
+    pocdb_returncode grc;
+    e::slice v;
+    up = up >> e::unpack_uint8<pocdb_returncode>(grc);
+    // a refusal carries nothing more
+    if (up.error() || grc != POCDB_BUSY) up = up >> v;
+
+    if (!up.error() && grc == POCDB_NOT_FOUND && r.attempt + 1 < REPLICAS)
+    {
+        if (ask(cl, owner, r.chunk, r.replica, r.attempt + 1)) return false;
+        *rc = POCDB_SERVER_ERROR;
+        return true;
+    }
+
+    // a manifest names only chunks that were stored, so a missing chunk is
+    // a server's fault
+    if (up.error() || grc != POCDB_SUCCESS)
+    {
+        *rc = grc == POCDB_NOT_FOUND || up.error() ? POCDB_SERVER_ERROR : grc;
+        return true;
+    }
+
+    if (!decode_into(v, out + uint64_t(r.chunk - first) * CHUNK_SIZE, m.chunk_size(r.chunk)))
+    {
+        *rc = POCDB_SERVER_ERROR;
+        return true;
+    }
+
+    if (next < last &&
+        !ask(cl, owner, next, cl->next_replica(key_slot(e::slice(chunk_key(key, m.id, next)))), 0))
+    {
+        *rc = POCDB_SERVER_ERROR;
+        return true;
+    }
+
+    next += next < last ? 1 : 0;
+
+    if (--remaining > 0)
+    {
+        return false;
+    }
+
+    *rc = POCDB_SUCCESS;
+    return true;
+}
+
+bool
+chunk_fetch :: disrupted(pocdb_client* cl, pending* owner, uint64_t server, pocdb_returncode* rc)
+{
+    std::vector<request> lost;
+
+    for (std::map<uint64_t, request>::iterator it = asked.begin(); it != asked.end(); )
+    {
+        if (it->second.server == server)
+        {
+            lost.push_back(it->second);
+            asked.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    for (size_t i = 0; i < lost.size(); ++i)
+    {
+        if (lost[i].attempt + 1 >= REPLICAS ||
+            !ask(cl, owner, lost[i].chunk, lost[i].replica, lost[i].attempt + 1))
+        {
+            *rc = POCDB_SERVER_ERROR;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// For a get that found manifest "v":  allocates the value and begins
+// fetching every chunk into it.  False, with *status set, if it cannot.
+static bool
+start_chunks(pocdb_client* cl, pending* p, const std::string& key, const e::slice& v,
+             chunk_fetch* cf, pocdb_returncode* status, char** val, size_t* val_sz)
+{
+    chunk_manifest m;
+
+    if (!decode_manifest(v, &m))
+    {
+        *status = POCDB_SERVER_ERROR;
+        return false;
+    }
+
+    *val_sz = m.size;
+    *val = (char*)malloc(m.size);
+
+    if (!*val)
+    {
+        *status = POCDB_SEE_ERRNO;
+        return false;
+    }
+
+    if (!cf->start(cl, p, key, m, 0, m.count, *val))
+    {
+        free(*val);
+        *val = NULL;
+        *val_sz = 0;
+        *status = POCDB_SERVER_ERROR;
+        return false;
+    }
+
+    return true;
+}
+
+// the fetch that start_chunks began is over
+static bool
+finish_chunks(pocdb_returncode rc, pocdb_returncode* status, char** val, size_t* val_sz)
+{
+    *status = rc;
+
+    if (rc != POCDB_SUCCESS)
+    {
+        free(*val);
+        *val = NULL;
+        *val_sz = 0;
+    }
+
+    return true;
+}
+
+struct pending_put : public pending
+{
+    pending_put(int64_t i, pocdb_returncode* s, const e::slice& k, const e::slice& _v,
+                bool tagged, size_t compress_min)
+        : pending(i, s), slot(key_slot(k)), host(), msg()
+    {
+        std::string enc;
+        encode_value(_v, tagged, compress_min, &enc);
+        const e::slice v(enc);
+        const size_t sz = BUSYBEE_HEADER_SIZE
+                        + 1 + sizeof(uint64_t)
+                        + pack_size(k)
+                        + pack_size(v);
+        msg.reset(e::buffer::create(sz));
+        // the nonce is filled in by start
+        msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('P') << uint64_t(0) << k << v;
+    }
+
+    virtual bool start(pocdb_client* cl)
+    {
+        host = cl->next_host(slot);
+        msg->pack_at(BUSYBEE_HEADER_SIZE + 1) << cl->route(this);
+        return cl->send(host, msg);
+    }
+
+    virtual bool handle(pocdb_client*, uint64_t, e::unpacker up)
+    {
+        up = up >> e::unpack_uint8<pocdb_returncode>(*status);
+        if (up.error()) *status = POCDB_SERVER_ERROR;
+        return true;
+    }
+
+    virtual bool disrupted(pocdb_client*, uint64_t server)
+    {
+        if (server != host) return false;
+        *status = POCDB_SERVER_ERROR;
+        return true;
+    }
+
+    const unsigned slot;
+    uint64_t host;
+    std::auto_ptr<e::buffer> msg;
+};
+
+// A hedged get that goes unanswered for the client's hedge delay is also
+// sent to a second replica, and takes whichever reply comes first.  A get
+// whose server fails is sent to a second replica at once.  A get that finds
+// a manifest fetches the chunks it names, unless "manifest" asks for the
+// manifest itself, in which case *manifest says whether it found one.
+struct pending_get : public pending
+{
+    pending_get(int64_t i, pocdb_returncode* s, const e::slice& k, char** v, size_t* v_sz,
+                bool* _manifest = NULL)
+        : pending(i, s), key(k.str()), val(v), val_sz(v_sz), manifest(_manifest)
+        , began(), host(), hedge_host(), lost(), chunks() {}
+
+    virtual bool start(pocdb_client* cl)
+    {
+        began = po6::monotonic_time();
+        host = cl->next_host(key_slot(e::slice(key)));
+        if (cl->hedging) cl->arm(this, cl->hedge_delay);
+        return ask(cl, host);
+    }
+
+    bool ask(pocdb_client* cl, uint64_t server)
+    {
+        const e::slice k(key);
+        const size_t sz = BUSYBEE_HEADER_SIZE
+                        + 1 + sizeof(uint64_t)
+                        + pack_size(k);
+        std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('G') << cl->route(this) << k;
+        return cl->send(server, msg);
+    }
+
+    bool hedge(pocdb_client* cl)
+    {
+        if (hedge_host) return true;
+        hedge_host = cl->next_host(key_slot(e::slice(key)), host);
+        return ask(cl, hedge_host);
+    }
+
+    virtual bool handle(pocdb_client* cl, uint64_t server, e::unpacker up)
+    {
+        pocdb_returncode rc;
+
+        if (chunks.active())
+        {
+            return chunks.handle(cl, this, server, up, &rc) &&
+                   finish_chunks(rc, status, val, val_sz);
+        }
+
+        e::slice v;
+        up = up >> e::unpack_uint8<pocdb_returncode>(rc);
+        if (up.error() || rc != POCDB_BUSY) up = up >> v;
+        cl->record_get(po6::monotonic_time() - began);
+        const bool chunked = !up.error() && rc == POCDB_SUCCESS && cl->tagged && is_manifest(v);
+        if (manifest) *manifest = chunked;
+
+        if (chunked && !manifest)
+        {
+            return !start_chunks(cl, this, key, v, &chunks, status, val, val_sz);
+        }
+
+        *status = up.error() ? POCDB_SERVER_ERROR
+                : rc != POCDB_SUCCESS ? rc
+                : chunked ? copy_value(v, val, val_sz)
+                : decode_value(v, cl->tagged, val, val_sz);
+        return true;
+    }
+
+    virtual bool disrupted(pocdb_client* cl, uint64_t server)
+    {
+        if (chunks.active())
+        {
+            pocdb_returncode rc;
+            return chunks.disrupted(cl, this, server, &rc) &&
+                   finish_chunks(rc, status, val, val_sz);
+        }
+
+        if (server != host && server != hedge_host) return false;
+        // the get fails only once every server it was sent to has
+        if (++lost == 1 && hedge(cl)) return false;
+        *status = POCDB_SERVER_ERROR;
+        return true;
+    }
+
+    virtual bool expired(pocdb_client* cl)
+    {
+        // the first server may yet answer, so a failed hedge is no failure
+        if (!chunks.active()) hedge(cl);
+        return false;
+    }
+
+    const std::string key;
+    char** const val;
+    size_t* const val_sz;
+    bool* const manifest;
+    uint64_t began;
+    uint64_t host;
+    uint64_t hedge_host;
+    unsigned lost;
+    chunk_fetch chunks;
+};
+
+// Asks one replica to answer from what it has learned, which it does if it
+// holds the slot's read lease.  Otherwise, probes a quorum for the newest
+// learned version.  If the quorum disagrees or has a write in flight, a
+// server completes the write (a read repair) and reports the first version
+// that may not yet be chosen.  As with pending_get, "manifest" asks for a
+// manifest itself rather than the chunks it names.
+struct pending_get_consistent : public pending
+{
+    pending_get_consistent(int64_t i, pocdb_returncode* s, const e::slice& k, char** v, size_t* v_sz,
+                           bool* _manifest = NULL)
+        : pending(i, s), key(k.str()), val(v), val_sz(v_sz), manifest(_manifest), slot(key_slot(k))
+        , start_host(), attempt(), leasing(), repairing(), repair_host()
+        , replies(), agree(), in_flight(), newest_host()
+        , newest_rc(), newest_ver(), newest_val(), chunks() {}
+
+    virtual bool start(pocdb_client* cl)
+    {
+        // both the lease holder asked and the quorum probed start from the
+        // replica expected to answer first
+        start_host = cl->next_replica(slot);
+        const e::slice k(key);
+        const size_t sz = BUSYBEE_HEADER_SIZE
+                        + 1 + sizeof(uint64_t)
+                        + pack_size(k);
+        std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('Y') << cl->route(this) << k;
+        leasing = true;
+        return cl->send(replica(0), msg);
+    }
+
+    bool probe(pocdb_client* cl)
+    {
+        const e::slice k(key);
+        const size_t sz = BUSYBEE_HEADER_SIZE
+                        + 1 + sizeof(uint64_t)
+                        + pack_size(k);
+        const uint64_t n = cl->route(this);
+        repairing = false;
+        replies = 0;
+        agree = true;
+        in_flight = false;
+        newest_host = replica(0);
+        newest_rc = POCDB_NOT_FOUND;
+        newest_ver = 0;
+        newest_val.clear();
+
+        for (unsigned i = 0; i < QUORUM; ++i)
+        {
+            std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
+            msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('g') << n << k;
+            if (!cl->send(replica(i), msg)) return false;
+        }
+
+        return true;
+    }
+
+    // the i'th replica probed by this attempt
+    uint64_t replica(unsigned i) const
+    {
+        return slot_replica(slot, (start_host + attempt + i) % REPLICAS);
+    }
+
+    bool repair(pocdb_client* cl)
+    {
+        const e::slice k(key);
+        const size_t sz = BUSYBEE_HEADER_SIZE
+                        + 1 + sizeof(uint64_t)
+                        + pack_size(k);
+        std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('C') << cl->route(this) << k;
+        repairing = true;
+        repair_host = newest_host;
+        return cl->send(repair_host, msg);
+    }
+
+    bool fail(pocdb_returncode rc)
+    {
+        *status = rc;
+        return true;
+    }
+
+    bool done(pocdb_client* cl, const e::slice& v)
+    {
+        const bool chunked = cl->tagged && is_manifest(v);
+        if (manifest) *manifest = chunked;
+
+        // the chunks were stored before the manifest was, so any replica's
+        // copy of one is as consistent as the manifest
+        if (chunked && !manifest)
+        {
+            return !start_chunks(cl, this, key, v, &chunks, status, val, val_sz);
+        }
+
+        *status = chunked ? copy_value(v, val, val_sz) : decode_value(v, cl->tagged, val, val_sz);
+        return true;
+    }
+
+    virtual bool handle(pocdb_client* cl, uint64_t server, e::unpacker up)
+    {
+        if (chunks.active())
+        {
+            pocdb_returncode rc;
+            return chunks.handle(cl, this, server, up, &rc) &&
+                   finish_chunks(rc, status, val, val_sz);
+        }
+
+        if (leasing) return handle_lease(cl, up);
+        return repairing ? handle_repair(cl, up) : handle_probe(cl, server, up);
+    }
+
+    bool handle_lease(pocdb_client* cl, e::unpacker up)
+    {
+        pocdb_returncode rc;
+        uint8_t leased;
+        e::slice v;
+        up = up >> e::unpack_uint8<pocdb_returncode>(rc);
+        if (!up.error() && rc == POCDB_BUSY) return fail(rc);
+        up = up >> leased >> v;
+        if (up.error()) return fail(POCDB_SERVER_ERROR);
+        leasing = false;
+
+        if (leased)
+        {
+            if (rc != POCDB_SUCCESS) return fail(rc);
+            return done(cl, v);
+        }
+
+        // the replica holds no lease, though it has asked for one by now
+        return probe(cl) ? false : fail(POCDB_SERVER_ERROR);
+    }
+
+    bool handle_probe(pocdb_client* cl, uint64_t server, e::unpacker up)
+    {
+        pocdb_returncode rc;
+        uint64_t ver;
+        uint8_t p;
+        e::slice v;
+        up = up >> e::unpack_uint8<pocdb_returncode>(rc);
+        if (!up.error() && rc == POCDB_BUSY) return fail(rc);
+        up = up >> ver >> p >> v;
+        if (up.error()) return fail(POCDB_SERVER_ERROR);
+        if (rc != POCDB_SUCCESS && rc != POCDB_NOT_FOUND) return fail(rc);
+
+        if (replies > 0 && (rc != newest_rc || ver != newest_ver))
+        {
+            agree = false;
+        }
+
+        if (replies == 0 ||
+            (rc == POCDB_SUCCESS && (newest_rc != POCDB_SUCCESS || ver > newest_ver)))
+        {
+            newest_host = server;
+            newest_rc = rc;
+            newest_ver = ver;
+            newest_val.assign(v.cdata(), v.size());
+        }
+
+        in_flight = in_flight || p;
+
+        if (++replies < QUORUM)
+        {
+            return false;
+        }
+
+        // every replica in the quorum learned the same version and none has
+        // a write in flight, so no completed put can be newer
+        if (agree && !in_flight)
+        {
+            if (newest_rc != POCDB_SUCCESS) return fail(newest_rc);
+            return done(cl, e::slice(newest_val));
+        }
+
+        return repair(cl) ? false : fail(POCDB_SERVER_ERROR);
+    }
+
+    bool handle_repair(pocdb_client* cl, e::unpacker up)
+    {
+        pocdb_returncode rc;
+        uint64_t next;
+        uint64_t ver;
+        e::slice v;
+        up = up >> e::unpack_uint8<pocdb_returncode>(rc);
+        if (!up.error() && rc == POCDB_BUSY) return fail(rc);
+        up = up >> next >> ver >> v;
+        if (up.error()) return fail(POCDB_SERVER_ERROR);
+        if (rc != POCDB_SUCCESS && rc != POCDB_NOT_FOUND) return fail(rc);
+
+        // versions before "next" are the only ones that may be chosen
+        if (rc == POCDB_NOT_FOUND && next == 0) return fail(POCDB_NOT_FOUND);
+        if (rc == POCDB_SUCCESS && ver + 1 >= next) return done(cl, v);
+        if (newest_rc == POCDB_SUCCESS && newest_ver + 1 >= next) return done(cl, e::slice(newest_val));
+
+        // the server we asked missed the newest version; ask elsewhere
+        if (++attempt >= REPLICAS) return fail(POCDB_SERVER_ERROR);
+        return probe(cl) ? false : fail(POCDB_SERVER_ERROR);
+    }
+
+    virtual bool disrupted(pocdb_client* cl, uint64_t server)
+    {
+        if (chunks.active())
+        {
+            pocdb_returncode rc;
+            return chunks.disrupted(cl, this, server, &rc) &&
+                   finish_chunks(rc, status, val, val_sz);
+        }
+
+        bool waiting = (repairing && server == repair_host) ||
+                       (leasing && server == replica(0));
+
+        for (unsigned i = 0; !leasing && !repairing && i < QUORUM; ++i)
+        {
+            waiting = waiting || replica(i) == server;
+        }
+
+        if (!waiting) return false;
+        *status = POCDB_SERVER_ERROR;
+        return true;
+    }
+
+    const std::string key;
+    char** const val;
+    size_t* const val_sz;
+    bool* const manifest;
+    const unsigned slot;
+    unsigned start_host;
+    unsigned attempt;
+    bool leasing;
+    bool repairing;
+    uint64_t repair_host;
+    unsigned replies;
+    bool agree;
+    bool in_flight;
+    uint64_t newest_host;
+    pocdb_returncode newest_rc;
+    uint64_t newest_ver;
+    std::string newest_val;
+    chunk_fetch chunks;
+};
+
+// Puts each chunk, CHUNK_WINDOW at a time, then gets the key consistently to
+// find the manifest it replaces, and then puts the manifest.  Once the
+// manifest is
+// chosen, the chunks of the value it replaced are retired:  each is put
+// empty, which frees its bytes while keeping its key, so that anti-entropy
+// cannot bring it back, and a reader still streaming that value fails.  A
+// put that fails before its manifest is sent, or whose manifest the server
+// refuses, retires its own chunks once those in flight are answered.  A put
+// whose manifest's server fails cannot know the outcome, and leaves its
+// chunks; so does a put whose get failed, or that raced another put of the
+// same key between its get and its manifest.
+struct pending_put_chunked : public pending
+{
+    enum phase_t { CHUNKS, DRAIN, LOOKUP, MANIFEST, RETIRE };
+
+    pending_put_chunked(int64_t i, pocdb_returncode* s, const e::slice& k, const e::slice& v,
+                        size_t compress_min, uint64_t id)
+        : pending(i, s), key(k.str()), m(v.size(), id), msgs(), slots()
+        , phase(CHUNKS), sent(), acked(), in_flight(), asked(), asked_host()
+        , found_rc(), found_val(), found_sz(), found_manifest()
+        , finder(i, &found_rc, k, &found_val, &found_sz, &found_manifest)
+        , old(), retire_id(), retire_count(), retired()
+    {
+        // chunks are encoded, each on its own, as any other value
+        for (uint32_t c = 0; c < m.count; ++c)
+        {
+            const std::string ck(chunk_key(key, m.id, c));
+            std::string enc;
+            encode_value(e::slice(v.data() + uint64_t(c) * CHUNK_SIZE, m.chunk_size(c)),
+                         true, compress_min, &enc);
+            msgs.push_back(put_message(e::slice(ck), e::slice(enc)));
+            slots.push_back(key_slot(e::slice(ck)));
+        }
+    }
+
+    virtual ~pending_put_chunked() throw ()
+    {
+        for (size_t c = 0; c < msgs.size(); ++c)
+        {
+            delete msgs[c];
+        }
+
+        free(found_val);
+    }
+
+    static e::buffer* put_message(const e::slice& k, const e::slice& v)
+    {
+        const size_t sz = BUSYBEE_HEADER_SIZE
+                        + 1 + sizeof(uint64_t)
+                        + pack_size(k)
+                        + pack_size(v);
+        e::buffer* msg = e::buffer::create(sz);
+        // the nonce is filled in when sent
+        msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('P') << uint64_t(0) << k << v;
+        return msg;
+    }
+
+    virtual bool start(pocdb_client* cl)
+    {
+        while (sent < msgs.size() && sent < CHUNK_WINDOW)
+        {
+            if (send_chunk(cl)) continue;
+            // nothing is stored yet unless an earlier chunk went out, in
+            // which case the put fails once it can retire what was sent
+            if (in_flight.empty()) return false;
+            *status = POCDB_SERVER_ERROR;
+            phase = DRAIN;
+            return true;
+        }
+
+        return true;
+    }
+
+    bool send_chunk(pocdb_client* cl)
+    {
+        std::auto_ptr<e::buffer> msg(msgs[sent]);
+        msgs[sent] = NULL;
+        const uint64_t host = cl->next_host(slots[sent]);
+        ++sent;
+        msg->pack_at(BUSYBEE_HEADER_SIZE + 1) << cl->route(this);
+        if (!cl->send(host, msg)) return false;
+        in_flight.push_back(host);
+        return true;
+    }
+
+    // gets the key, or failing that, puts the manifest at once; the get's
+    // replies are routed to this operation, which hands them to "finder"
+    bool lookup(pocdb_client* cl)
+    {
+        phase = LOOKUP;
+        return finder.start(cl) ? false : looked_up(cl);
+    }
+
+    bool looked_up(pocdb_client* cl)
+    {
+        // replies to the get that come late must not reach later phases
+        for (size_t i = 0; i < finder.nonces.size(); ++i)
+        {
+            cl->routes.erase(finder.nonces[i]);
+        }
+
+        finder.nonces.clear();
+
+        if (found_rc != POCDB_SUCCESS || !found_manifest ||
+            !decode_manifest(e::slice(found_val, found_sz), &old) || old.id == m.id)
+        {
+            old = chunk_manifest();
+        }
+
+        free(found_val);
+        found_val = NULL;
+        return send_manifest(cl);
+    }
+
+    // true if the manifest could not be sent, whose outcome is then unknown
+    bool send_manifest(pocdb_client* cl)
+    {
+        std::string enc;
+        encode_manifest(m, &enc);
+        std::auto_ptr<e::buffer> msg(put_message(e::slice(key), e::slice(enc)));
+        phase = MANIFEST;
+        asked = cl->route(this);
+        asked_host = cl->next_host(key_slot(e::slice(key)));
+        msg->pack_at(BUSYBEE_HEADER_SIZE + 1) << asked;
+        if (cl->send(asked_host, msg)) return false;
+        *status = POCDB_SERVER_ERROR;
+        return true;
+    }
+
+    // the put failed with "rc" before its manifest was chosen
+    bool fail(pocdb_client* cl, pocdb_returncode rc)
+    {
+        *status = rc;
+        phase = DRAIN;
+        return drained(cl);
+    }
+
+    bool drained(pocdb_client* cl)
+    {
+        return in_flight.empty() && retire(cl, m.id, sent);
+    }
+
+    bool retire(pocdb_client* cl, uint64_t id, uint32_t count)
+    {
+        phase = RETIRE;
+        retire_id = id;
+        retire_count = count;
+        retired = 0;
+        return retire_next(cl);
+    }
+
+    // true once every chunk being retired is answered for
+    bool retire_next(pocdb_client* cl)
+    {
+        while (retired < retire_count && in_flight.size() < CHUNK_WINDOW)
+        {
+            const std::string ck(chunk_key(key, retire_id, retired++));
+            const uint64_t host = cl->next_host(key_slot(e::slice(ck)));
+            std::auto_ptr<e::buffer> msg(put_message(e::slice(ck), e::slice()));
+            msg->pack_at(BUSYBEE_HEADER_SIZE + 1) << cl->route(this);
+            if (cl->send(host, msg)) in_flight.push_back(host);
+        }
+
+        return in_flight.empty();
+    }
+
+    virtual bool handle(pocdb_client* cl, uint64_t server, e::unpacker up)
+    {
+        if (phase == LOOKUP)
+        {
+            return finder.handle(cl, server, up) && looked_up(cl);
+        }
+
+        pocdb_returncode rc;
+        up = up >> e::unpack_uint8<pocdb_returncode>(rc);
+        if (up.error()) rc = POCDB_SERVER_ERROR;
+
+        if (phase == MANIFEST)
+        {
+            // a late reply to a chunk put that was given up on
+            if (cl->replying != asked) return false;
+            return manifested(cl, rc);
+        }
+
+        std::vector<uint64_t>::iterator it = std::find(in_flight.begin(), in_flight.end(), server);
+        if (it != in_flight.end()) in_flight.erase(it);
+
+        // a chunk that failed to retire is left behind
+        if (phase == RETIRE) return retire_next(cl);
+        if (phase == DRAIN) return drained(cl);
+        if (rc != POCDB_SUCCESS) return fail(cl, rc);
+        ++acked;
+
+        if (sent < msgs.size())
+        {
+            return send_chunk(cl) ? false : fail(cl, POCDB_SERVER_ERROR);
+        }
+
+        return acked < msgs.size() ? false : lookup(cl);
+    }
+
+    bool manifested(pocdb_client* cl, pocdb_returncode rc)
+    {
+        // no key names chunks the server refused to name
+        if (rc != POCDB_SUCCESS) return fail(cl, rc);
+        *status = POCDB_SUCCESS;
+        return retire(cl, old.id, old.count);
+    }
+
+    virtual bool disrupted(pocdb_client* cl, uint64_t server)
+    {
+        if (phase == LOOKUP)
+        {
+            return finder.disrupted(cl, server) && looked_up(cl);
+        }
+
+        if (phase == MANIFEST && server == asked_host)
+        {
+            *status = POCDB_SERVER_ERROR;
+            return true;
+        }
+
+        const size_t before = in_flight.size();
+        in_flight.erase(std::remove(in_flight.begin(), in_flight.end(), server), in_flight.end());
+
+        if (in_flight.size() == before)
+        {
+            return false;
+        }
+
+        switch (phase)
+        {
+            case CHUNKS:
+                return fail(cl, POCDB_SERVER_ERROR);
+            case DRAIN:
+                return drained(cl);
+            case RETIRE:
+                return retire_next(cl);
+            case LOOKUP:
+            case MANIFEST:
+            default:
+                return false;
+        }
+    }
+
+    const std::string key;
+    const chunk_manifest m;
+    // chunk puts not yet sent, and the slots of their keys
+    std::vector<e::buffer*> msgs;
+    std::vector<unsigned> slots;
+    phase_t phase;
+    size_t sent;
+    size_t acked;
+    // servers with a chunk put outstanding
+    std::vector<uint64_t> in_flight;
+    // the nonce and server of the manifest put
+    uint64_t asked;
+    uint64_t asked_host;
+    // the consistent get of the key, and what it found
+    pocdb_returncode found_rc;
+    char* found_val;
+    size_t found_sz;
+    bool found_manifest;
+    pending_get_consistent finder;
+    // the manifest this put replaces, and the chunks being retired
+    chunk_manifest old;
+    uint64_t retire_id;
+    uint32_t retire_count;
+    uint32_t retired;
+};
+
+// a range of a chunked value's chunks, for a reader
+struct pending_chunks : public pending
+{
+    pending_chunks(int64_t i, pocdb_returncode* s, const std::string& k,
+                   const chunk_manifest& _m, uint32_t f, uint32_t l, char* o)
+        : pending(i, s), key(k), m(_m), first(f), last(l), out(o), chunks() {}
+
+    virtual bool start(pocdb_client* cl)
+    {
+        return chunks.start(cl, this, key, m, first, last, out);
+    }
+
+    virtual bool handle(pocdb_client* cl, uint64_t server, e::unpacker up)
+    {
+        return chunks.handle(cl, this, server, up, status);
+    }
+
+    virtual bool disrupted(pocdb_client* cl, uint64_t server)
+    {
+        return chunks.disrupted(cl, this, server, status);
+    }
+
+    const std::string key;
+    const chunk_manifest m;
+    const uint32_t first;
+    const uint32_t last;
+    char* const out;
+    chunk_fetch chunks;
+};
+
+struct pending_stats : public pending
+{
+    pending_stats(int64_t i, pocdb_returncode* s, uint64_t h, pocdb_stat** st, size_t* st_sz)
+        : pending(i, s), host(h), stats(st), stats_sz(st_sz) {}
+
+    virtual bool start(pocdb_client* cl)
+    {
+        const size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint64_t);
+        std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('S') << cl->route(this);
+        return cl->send(host, msg);
+    }
+
+    virtual bool handle(pocdb_client*, uint64_t, e::unpacker up)
+    {
+        pocdb_returncode rc;
+        uint32_t n = 0;
+        up = up >> e::unpack_uint8<pocdb_returncode>(rc);
+        if (up.error() || rc != POCDB_BUSY) up = up >> n;
+        std::vector<std::pair<e::slice, uint64_t> > all;
+        size_t names = 0;
+
+        for (uint32_t i = 0; !up.error() && i < n; ++i)
+        {
+            std::pair<e::slice, uint64_t> p;
+            up = up >> p.first >> p.second;
+            all.push_back(p);
+            names += p.first.size() + 1;
+        }
+
+        if (up.error() || rc != POCDB_SUCCESS)
+        {
+            *status = up.error() ? POCDB_SERVER_ERROR : rc;
+            return true;
+        }
+
+        // one block: the array, then every name it points to
+        char* block = (char*)malloc(all.size() * sizeof(pocdb_stat) + names);
+
+        if (!block)
+        {
+            *status = POCDB_SEE_ERRNO;
+            return true;
+        }
+
+        *stats = (pocdb_stat*)block;
+        *stats_sz = all.size();
+        char* name = block + all.size() * sizeof(pocdb_stat);
+
+        for (size_t i = 0; i < all.size(); ++i)
+        {
+            memcpy(name, all[i].first.data(), all[i].first.size());
+            name[all[i].first.size()] = '\0';
+            (*stats)[i].name = name;
+            (*stats)[i].value = all[i].second;
+            name += all[i].first.size() + 1;
+        }
+
+        *status = POCDB_SUCCESS;
+        return true;
+    }
+
+    virtual bool disrupted(pocdb_client*, uint64_t server)
+    {
+        if (server != host) return false;
+        *status = POCDB_SERVER_ERROR;
+        return true;
+    }
+
+    const uint64_t host;
+    pocdb_stat** const stats;
+    size_t* const stats_sz;
+};
+
+static pocdb_returncode
+wait_for(pocdb_client* client, int64_t id, pocdb_returncode* status)
+{
+    if (id < 0) return *status;
+    pocdb_returncode lrc;
+    if (client->loop(id, -1, &lrc) < 0) return lrc;
+    return *status;
+}
+
 pocdb_client* pocdb_create() { return new pocdb_client(); }
 void pocdb_destroy(pocdb_client* client) { delete client; }
+void pocdb_hedge_gets(pocdb_client* client, int enable) { client->hedging = enable != 0; }
+void pocdb_tag_values(pocdb_client* client, int enable) { client->tagged = enable != 0; }
+void pocdb_compress_values(pocdb_client* client, size_t min_size) { client->compress_min = min_size; }
+
+int64_t
+pocdb_async_put(pocdb_client* client,
+                const char* key, size_t key_sz,
+                const char* val, size_t val_sz,
+                pocdb_returncode* status)
+{
+    const e::slice k(key, key_sz);
+    const e::slice v(val, val_sz);
+
+    if (client->tagged && val_sz > CHUNK_SIZE)
+    {
+        return client->issue(new pending_put_chunked(client->next_id++, status, k, v,
+                                                     client->compress_min, client->chunk_id()));
+    }
+
+    return client->issue(new pending_put(client->next_id++, status, k, v,
+                                         client->tagged, client->compress_min));
+}
+
+int64_t
+pocdb_async_get(pocdb_client* client,
+                const char* key, size_t key_sz,
+                pocdb_returncode* status,
+                char** val, size_t* val_sz)
+{
+    const e::slice k(key, key_sz);
+    return client->issue(new pending_get(client->next_id++, status, k, val, val_sz));
+}
+
+int64_t
+pocdb_async_get_consistent(pocdb_client* client,
+                           const char* key, size_t key_sz,
+                           pocdb_returncode* status,
+                           char** val, size_t* val_sz)
+{
+    const e::slice k(key, key_sz);
+    return client->issue(new pending_get_consistent(client->next_id++, status, k, val, val_sz));
+}
+
+int64_t
+pocdb_loop(pocdb_client* client, int timeout, pocdb_returncode* status)
+{
+    return client->loop(-1, timeout, status);
+}
+
+int64_t
+pocdb_wait(pocdb_client* client, int64_t id, int timeout, pocdb_returncode* status)
+{
+    return client->loop(id, timeout, status);
+}
 
 pocdb_returncode
 pocdb_put(pocdb_client* client,
           const char* key, size_t key_sz,
           const char* val, size_t val_sz)
 {
-    const uint64_t host = HOSTS[client->reqno++ % NUM_HOSTS];
-    const e::slice k(key, key_sz);
-    const e::slice v(val, val_sz);
-    const size_t sz = BUSYBEE_HEADER_SIZE
-                    + 1
-                    + pack_size(k)
-                    + pack_size(v);
-    std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
-    msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('P') << k << v;
-    if (client->busybee->send(host, msg) != BUSYBEE_SUCCESS) return POCDB_SERVER_ERROR;
-
-    uint64_t resp;
-    if (client->busybee->recv(-1, &resp, &msg) != BUSYBEE_SUCCESS) return POCDB_SERVER_ERROR;
-    pocdb_returncode rc;
-    e::unpacker up = msg->unpack_from(BUSYBEE_HEADER_SIZE);
-    up = up >> e::unpack_uint8<pocdb_returncode>(rc);
-    return !up.error() ? rc : POCDB_SERVER_ERROR;
+    pocdb_returncode status;
+    int64_t id = pocdb_async_put(client, key, key_sz, val, val_sz, &status);
+    return wait_for(client, id, &status);
 }
 
 pocdb_returncode
@@ -83,25 +1779,283 @@ pocdb_get(pocdb_client* client,
           const char* key, size_t key_sz,
           char** val, size_t* val_sz)
 {
-    const uint64_t host = HOSTS[client->reqno++ % NUM_HOSTS];
-    const e::slice k(key, key_sz);
-    const size_t sz = BUSYBEE_HEADER_SIZE
-                    + 1
-                    + pack_size(k);
-    std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
-    msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('G') << k;
-    if (client->busybee->send(host, msg) != BUSYBEE_SUCCESS) return POCDB_SERVER_ERROR;
+    pocdb_returncode status;
+    int64_t id = pocdb_async_get(client, key, key_sz, &status, val, val_sz);
+    return wait_for(client, id, &status);
+}
 
-    uint64_t resp;
-    if (client->busybee->recv(-1, &resp, &msg) != BUSYBEE_SUCCESS) return POCDB_SERVER_ERROR;
-    pocdb_returncode rc;
-    e::slice v;
-    e::unpacker up = msg->unpack_from(BUSYBEE_HEADER_SIZE);
-    up = up >> e::unpack_uint8<pocdb_returncode>(rc) >> v;
-    if (up.error()) return POCDB_SERVER_ERROR;
-    if (rc != POCDB_SUCCESS) return rc;
-    *val_sz = v.size();
-    *val = v.size() ? (char*)malloc(v.size()) : (char*)NULL;
-    if (!*val && v.size()) return POCDB_SEE_ERRNO;
-    return !up.error() ? rc : POCDB_SERVER_ERROR;
+pocdb_returncode
+pocdb_get_consistent(pocdb_client* client,
+                     const char* key, size_t key_sz,
+                     char** val, size_t* val_sz)
+{
+    pocdb_returncode status;
+    int64_t id = pocdb_async_get_consistent(client, key, key_sz, &status, val, val_sz);
+    return wait_for(client, id, &status);
+}
+
+// Every request is issued before any is waited on, and all of them go to the
+// same server in one message, so the server handles them as one batch.
+static pocdb_returncode
+wait_all(pocdb_client* client, const std::vector<int64_t>& ids,
+         size_t n, pocdb_returncode* statuses)
+{
+    pocdb_returncode rc = POCDB_SUCCESS;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        pocdb_returncode lrc;
+
+        if (ids[i] >= 0 && rc == POCDB_SUCCESS &&
+            client->loop(ids[i], -1, &lrc) < 0)
+        {
+            rc = lrc;
+        }
+
+        if (ids[i] >= 0 && rc != POCDB_SUCCESS)
+        {
+            statuses[i] = rc;
+        }
+    }
+
+    return rc;
+}
+
+pocdb_returncode
+pocdb_multi_put(pocdb_client* client, size_t n,
+                const char* const* keys, const size_t* key_szs,
+                const char* const* vals, const size_t* val_szs,
+                pocdb_returncode* statuses)
+{
+    std::vector<int64_t> ids(n);
+    client->begin_batch();
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        ids[i] = pocdb_async_put(client, keys[i], key_szs[i],
+                                 vals[i], val_szs[i], &statuses[i]);
+    }
+
+    client->end_batch();
+    return wait_all(client, ids, n, statuses);
+}
+
+pocdb_returncode
+pocdb_multi_get(pocdb_client* client, size_t n,
+                const char* const* keys, const size_t* key_szs,
+                pocdb_returncode* statuses,
+                char** vals, size_t* val_szs)
+{
+    std::vector<int64_t> ids(n);
+    client->begin_batch();
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        ids[i] = pocdb_async_get(client, keys[i], key_szs[i],
+                                 &statuses[i], &vals[i], &val_szs[i]);
+    }
+
+    client->end_batch();
+    return wait_all(client, ids, n, statuses);
+}
+
+pocdb_returncode
+pocdb_stats(pocdb_client* client, const char* server,
+            pocdb_stat** stats, size_t* stats_sz)
+{
+    *stats = NULL;
+    *stats_sz = 0;
+
+    if (!server || server[0] < 'A' || server[0] >= char('A' + NUM_HOSTS) || server[1])
+    {
+        errno = EINVAL;
+        return POCDB_SEE_ERRNO;
+    }
+
+    pocdb_returncode status;
+    const uint64_t host = HOSTS[server[0] - 'A'];
+    int64_t id = client->issue(new pending_stats(client->next_id++, &status, host, stats, stats_sz));
+    return wait_for(client, id, &status);
+}
+
+// A reader holds at most two chunks:  the one being read, and the next one,
+// fetched while the caller consumes the first.  A value that is not chunked
+// is read from a single get.
+struct pocdb_reader
+{
+    pocdb_reader(pocdb_client* cl, const e::slice& k);
+    ~pocdb_reader() throw ();
+
+    // begin fetching the next chunk into "ahead"
+    bool prefetch(pocdb_returncode* status);
+
+    pocdb_client* const client;
+    const std::string key;
+    bool chunked;
+    chunk_manifest m;
+    // all of an unchunked value, or the chunk being read
+    char* current;
+    size_t current_sz;
+    size_t offset;
+    // the chunk requests go out for next, and the one fetching into "ahead"
+    uint32_t next_chunk;
+    int64_t ahead_id;
+    pocdb_returncode ahead_status;
+    std::vector<char> ahead;
+    // chunks are read into this buffer and "ahead" in turn
+    std::vector<char> spare;
+
+    private:
+        pocdb_reader(const pocdb_reader&);
+        pocdb_reader& operator = (const pocdb_reader&);
+};
+
+pocdb_reader :: pocdb_reader(pocdb_client* cl, const e::slice& k)
+    : client(cl)
+    , key(k.str())
+    , chunked(false)
+    , m()
+    , current(NULL)
+    , current_sz(0)
+    , offset(0)
+    , next_chunk(0)
+    , ahead_id(-1)
+    , ahead_status(POCDB_SUCCESS)
+    , ahead()
+    , spare()
+{
+}
+
+pocdb_reader :: ~pocdb_reader() throw ()
+{
+    pocdb_returncode lrc;
+
+    // the fetch writes into "ahead", so it must finish first
+    if (ahead_id >= 0)
+    {
+        client->loop(ahead_id, -1, &lrc);
+    }
+
+    if (!chunked)
+    {
+        free(current);
+    }
+}
+
+bool
+pocdb_reader :: prefetch(pocdb_returncode* status)
+{
+    if (next_chunk >= m.count)
+    {
+        return true;
+    }
+
+    ahead.resize(m.chunk_size(next_chunk));
+    pending* p = new pending_chunks(client->next_id++, &ahead_status, key, m,
+                                    next_chunk, next_chunk + 1, &ahead[0]);
+    p->internal = true;
+    ahead_id = client->issue(p);
+
+    if (ahead_id < 0)
+    {
+        *status = ahead_status;
+        return false;
+    }
+
+    ++next_chunk;
+    return true;
+}
+
+pocdb_reader*
+pocdb_reader_open(pocdb_client* client,
+                  const char* key, size_t key_sz,
+                  pocdb_returncode* status)
+{
+    std::auto_ptr<pocdb_reader> r(new pocdb_reader(client, e::slice(key, key_sz)));
+    char* val = NULL;
+    size_t val_sz = 0;
+    int64_t id = client->issue(new pending_get(client->next_id++, status,
+                                               e::slice(key, key_sz), &val, &val_sz,
+                                               &r->chunked));
+
+    if (wait_for(client, id, status) != POCDB_SUCCESS)
+    {
+        return NULL;
+    }
+
+    if (!r->chunked)
+    {
+        r->current = val;
+        r->current_sz = val_sz;
+        return r.release();
+    }
+
+    const bool ok = decode_manifest(e::slice(val, val_sz), &r->m);
+    free(val);
+
+    if (!ok)
+    {
+        *status = POCDB_SERVER_ERROR;
+        return NULL;
+    }
+
+    return r->prefetch(status) ? r.release() : NULL;
+}
+
+uint64_t
+pocdb_reader_size(pocdb_reader* reader)
+{
+    return reader->chunked ? reader->m.size : reader->current_sz;
+}
+
+int64_t
+pocdb_reader_read(pocdb_reader* reader, char* buf, size_t buf_sz,
+                  pocdb_returncode* status)
+{
+    *status = POCDB_SUCCESS;
+
+    if (reader->offset == reader->current_sz && reader->ahead_id >= 0)
+    {
+        pocdb_returncode lrc;
+        const int64_t id = reader->ahead_id;
+        reader->ahead_id = -1;
+
+        if (reader->client->loop(id, -1, &lrc) < 0)
+        {
+            *status = lrc;
+            return -1;
+        }
+
+        if (reader->ahead_status != POCDB_SUCCESS)
+        {
+            *status = reader->ahead_status;
+            return -1;
+        }
+
+        reader->spare.swap(reader->ahead);
+        reader->current = &reader->spare[0];
+        reader->current_sz = reader->spare.size();
+        reader->offset = 0;
+
+        if (!reader->prefetch(status))
+        {
+            return -1;
+        }
+    }
+
+    const size_t n = std::min(buf_sz, reader->current_sz - reader->offset);
+
+    if (n > 0)
+    {
+        memcpy(buf, reader->current + reader->offset, n);
+    }
+
+    reader->offset += n;
+    return n;
+}
+
+void
+pocdb_reader_close(pocdb_reader* reader)
+{
+    delete reader;
 }
@@ -28,6 +28,15 @@
 #ifndef pocdb_common_h_
 #define pocdb_common_h_
 
+// STL
+#include <list>
+#include <map>
+#include <memory>
+
+// e
+#include <e/buffer.h>
+#include <e/slice.h>
+
 // BusyBee
 #include <busybee.h>
 
@@ -37,9 +46,102 @@
 #define HOSTD (0xdefec8edULL << 32)
 #define HOSTE (0xcafebabeULL << 32)
 #define NUM_HOSTS 5
-#define QUORUM (NUM_HOSTS / 2 + 1)
 
-uint64_t HOSTS[] = { HOSTA, HOSTB, HOSTC, HOSTD, HOSTE };
+static const uint64_t HOSTS[] = { HOSTA, HOSTB, HOSTC, HOSTD, HOSTE };
+
+// Keys hash onto NUM_SLOTS slots.  A slot is replicated on REPLICAS hosts,
+// the ones following its position in HOSTS, and only those hosts run Paxos
+// for its keys.  Growing the cluster therefore spreads slots out, rather than
+// adding one more replica of everything.
+#define REPLICAS 3
+#define QUORUM (REPLICAS / 2 + 1)
+#define NUM_SLOTS 1024
+
+typedef char replicas_must_fit_in_cluster[REPLICAS <= NUM_HOSTS ? 1 : -1];
+
+// FNV-1a
+inline uint64_t
+key_hash(const e::slice& k)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < k.size(); ++i)
+    {
+        h ^= k.data()[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+// for callers that already hashed the key
+inline unsigned
+hash_slot(uint64_t h)
+{
+    return h % NUM_SLOTS;
+}
+
+inline unsigned
+key_slot(const e::slice& k)
+{
+    return hash_slot(key_hash(k));
+}
+
+// the i'th of REPLICAS replicas of "slot"
+inline uint64_t
+slot_replica(unsigned slot, unsigned i)
+{
+    return HOSTS[(slot + i) % NUM_HOSTS];
+}
+
+inline bool
+is_replica(unsigned slot, uint64_t host)
+{
+    for (unsigned i = 0; i < REPLICAS; ++i)
+    {
+        if (slot_replica(slot, i) == host)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// the i for which slot_replica(slot, i) is "host", or REPLICAS if none is
+inline unsigned
+replica_index(unsigned slot, uint64_t host)
+{
+    unsigned i = 0;
+
+    while (i < REPLICAS && slot_replica(slot, i) != host)
+    {
+        ++i;
+    }
+
+    return i;
+}
+
+// Messages bound for the same destination travel together in an envelope.
+// Peers see an envelope as message type 'X'; clients, as a reply whose nonce
+// is BATCH_NONCE.  Each enclosed message is a slice holding everything after
+// its busybee header.
+#define BATCH_NONCE 0xffffffffffffffffULL
+#define BATCH_MAX_SIZE (1U << 20)
+
+inline bool
+is_host(uint64_t id)
+{
+    for (unsigned i = 0; i < NUM_HOSTS; ++i)
+    {
+        if (HOSTS[i] == id)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
 
 class controller : public busybee_controller
 {
@@ -64,4 +166,107 @@ class controller : public busybee_controller
         }
 };
 
+// where an outbox gets its envelopes, and returns the messages they enclose
+inline e::buffer* create_buffer(size_t sz) { return e::buffer::create(sz); }
+inline void delete_buffer(e::buffer* b) { delete b; }
+
+struct outbox
+{
+    outbox(e::buffer* (*a)(size_t) = create_buffer, void (*r)(e::buffer*) = delete_buffer)
+        : acquire(a), release(r), queued() {}
+    ~outbox() throw ();
+
+    bool empty() const { return queued.empty(); }
+    void add(uint64_t to, std::auto_ptr<e::buffer> msg);
+    // the next message to send; an envelope whenever several can share one
+    bool next(uint64_t* to, std::auto_ptr<e::buffer>* msg);
+
+    e::buffer* (*const acquire)(size_t);
+    void (*const release)(e::buffer*);
+    typedef std::map<uint64_t, std::list<e::buffer*> > queue_map_t;
+    queue_map_t queued;
+
+    private:
+        outbox(const outbox&);
+        outbox& operator = (const outbox&);
+};
+
+inline
+outbox :: ~outbox() throw ()
+{
+    for (queue_map_t::iterator it = queued.begin(); it != queued.end(); ++it)
+    {
+        for (std::list<e::buffer*>::iterator b = it->second.begin();
+                b != it->second.end(); ++b)
+        {
+            release(*b);
+        }
+    }
+}
+
+inline void
+outbox :: add(uint64_t to, std::auto_ptr<e::buffer> msg)
+{
+    queued[to].push_back(msg.release());
+}
+
+inline bool
+outbox :: next(uint64_t* to, std::auto_ptr<e::buffer>* msg)
+{
+    if (queued.empty())
+    {
+        return false;
+    }
+
+    queue_map_t::iterator it = queued.begin();
+    std::list<e::buffer*>& q(it->second);
+    *to = it->first;
+    const size_t header = is_host(*to) ? 1 : sizeof(uint64_t);
+    size_t sz = BUSYBEE_HEADER_SIZE + header + sizeof(uint32_t);
+    uint32_t count = 0;
+
+    for (std::list<e::buffer*>::iterator b = q.begin(); b != q.end(); ++b)
+    {
+        const size_t body = pack_size(e::slice((*b)->data() + BUSYBEE_HEADER_SIZE,
+                                               (*b)->size() - BUSYBEE_HEADER_SIZE));
+
+        if (count > 0 && sz + body > BATCH_MAX_SIZE)
+        {
+            break;
+        }
+
+        sz += body;
+        ++count;
+    }
+
+    if (count == 1)
+    {
+        msg->reset(q.front());
+        q.pop_front();
+    }
+    else
+    {
+        msg->reset(acquire(sz));
+        e::packer pa = (*msg)->pack_at(BUSYBEE_HEADER_SIZE);
+        pa = header == 1 ? pa << uint8_t('X') : pa << uint64_t(BATCH_NONCE);
+        pa = pa << count;
+
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            e::buffer* b = q.front();
+            q.pop_front();
+            pa = pa << e::slice(b->data() + BUSYBEE_HEADER_SIZE,
+                                b->size() - BUSYBEE_HEADER_SIZE);
+            release(b);
+        }
+    }
+
+    if (q.empty())
+    {
+        queued.erase(it);
+    }
+
+    return true;
+}
+
 #endif // pocdb_common_h_
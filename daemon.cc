@@ -0,0 +1,3704 @@
+// Copyright (c) 2017, Robert Escriva
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of pocdb nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// POSIX
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+// Google Log
+#include <glog/raw_logging.h>
+
+// e
+#include <e/daemon.h>
+#include <e/guard.h>
+#include <e/strescape.h>
+
+// pocdb
+#include "daemon.h"
+
+int
+tagged_key_comparator :: Compare(const leveldb::Slice& a, const leveldb::Slice& b) const
+{
+    const size_t a_sz = a.size() > 0 ? a.size() - 1 : 0;
+    const size_t b_sz = b.size() > 0 ? b.size() - 1 : 0;
+    const int cmp = memcmp(a.data(), b.data(), std::min(a_sz, b_sz));
+
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    else if (a_sz != b_sz)
+    {
+        return a_sz < b_sz ? -1 : 1;
+    }
+    else if (a.size() == 0 || b.size() == 0)
+    {
+        return int(a.size()) - int(b.size());
+    }
+
+    return int(uint8_t(a[a_sz])) - int(uint8_t(b[b_sz]));
+}
+
+#define BUFFER_POOL_CLASSES 15
+#define BUFFER_POOL_DEPTH 16
+
+// Per-thread free lists of message buffers, by power-of-two capacity from 64
+// bytes up.  busybee frees what it sends, so the pool is stocked by received
+// messages, which come back here once their last reference goes away.  Only
+// threads that handle messages keep a pool; the flusher, timer, tracer and
+// anti-entropy threads would only collect buffers they never reuse, so what
+// they release goes back to the allocator.
+static __thread bool s_pooling = false;
+static __thread e::buffer* s_pool[BUFFER_POOL_CLASSES][BUFFER_POOL_DEPTH];
+static __thread size_t s_pool_sz[BUFFER_POOL_CLASSES];
+
+static size_t
+pool_class(size_t sz)
+{
+    size_t c = 0;
+
+    while (c + 1 < BUFFER_POOL_CLASSES && (size_t(64) << (c + 1)) <= sz)
+    {
+        ++c;
+    }
+
+    return c;
+}
+
+e::buffer*
+acquire_buffer(size_t sz)
+{
+    const size_t c = pool_class(sz);
+
+    // the next class up always fits; this class fits only some of the time
+    for (size_t i = c; i < c + 2 && i < BUFFER_POOL_CLASSES; ++i)
+    {
+        if (s_pool_sz[i] > 0 && s_pool[i][s_pool_sz[i] - 1]->capacity() >= sz)
+        {
+            e::buffer* b = s_pool[i][--s_pool_sz[i]];
+            b->resize(sz);
+            return b;
+        }
+    }
+
+    return e::buffer::create(sz);
+}
+
+void
+release_buffer(e::buffer* b)
+{
+    const size_t cap = b->capacity();
+    const size_t c = pool_class(cap);
+
+    if (!s_pooling || cap < 64 || cap >= (size_t(64) << BUFFER_POOL_CLASSES) ||
+        s_pool_sz[c] >= BUFFER_POOL_DEPTH)
+    {
+        delete b;
+        return;
+    }
+
+    s_pool[c][s_pool_sz[c]++] = b;
+}
+
+void
+start_buffer_pool()
+{
+    s_pooling = true;
+}
+
+void
+stop_buffer_pool()
+{
+    s_pooling = false;
+
+    for (size_t c = 0; c < BUFFER_POOL_CLASSES; ++c)
+    {
+        while (s_pool_sz[c] > 0)
+        {
+            delete s_pool[c][--s_pool_sz[c]];
+        }
+    }
+}
+
+uint32_t s_interrupts = 0;
+__thread outbox* s_outbox = NULL;
+// set while handling a client message the scheduler had no room for; every
+// request in it is refused as busy
+static __thread bool s_refusing = false;
+
+// true for the messages clients send; the rest drive Paxos, leases and
+// anti-entropy, and are taken only from other hosts
+static bool
+from_clients(uint8_t type)
+{
+    switch (type)
+    {
+        case uint8_t('X'):
+        case uint8_t('P'):
+        case uint8_t('G'):
+        case uint8_t('g'):
+        case uint8_t('C'):
+        case uint8_t('Y'):
+        case uint8_t('S'):
+            return true;
+        default:
+            return false;
+    }
+}
+
+// the number of puts in a client's message, which is what its rate limit
+// counts
+static uint64_t
+puts_in(const buffer_ref& msg)
+{
+    e::unpacker up(msg->unpack_from(BUSYBEE_HEADER_SIZE));
+    uint8_t type;
+    uint32_t count;
+    up = up >> type;
+
+    if (up.error() || type == uint8_t('P'))
+    {
+        return up.error() ? 0 : 1;
+    }
+    else if (type != uint8_t('X') || (up = up >> count).error())
+    {
+        return 0;
+    }
+
+    uint64_t puts = 0;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        e::slice m;
+        up = up >> m;
+
+        if (up.error())
+        {
+            break;
+        }
+
+        puts += m.size() > 0 && m.data()[0] == 'P' ? 1 : 0;
+    }
+
+    return puts;
+}
+
+static void
+exit_on_signal(int /*signum*/)
+{
+    RAW_LOG(ERROR, "interrupted: exiting");
+    e::atomic::increment_32_nobarrier(&s_interrupts, 1);
+}
+
+class busybee_transport : public transport
+{
+    public:
+        busybee_transport(busybee_server* b) : bb(b) {}
+        virtual ~busybee_transport() throw () {}
+
+    public:
+        virtual void send(uint64_t to, std::auto_ptr<e::buffer> msg)
+        { bb->send(to, msg); }
+        virtual busybee_returncode recv(e::garbage_collector::thread_state* ts, int timeout,
+                                        uint64_t* from, std::auto_ptr<e::buffer>* msg)
+        { return bb->recv(ts, timeout, from, msg); }
+
+    private:
+        busybee_server* bb;
+};
+
+pocdaemon :: pocdaemon(uint64_t h, const daemon_options& opts)
+    : host(h)
+    , stable_ballots(opts.stable_ballots)
+    , coalesce(opts.coalesce)
+    , max_queued(opts.max_queued)
+    , queued_bytes(0)
+    , retry_backoff(opts.retry_backoff)
+    , gc()
+    , control()
+    , busybee()
+    , busybee_net()
+    , net(NULL)
+    , stopping(0)
+    , comparator()
+    , db(NULL)
+    , learned_db(NULL)
+    , commit(this, opts.commit_delay, opts.commit_batch)
+    , trace(opts.trace_sample, opts.trace_values)
+    , ae(this, opts.ae_interval, opts.ae_rate)
+    , learned(opts.cache_bytes)
+    , stats()
+    , write_shards()
+    , timers(this)
+    , leases(this, opts.lease_term, opts.lease_skew)
+    , sched(this, opts.client_rate, opts.client_burst, opts.client_queue)
+    , acceptor_locks()
+    , threads()
+{
+    for (size_t i = 0; i < WRITE_MAP_SHARDS; ++i)
+    {
+        void* mem = NULL;
+
+        if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(write_shard)) != 0)
+        {
+            throw std::bad_alloc();
+        }
+
+        write_shards[i] = new (mem) write_shard(&gc);
+    }
+}
+
+pocdaemon :: ~pocdaemon() throw ()
+{
+    for (size_t i = 0; i < WRITE_MAP_SHARDS; ++i)
+    {
+        write_shards[i]->~write_shard();
+        free(write_shards[i]);
+    }
+}
+
+pocdaemon::write_map_t&
+pocdaemon :: write_map(uint64_t h)
+{
+    // the low bits pick the slot, so the high bits pick the shard
+    return write_shards[(h >> 32) % WRITE_MAP_SHARDS]->map;
+}
+
+bool
+pocdaemon :: open_store(const store_config& cfg, const char* path, int files, leveldb::DB** store)
+{
+    leveldb::Options opts;
+    opts.comparator = &comparator;
+    opts.create_if_missing = true;
+    opts.write_buffer_size = size_t(cfg.write_buffer) << 20;
+    opts.block_size = size_t(cfg.block_size) << 10;
+    opts.compression = strcmp(cfg.compression, "none") == 0
+                     ? leveldb::kNoCompression : leveldb::kSnappyCompression;
+    opts.max_open_files = files;
+
+    // both live as long as the process does, as the store does
+    if (cfg.bloom_bits > 0)
+    {
+        opts.filter_policy = leveldb::NewBloomFilterPolicy(cfg.bloom_bits);
+    }
+
+    if (cfg.block_cache > 0)
+    {
+        opts.block_cache = leveldb::NewLRUCache(size_t(cfg.block_cache) << 20);
+    }
+
+    leveldb::Status st = leveldb::DB::Open(opts, path, store);
+
+    if (!st.ok() && st.ToString().find("does not match existing comparator") != std::string::npos)
+    {
+        LOG(ERROR) << "\"" << path << "\" holds a store written by a pocdb from before "
+                   << "record format " << RECORD_FORMAT << ", which this pocdb cannot read; "
+                   << "move it aside and start from an empty directory";
+        return false;
+    }
+    else if (!st.ok())
+    {
+        LOG(ERROR) << "could not open leveldb in \"" << path << "\": " << st.ToString();
+        return false;
+    }
+
+    return check_format(*store, path);
+}
+
+bool
+pocdaemon :: check_format(leveldb::DB* store, const char* path)
+{
+    const std::string key(record_key(e::slice(), FORMAT_TAG));
+    std::string rec;
+    leveldb::Status st = store->Get(leveldb::ReadOptions(), key, &rec);
+
+    if (st.ok() && rec.size() == 1 && uint8_t(rec[0]) == RECORD_FORMAT)
+    {
+        return true;
+    }
+    else if (st.ok())
+    {
+        LOG(ERROR) << "\"" << path << "\" holds records in format "
+                   << (rec.size() == 1 ? int(uint8_t(rec[0])) : -1)
+                   << ", but this pocdb reads only format " << RECORD_FORMAT;
+        return false;
+    }
+    else if (!st.IsNotFound())
+    {
+        LOG(ERROR) << "could not read the record format of \"" << path << "\": " << st.ToString();
+        return false;
+    }
+
+    // a new store, or one that opened under this comparator and so holds
+    // this format's records
+    leveldb::WriteOptions opts;
+    opts.sync = true;
+    st = store->Put(opts, key, std::string(1, char(RECORD_FORMAT)));
+
+    if (!st.ok())
+    {
+        LOG(ERROR) << "could not record the format of \"" << path << "\": " << st.ToString();
+        return false;
+    }
+
+    return true;
+}
+
+int
+pocdaemon :: run(size_t num_threads, const store_config& acceptor, const store_config* learned)
+{
+    if (!e::block_all_signals())
+    {
+        std::cerr << "could not block signals; exiting" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!e::install_signal_handler(SIGHUP, exit_on_signal) ||
+        !e::install_signal_handler(SIGINT, exit_on_signal) ||
+        !e::install_signal_handler(SIGTERM, exit_on_signal) ||
+        !e::install_signal_handler(SIGQUIT, exit_on_signal))
+    {
+        PLOG(ERROR) << "could not install signal handlers";
+        return EXIT_FAILURE;
+    }
+
+    if (!open_stores(".", acceptor, learned))
+    {
+        return EXIT_FAILURE;
+    }
+
+    start(num_threads);
+
+    while (e::atomic::increment_32_nobarrier(&s_interrupts, 0) == 0)
+    {
+        sigset_t ss;
+        sigemptyset(&ss);
+        sigsuspend(&ss);
+    }
+
+    stop();
+    return EXIT_SUCCESS;
+}
+
+bool
+pocdaemon :: open_stores(const std::string& dir, const store_config& acceptor, const store_config* learned)
+{
+    // the stores split half the process's file descriptors between them
+    const int files = std::max(sysconf(_SC_OPEN_MAX) >> (learned ? 2 : 1), learned ? 512L : 1024L);
+
+    if (!open_store(acceptor, dir.c_str(), files, &db))
+    {
+        return false;
+    }
+
+    if (!learned)
+    {
+        learned_db = db;
+    }
+    else if (!open_store(*learned, (dir + "/learned").c_str(), files, &learned_db))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+void
+pocdaemon :: start(size_t num_threads)
+{
+    if (!net)
+    {
+        busybee.reset(busybee_server::create(&control, host, control.lookup(host), &gc));
+        busybee_net.reset(new busybee_transport(busybee.get()));
+        net = busybee_net.get();
+    }
+
+    commit.start();
+    trace.start();
+    ae.start();
+    timers.start();
+
+    for (size_t i = 0; i < num_threads; ++i)
+    {
+        using namespace po6::threads;
+        e::compat::shared_ptr<thread> t(new thread(make_obj_func(&pocdaemon::loop, this, i)));
+        threads.push_back(t);
+        t->start();
+    }
+}
+
+void
+pocdaemon :: stop()
+{
+    e::atomic::increment_32_nobarrier(&stopping, 1);
+
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        threads[i]->join();
+    }
+
+    threads.clear();
+    timers.shutdown();
+    commit.shutdown();
+    trace.shutdown();
+    ae.shutdown();
+}
+
+void
+pocdaemon :: loop(size_t thread)
+{
+    e::garbage_collector::thread_state ts;
+    gc.register_thread(&ts);
+    start_buffer_pool();
+    LOG(INFO) << "network thread " << thread << " started";
+    // bounded waits so that every thread notices an interrupt
+    int timeout = 250;
+    size_t drained = 0;
+
+    while (e::atomic::increment_32_nobarrier(&s_interrupts, 0) == 0 &&
+           e::atomic::increment_32_nobarrier(&stopping, 0) == 0)
+    {
+        gc.quiescent_state(&ts);
+        uint64_t id;
+        std::auto_ptr<e::buffer> msg;
+        busybee_returncode rc = net->recv(&ts, timeout, &id, &msg);
+
+        if (rc == BUSYBEE_SUCCESS)
+        {
+            // handlers may hold onto the message, e.g. to queue a value in it
+            buffer_ref m(msg.release(), release_buffer);
+
+            if (is_host(id))
+            {
+                handle(id, m);
+            }
+            else if (!sched.enqueue(id, m, puts_in(m), po6::monotonic_time()))
+            {
+                s_refusing = true;
+                handle(id, m);
+                s_refusing = false;
+            }
+
+            // keep taking what has arrived, so peers' messages never wait
+            // behind queued clients, but let clients have a turn now and then
+            if (++drained < SCHEDULER_DRAIN)
+            {
+                timeout = 0;
+                continue;
+            }
+        }
+        else if (rc != BUSYBEE_TIMEOUT && rc != BUSYBEE_INTERRUPTED)
+        {
+            LOG(ERROR) << "busybee: " << rc;
+        }
+
+        drained = 0;
+        uint64_t wait = 250 * PO6_MILLIS;
+        buffer_ref m;
+
+        if (sched.dequeue(po6::monotonic_time(), &id, &m, &wait))
+        {
+            handle(id, m);
+            timeout = 0;
+        }
+        else
+        {
+            timeout = (wait + PO6_MILLIS - 1) / PO6_MILLIS;
+        }
+    }
+
+    LOG(INFO) << "network thread " << thread << " exiting";
+    stop_buffer_pool();
+    gc.deregister_thread(&ts);
+}
+
+void
+pocdaemon :: handle(uint64_t id, const buffer_ref& msg)
+{
+    e::unpacker up(msg->unpack_from(BUSYBEE_HEADER_SIZE));
+    uint8_t type;
+    up = up >> type;
+
+    if (up.error())
+    {
+        LOG(ERROR) << "bad message";
+        return;
+    }
+
+    outbox ob(acquire_buffer, release_buffer);
+    s_outbox = &ob;
+    dispatch(id, type, msg, up);
+    s_outbox = NULL;
+    send(&ob);
+}
+
+void
+pocdaemon :: dispatch(uint64_t id, uint8_t type, const buffer_ref& msg, e::unpacker up)
+{
+    // whether sent alone or in a batch
+    if (!from_clients(type) && !is_host(id))
+    {
+        LOG(WARNING) << "client sent a message only hosts may send";
+        return;
+    }
+
+    // every client request begins with its nonce; a batch's are refused one
+    // by one
+    if (s_refusing && type != uint8_t('X'))
+    {
+        uint64_t nonce;
+        up = up >> nonce;
+        CHECK_UNPACK(up);
+        daemon_stats::count(&stats.client_refused);
+        return refuse(id, nonce);
+    }
+
+    switch (type)
+    {
+        case uint8_t('X'):
+            return process_batch(id, msg, up);
+        case uint8_t('P'):
+            return process_put(id, msg, up);
+        case uint8_t('G'):
+            return process_get(id, msg, up);
+        case uint8_t('g'):
+            return process_read_probe(id, msg, up);
+        case uint8_t('C'):
+            return process_read_repair(id, msg, up);
+        case uint8_t('Y'):
+            return process_lease_get(id, msg, up);
+        case uint8_t('E'):
+            return process_lease_ask(id, msg, up);
+        case uint8_t('e'):
+            return process_lease_grant(id, msg, up);
+        case uint8_t('v'):
+            return process_lease_check(id, msg, up);
+        case uint8_t('V'):
+            return process_lease_checked(id, msg, up);
+        case uint8_t('l'):
+            return process_learned_ack(id, msg, up);
+        case uint8_t('a'):
+            return process_phase1a(id, msg, up);
+        case uint8_t('b'):
+            return process_phase1b(id, msg, up);
+        case uint8_t('A'):
+            return process_phase2a(id, msg, up);
+        case uint8_t('B'):
+            return process_phase2b(id, msg, up);
+        case uint8_t('L'):
+            return process_learn(id, msg, up);
+        case uint8_t('N'):
+            return process_commit_notice(id, msg, up);
+        case uint8_t('R'):
+            return process_retry(id, msg, up);
+        case uint8_t('S'):
+            return process_stats(id, msg, up);
+        case uint8_t('F'):
+            return process_forward(id, msg, up);
+        case uint8_t('f'):
+            return process_forwarded(id, msg, up);
+        case uint8_t('D'):
+            return ae.digests(id, up);
+        case uint8_t('M'):
+            return ae.mismatched(id, up);
+        case uint8_t('K'):
+            return ae.versions(id, up);
+        case uint8_t('Q'):
+            return ae.pull(id, up);
+        default:
+            LOG(ERROR) << "bad message";
+            return;
+    }
+}
+
+void
+pocdaemon :: send(uint64_t to, std::auto_ptr<e::buffer> msg)
+{
+    if (s_outbox)
+    {
+        s_outbox->add(to, msg);
+    }
+    else
+    {
+        net->send(to, msg);
+    }
+}
+
+void
+pocdaemon :: send(const std::vector<uint64_t>& to, std::auto_ptr<e::buffer> msg)
+{
+    // the transport takes ownership of what it sends, so peers cannot share
+    // one buffer; each extra peer costs a pooled buffer and a memcpy instead
+    // of packing the key, ballot, and value again
+    for (size_t i = 0; i + 1 < to.size(); ++i)
+    {
+        std::auto_ptr<e::buffer> copy(acquire_buffer(msg->size()));
+        memcpy(copy->data(), msg->data(), msg->size());
+        send(to[i], copy);
+    }
+
+    if (!to.empty())
+    {
+        send(to.back(), msg);
+    }
+}
+
+void
+pocdaemon :: send(outbox* ob)
+{
+    uint64_t to;
+    std::auto_ptr<e::buffer> msg;
+
+    while (ob->next(&to, &msg))
+    {
+        net->send(to, msg);
+    }
+}
+
+void
+pocdaemon :: process_batch(uint64_t c, const buffer_ref& msg, e::unpacker up)
+{
+    uint32_t count;
+    up = up >> count;
+    CHECK_UNPACK(up);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        e::slice m;
+        uint8_t type;
+        up = up >> m;
+        CHECK_UNPACK(up);
+        e::unpacker sub(m);
+        sub = sub >> type;
+        CHECK_UNPACK(sub);
+
+        if (type == uint8_t('X'))
+        {
+            LOG(WARNING) << "nested batch";
+            return;
+        }
+
+        dispatch(c, type, msg, sub);
+    }
+}
+
+void
+pocdaemon :: process_get(uint64_t c, const buffer_ref& msg, e::unpacker up)
+{
+    uint64_t nonce;
+    e::slice k;
+    up = up >> nonce >> k;
+    CHECK_UNPACK(up);
+    const uint64_t h = key_hash(k);
+    daemon_stats::count(&stats.gets);
+
+    if (!serves(c, nonce, h))
+    {
+        return;
+    }
+
+    uint64_t ver;
+    std::string val;
+    pocdb_returncode rc = get_learned(k, &ver, &val);
+    const size_t sz = BUSYBEE_HEADER_SIZE
+                    + sizeof(uint64_t) + 1
+                    + pack_size(e::slice(val));
+    std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+    reply->pack_at(BUSYBEE_HEADER_SIZE)
+        << nonce << e::pack_uint8<pocdb_returncode>(rc) << e::slice(val);
+    send(c, reply);
+}
+
+void
+pocdaemon :: process_read_probe(uint64_t c, const buffer_ref& msg, e::unpacker up)
+{
+    uint64_t nonce;
+    e::slice k;
+    up = up >> nonce >> k;
+    CHECK_UNPACK(up);
+    const uint64_t h = key_hash(k);
+    daemon_stats::count(&stats.read_probes);
+
+    if (!serves(c, nonce, h))
+    {
+        return;
+    }
+
+    uint64_t ver;
+    std::string val;
+    pocdb_returncode rc = get_learned(k, &ver, &val);
+    uint64_t cur_ver;
+    ballot cur_b;
+    pvalue cur_v;
+
+    if (rc != POCDB_SERVER_ERROR &&
+        get_acceptor_state(k, &cur_ver, &cur_b, &cur_v) != POCDB_SUCCESS)
+    {
+        rc = POCDB_SERVER_ERROR;
+    }
+
+    // an accepted, but not yet learned, value may be chosen already
+    const uint8_t pending = cur_v.b != ballot() ? 1 : 0;
+    const size_t sz = BUSYBEE_HEADER_SIZE
+                    + 2 * sizeof(uint64_t) + 2
+                    + pack_size(e::slice(val));
+    std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+    reply->pack_at(BUSYBEE_HEADER_SIZE)
+        << nonce << e::pack_uint8<pocdb_returncode>(rc)
+        << ver << pending << e::slice(val);
+    send(c, reply);
+}
+
+void
+pocdaemon :: process_read_repair(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    uint64_t nonce;
+    e::slice k;
+    up = up >> nonce >> k;
+    CHECK_UNPACK(up);
+    const uint64_t h = key_hash(k);
+    daemon_stats::count(&stats.read_repairs);
+
+    if (!serves(c, nonce, h))
+    {
+        return;
+    }
+
+    write_map_t::state_reference sr;
+    write_state_machine* sm = write_map(h).get_or_create_state(k.str(), &sr);
+    sm->read(c, nonce, this);
+}
+
+void
+pocdaemon :: process_lease_get(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    uint64_t nonce;
+    e::slice k;
+    up = up >> nonce >> k;
+    CHECK_UNPACK(up);
+    const uint64_t h = key_hash(k);
+
+    if (!serves(c, nonce, h))
+    {
+        return;
+    }
+
+    uint64_t ver;
+    std::string val;
+    pocdb_returncode rc = POCDB_SUCCESS;
+    uint8_t leased = 0;
+
+    // without a lease the client falls back to reading from a quorum
+    if (leases.held(hash_slot(h), k))
+    {
+        daemon_stats::count(&stats.lease_reads);
+        rc = get_learned(k, &ver, &val);
+        leased = 1;
+    }
+    else
+    {
+        daemon_stats::count(&stats.lease_misses);
+    }
+
+    const size_t sz = BUSYBEE_HEADER_SIZE
+                    + sizeof(uint64_t) + 2
+                    + pack_size(e::slice(val));
+    std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+    reply->pack_at(BUSYBEE_HEADER_SIZE)
+        << nonce << e::pack_uint8<pocdb_returncode>(rc) << leased << e::slice(val);
+    send(c, reply);
+}
+
+void
+pocdaemon :: process_lease_ask(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    uint32_t slot;
+    uint64_t asked;
+    up = up >> slot >> asked;
+    CHECK_UNPACK(up);
+
+    if (slot < NUM_SLOTS)
+    {
+        leases.grant(c, slot, asked);
+    }
+}
+
+void
+pocdaemon :: process_lease_grant(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    uint32_t slot;
+    uint64_t asked;
+    up = up >> slot >> asked;
+    CHECK_UNPACK(up);
+
+    if (slot < NUM_SLOTS)
+    {
+        leases.granted(c, slot, asked);
+    }
+}
+
+void
+pocdaemon :: process_lease_check(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    uint32_t slot;
+    uint64_t asked;
+    e::slice k;
+    up = up >> slot >> asked >> k;
+    CHECK_UNPACK(up);
+
+    if (slot >= NUM_SLOTS || key_slot(k) != slot)
+    {
+        LOG(ERROR) << "lease check for a key outside its slot";
+        return;
+    }
+
+    // the grant must already last when the key is read, so that any put
+    // accepted here later waits on the holder
+    bool ok = leases.grants(c, slot);
+    uint64_t ver = 0;
+    std::string val;
+    uint64_t cur_ver;
+    ballot cur_b;
+    pvalue cur_v;
+
+    // an accepted, but not yet learned, value may be chosen already
+    ok = ok &&
+         get_learned(k, &ver, &val) != POCDB_SERVER_ERROR &&
+         get_acceptor_state(k, &cur_ver, &cur_b, &cur_v) == POCDB_SUCCESS &&
+         cur_v.b == ballot();
+    const size_t sz = BUSYBEE_HEADER_SIZE
+                    + 1 + sizeof(uint32_t) + 2 * sizeof(uint64_t) + 1
+                    + pack_size(k);
+    std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+    reply->pack_at(BUSYBEE_HEADER_SIZE)
+        << uint8_t('V') << slot << asked << k << uint8_t(ok ? 1 : 0) << ver;
+    send(c, reply);
+}
+
+void
+pocdaemon :: process_lease_checked(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    uint32_t slot;
+    uint64_t asked;
+    e::slice k;
+    uint8_t ok;
+    uint64_t ver;
+    up = up >> slot >> asked >> k >> ok >> ver;
+    CHECK_UNPACK(up);
+
+    if (slot < NUM_SLOTS)
+    {
+        leases.checked(c, slot, asked, k, ok != 0, ver);
+    }
+}
+
+void
+pocdaemon :: process_learned_ack(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    e::slice k;
+    uint64_t ver;
+    up = up >> k >> ver;
+    CHECK_UNPACK(up);
+    const uint64_t h = key_hash(k);
+
+    write_map_t::state_reference sr;
+    write_state_machine* sm = write_map(h).get_state(k.str(), &sr);
+
+    if (sm)
+    {
+        sm->learned_by(c, ver, this);
+    }
+}
+
+void
+pocdaemon :: process_put(uint64_t c, const buffer_ref& msg, e::unpacker up)
+{
+    uint64_t nonce;
+    e::slice k;
+    e::slice v;
+    up = up >> nonce >> k >> v;
+    CHECK_UNPACK(up);
+    const uint64_t h = key_hash(k);
+    daemon_stats::count(&stats.puts);
+
+    if (!serves(c, nonce, h))
+    {
+        return;
+    }
+
+    if (!admit(v.size()))
+    {
+        return refuse(c, nonce);
+    }
+
+    write_map_t::state_reference sr;
+    write_state_machine* sm = write_map(h).get_or_create_state(k.str(), &sr);
+    sm->write(c, nonce, msg, v, 0, this);
+}
+
+void
+pocdaemon :: process_phase1a(uint64_t c, const buffer_ref& msg, e::unpacker up)
+{
+    e::slice k;
+    uint64_t ver;
+    ballot b;
+    up = up >> k >> ver >> b;
+    CHECK_UNPACK(up);
+
+    po6::threads::mutex::hold hold(acceptor_lock(k));
+    uint64_t cur_ver;
+    ballot cur_b;
+    pvalue cur_v;
+
+    if (get_acceptor_state(k, &cur_ver, &cur_b, &cur_v) != POCDB_SUCCESS)
+    {
+        LOG(ERROR) << "could not get acceptor state";
+        return;
+    }
+
+    if (c == b.leader && b > cur_b && ver >= cur_ver)
+    {
+        cur_ver = ver;
+        cur_b = b;
+
+        if (save_acceptor_state(k, cur_ver, cur_b, cur_v) != POCDB_SUCCESS)
+        {
+            LOG(ERROR) << "could not save acceptor state";
+            return;
+        }
+    }
+
+    const size_t sz = BUSYBEE_HEADER_SIZE
+                    + 1 + sizeof(uint64_t)
+                    + pack_size(k)
+                    + pack_size(cur_b)
+                    + pack_size(cur_v);
+    std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+    reply->pack_at(BUSYBEE_HEADER_SIZE)
+        << uint8_t('b') << k << cur_ver << cur_b << cur_v;
+    commit.reply(c, reply);
+}
+
+void
+pocdaemon :: process_phase1b(uint64_t c, const buffer_ref& msg, e::unpacker up)
+{
+    e::slice k;
+    uint64_t ver;
+    ballot b;
+    pvalue v;
+    up = up >> k >> ver >> b >> v;
+    CHECK_UNPACK(up);
+    const uint64_t h = key_hash(k);
+    v.buf = msg;
+
+    write_map_t::state_reference sr;
+    write_state_machine* sm = write_map(h).get_state(k.str(), &sr);
+
+    // a reply for a round that no longer exists
+    if (!sm)
+    {
+        daemon_stats::count(&stats.orphans);
+        return;
+    }
+
+    sm->phase1b(c, ver, b, v, this);
+}
+
+void
+pocdaemon :: process_phase2a(uint64_t c, const buffer_ref& msg, e::unpacker up)
+{
+    e::slice k;
+    uint64_t ver;
+    ballot b;
+    pvalue v;
+    up = up >> k >> ver >> b >> v;
+    CHECK_UNPACK(up);
+    v.buf = msg;
+
+    po6::threads::mutex::hold hold(acceptor_lock(k));
+    uint64_t cur_ver;
+    ballot cur_b;
+    pvalue cur_v;
+
+    if (get_acceptor_state(k, &cur_ver, &cur_b, &cur_v) != POCDB_SUCCESS)
+    {
+        LOG(ERROR) << "could not get acceptor state";
+        return;
+    }
+
+    if (ver == cur_ver && b == cur_b)
+    {
+        if (save_acceptor_state(k, ver, b, v) != POCDB_SUCCESS)
+        {
+            LOG(ERROR) << "could not save acceptor state";
+            return;
+        }
+
+        // the proposer must not reply until these holders learn the value
+        std::vector<std::pair<uint64_t, uint64_t> > holders;
+        leases.holders(key_slot(k), &holders);
+        const size_t sz = BUSYBEE_HEADER_SIZE
+                        + 1 + sizeof(uint64_t)
+                        + pack_size(k)
+                        + pack_size(cur_b)
+                        + sizeof(uint32_t)
+                        + holders.size() * 2 * sizeof(uint64_t);
+        std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+        e::packer pa = reply->pack_at(BUSYBEE_HEADER_SIZE)
+                     << uint8_t('B') << k << cur_ver << cur_b
+                     << uint32_t(holders.size());
+
+        for (size_t i = 0; i < holders.size(); ++i)
+        {
+            pa = pa << holders[i].first << holders[i].second;
+        }
+
+        commit.reply(c, reply);
+    }
+    else
+    {
+        const size_t sz = BUSYBEE_HEADER_SIZE
+                        + 1 + 2 * sizeof(uint64_t)
+                        + pack_size(k)
+                        + pack_size(b)
+                        + pack_size(cur_b);
+        std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+        reply->pack_at(BUSYBEE_HEADER_SIZE)
+            << uint8_t('R') << k << ver << b << cur_ver << cur_b;
+        // a refusal promises nothing, so it need not wait for a sync
+        send(c, reply);
+        return;
+    }
+}
+
+void
+pocdaemon :: process_phase2b(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    e::slice k;
+    uint64_t ver;
+    ballot b;
+    uint32_t count;
+    up = up >> k >> ver >> b >> count;
+    std::vector<std::pair<uint64_t, uint64_t> > holders;
+    const uint64_t now = po6::monotonic_time();
+
+    for (uint32_t i = 0; !up.error() && i < count; ++i)
+    {
+        uint64_t holder;
+        uint64_t left;
+        up = up >> holder >> left;
+        // the grant's time left, as measured by a clock that may run slow
+        holders.push_back(std::make_pair(holder, now + left + leases.skew));
+    }
+
+    CHECK_UNPACK(up);
+    const uint64_t h = key_hash(k);
+
+    write_map_t::state_reference sr;
+    write_state_machine* sm = write_map(h).get_state(k.str(), &sr);
+
+    // a reply for a round that no longer exists
+    if (!sm)
+    {
+        daemon_stats::count(&stats.orphans);
+        return;
+    }
+
+    sm->phase2b(c, ver, b, holders, this);
+}
+
+void
+pocdaemon :: process_learn(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    e::slice k;
+    uint64_t ver;
+    e::slice v;
+    up = up >> k >> ver >> v;
+    CHECK_UNPACK(up);
+    learn(k, ver, v);
+    ack_learned(c, k, ver);
+}
+
+void
+pocdaemon :: process_commit_notice(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    e::slice k;
+    uint64_t ver;
+    ballot b;
+    up = up >> k >> ver >> b;
+    CHECK_UNPACK(up);
+    daemon_stats::count(&stats.commit_notices);
+    uint64_t cur_ver;
+    ballot cur_b;
+    pvalue cur_v;
+    pocdb_returncode rc;
+
+    {
+        po6::threads::mutex::hold hold(acceptor_lock(k));
+        rc = get_acceptor_state(k, &cur_ver, &cur_b, &cur_v);
+    }
+
+    if (rc != POCDB_SUCCESS)
+    {
+        LOG(ERROR) << "could not get acceptor state";
+        return;
+    }
+
+    // the value accepted under the winning ballot is the value chosen;
+    // cur_v keeps its own reference to it, so it outlives the lock
+    if (cur_ver == ver && cur_v.b == b)
+    {
+        learn(k, ver, cur_v.v);
+        return ack_learned(c, k, ver);
+    }
+
+    uint64_t learned_ver;
+    std::string val;
+
+    if (get_learned(k, &learned_ver, &val) == POCDB_SUCCESS && learned_ver >= ver)
+    {
+        return ack_learned(c, k, ver);
+    }
+
+    // this acceptor has since lost or replaced the value, so pull it
+    daemon_stats::count(&stats.notice_pulls);
+    const size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint32_t) + pack_size(k);
+    std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+    msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('Q') << uint32_t(1) << k;
+    send(c, msg);
+}
+
+void
+pocdaemon :: process_retry(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    e::slice k;
+    uint64_t ver;
+    ballot b;
+    uint64_t cur_ver;
+    ballot cur_b;
+    up = up >> k >> ver >> b >> cur_ver >> cur_b;
+    CHECK_UNPACK(up);
+    const uint64_t h = key_hash(k);
+    daemon_stats::count(&stats.retries);
+
+    write_map_t::state_reference sr;
+    write_state_machine* sm = write_map(h).get_state(k.str(), &sr);
+
+    // a reply for a round that no longer exists
+    if (!sm)
+    {
+        daemon_stats::count(&stats.orphans);
+        return;
+    }
+
+    sm->retry(c, ver, b, cur_ver, cur_b, this);
+}
+
+void
+pocdaemon :: process_forward(uint64_t c, const buffer_ref& msg, e::unpacker up)
+{
+    e::slice k;
+    uint64_t client;
+    uint64_t nonce;
+    e::slice v;
+    up = up >> k >> client >> nonce >> v;
+    CHECK_UNPACK(up);
+    const uint64_t h = key_hash(k);
+    pocdb_returncode rc = POCDB_SUCCESS;
+
+    if (!is_replica(hash_slot(h), host))
+    {
+        rc = POCDB_SERVER_ERROR;
+    }
+    else if (!admit(v.size()))
+    {
+        rc = POCDB_BUSY;
+    }
+
+    // the forwarder relays the failure to its client
+    if (rc != POCDB_SUCCESS)
+    {
+        const size_t sz = BUSYBEE_HEADER_SIZE + 1 + 2 * sizeof(uint64_t) + 1;
+        std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+        reply->pack_at(BUSYBEE_HEADER_SIZE)
+            << uint8_t('f') << client << nonce << e::pack_uint8<pocdb_returncode>(rc);
+        send(c, reply);
+        return;
+    }
+
+    write_map_t::state_reference sr;
+    write_state_machine* sm = write_map(h).get_or_create_state(k.str(), &sr);
+    sm->write(client, nonce, msg, v, c, this);
+}
+
+void
+pocdaemon :: process_forwarded(uint64_t, const buffer_ref&, e::unpacker up)
+{
+    uint64_t client;
+    uint64_t nonce;
+    pocdb_returncode rc;
+    up = up >> client >> nonce >> e::unpack_uint8<pocdb_returncode>(rc);
+    CHECK_UNPACK(up);
+    const size_t sz = BUSYBEE_HEADER_SIZE + sizeof(uint64_t) + 1;
+    std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+    reply->pack_at(BUSYBEE_HEADER_SIZE)
+        << nonce << e::pack_uint8<pocdb_returncode>(rc);
+    send(client, reply);
+}
+
+bool
+pocdaemon :: admit(size_t bytes)
+{
+    // refuse puts beyond the cap rather than queue them without bound; a
+    // put arriving to an empty queue is always accepted
+    const uint64_t queued = e::atomic::increment_64_nobarrier(&queued_bytes, bytes);
+
+    if (queued > max_queued && queued > bytes)
+    {
+        discharge(bytes);
+        daemon_stats::count(&stats.busy);
+        return false;
+    }
+
+    return true;
+}
+
+void
+pocdaemon :: discharge(size_t bytes)
+{
+    e::atomic::increment_64_nobarrier(&queued_bytes, 0 - uint64_t(bytes));
+}
+
+void
+pocdaemon :: refuse(uint64_t c, uint64_t nonce)
+{
+    const size_t sz = BUSYBEE_HEADER_SIZE + sizeof(uint64_t) + 1;
+    std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+    reply->pack_at(BUSYBEE_HEADER_SIZE)
+        << nonce << e::pack_uint8<pocdb_returncode>(POCDB_BUSY);
+    send(c, reply);
+}
+
+bool
+pocdaemon :: serves(uint64_t c, uint64_t nonce, uint64_t h)
+{
+    if (is_replica(hash_slot(h), host))
+    {
+        return true;
+    }
+
+    // every reply to a client begins with nonce and returncode
+    LOG(WARNING) << "client asked for a key this host does not replicate";
+    const size_t sz = BUSYBEE_HEADER_SIZE + sizeof(uint64_t) + 1;
+    std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+    reply->pack_at(BUSYBEE_HEADER_SIZE)
+        << nonce << e::pack_uint8<pocdb_returncode>(POCDB_SERVER_ERROR);
+    send(c, reply);
+    return false;
+}
+
+void
+pocdaemon :: ack_learned(uint64_t c, const e::slice& k, uint64_t ver)
+{
+    if (!leases.acknowledges(key_slot(k)))
+    {
+        return;
+    }
+
+    const size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint64_t) + pack_size(k);
+    std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+    msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('l') << k << ver;
+    send(c, msg);
+}
+
+void
+pocdaemon :: process_stats(uint64_t c, const buffer_ref&, e::unpacker up)
+{
+    uint64_t nonce;
+    up = up >> nonce;
+    CHECK_UNPACK(up);
+    std::vector<std::pair<std::string, uint64_t> > all;
+    stats.snapshot(&all);
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes;
+    learned.stats(&hits, &misses, &bytes);
+    all.push_back(std::make_pair(std::string("cache.hits"), hits));
+    all.push_back(std::make_pair(std::string("cache.misses"), misses));
+    all.push_back(std::make_pair(std::string("cache.bytes"), bytes));
+    all.push_back(std::make_pair(std::string("queued_bytes"),
+                                 e::atomic::load_64_nobarrier(&queued_bytes)));
+    all.push_back(std::make_pair(std::string("trace.dropped"),
+                                 e::atomic::load_64_nobarrier(&trace.dropped)));
+    size_t sz = BUSYBEE_HEADER_SIZE + sizeof(uint64_t) + 1 + sizeof(uint32_t);
+
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+        sz += pack_size(e::slice(all[i].first)) + sizeof(uint64_t);
+    }
+
+    std::auto_ptr<e::buffer> reply(acquire_buffer(sz));
+    e::packer pa = reply->pack_at(BUSYBEE_HEADER_SIZE);
+    pa = pa << nonce << e::pack_uint8<pocdb_returncode>(POCDB_SUCCESS) << uint32_t(all.size());
+
+    for (size_t i = 0; i < all.size(); ++i)
+    {
+        pa = pa << e::slice(all[i].first) << all[i].second;
+    }
+
+    send(c, reply);
+}
+
+void
+pocdaemon :: learn(const e::slice& k, uint64_t ver, const e::slice& v)
+{
+    daemon_stats::count(&stats.learns);
+    po6::threads::mutex::hold hold(acceptor_lock(k));
+    uint64_t cur;
+    std::string val;
+
+    // learns may arrive out of order, and anti-entropy resends old ones, so
+    // only a newer version replaces what is already learned
+    if (get_learned(k, &cur, &val) != POCDB_SUCCESS || cur < ver)
+    {
+        encode_learned(&val, ver, v);
+        commit.put(record_key(k, LEARNED_TAG), &val);
+        learned.put(k, ver, v);
+    }
+
+    // the instance is decided, so the acceptor moves on to the next one and
+    // its copy of the value is garbage.  The promise stays so that a stable
+    // leader may go straight to Phase 2; without stable leaders every round
+    // runs Phase 1 anyway, so the record is dropped altogether and rebuilt
+    // from the learned version when next needed.  Either write shares a
+    // batch with the learned record, which the flusher makes durable first.
+    uint64_t cur_ver;
+    ballot cur_b;
+    pvalue cur_v;
+
+    if (get_acceptor_state(k, &cur_ver, &cur_b, &cur_v) == POCDB_SUCCESS &&
+        cur_ver <= ver)
+    {
+        if (stable_ballots)
+        {
+            save_acceptor_state(k, ver + 1, cur_b, pvalue());
+        }
+        else
+        {
+            daemon_stats::count(&stats.acceptors_retired);
+            commit.del(record_key(k, ACCEPTOR_TAG));
+        }
+    }
+
+    trace.learn(k, ver, v);
+}
+
+pocdb_returncode
+pocdaemon :: get_learned(const e::slice& k, uint64_t* ver, std::string* val)
+{
+    *ver = 0;
+    val->clear();
+
+    if (learned.get(k, ver, val))
+    {
+        return POCDB_SUCCESS;
+    }
+
+    const std::string key(record_key(k, LEARNED_TAG));
+    leveldb::Status st;
+
+    if (!commit.get(key, val) &&
+        (st = learned_db->Get(leveldb::ReadOptions(), key, val)).IsNotFound())
+    {
+        return POCDB_NOT_FOUND;
+    }
+    else if (!st.ok())
+    {
+        LOG(ERROR) << "leveldb error: " << st.ToString();
+        return POCDB_SERVER_ERROR;
+    }
+
+    size_t off;
+
+    if (!decode_learned(e::slice(*val), ver, &off))
+    {
+        LOG(ERROR) << "corrupt learned value";
+        return POCDB_SERVER_ERROR;
+    }
+
+    val->erase(0, off);
+    learned.put(k, *ver, e::slice(*val));
+    return POCDB_SUCCESS;
+}
+
+po6::threads::mutex*
+pocdaemon :: acceptor_lock(const e::slice& k)
+{
+    return &acceptor_locks[key_hash(k) % ACCEPTOR_LOCK_STRIPES];
+}
+
+pocdb_returncode
+pocdaemon :: get_acceptor_state(const e::slice& k, uint64_t* ver,
+                                ballot* b, pvalue* v)
+{
+    *ver = 0;
+    *b = ballot();
+    *v = pvalue();
+
+    const std::string key(record_key(k, ACCEPTOR_TAG));
+    std::string val;
+    leveldb::Status st;
+    const bool staged = commit.get(key, &val);
+
+    // without a record the acceptor has promised nothing and accepted
+    // nothing since the last learned version, if there is one
+    if ((staged && val.empty()) ||
+        (!staged && (st = db->Get(leveldb::ReadOptions(), key, &val)).IsNotFound()))
+    {
+        uint64_t learned_ver;
+
+        switch (get_learned(k, &learned_ver, &val))
+        {
+            case POCDB_SUCCESS:
+                *ver = learned_ver + 1;
+                return POCDB_SUCCESS;
+            case POCDB_NOT_FOUND:
+                return POCDB_SUCCESS;
+            default:
+                return POCDB_SERVER_ERROR;
+        }
+    }
+    else if (!st.ok())
+    {
+        LOG(ERROR) << "error: " << st.ToString();
+        return POCDB_SERVER_ERROR;
+    }
+
+    // the accepted value is decoded in place, so it needs a buffer to live in
+    v->buf = buffer_ref(acquire_buffer(val.size()), release_buffer);
+    memcpy(v->buf->data(), val.data(), val.size());
+
+    if (!decode_acceptor(e::slice(v->buf->data(), val.size()), ver, b, v))
+    {
+        LOG(ERROR) << "corrupt acceptor";
+        return POCDB_SERVER_ERROR;
+    }
+
+    return POCDB_SUCCESS;
+}
+
+pocdb_returncode
+pocdaemon :: save_acceptor_state(const e::slice& k, uint64_t ver,
+                                 const ballot& b, const pvalue& v)
+{
+    std::string val;
+    encode_acceptor(&val, ver, b, v);
+    commit.put(record_key(k, ACCEPTOR_TAG), &val);
+    return POCDB_SUCCESS;
+}
+
+write_state_machine :: write_state_machine(const std::string& k)
+    : key(k)
+    , slot(key_slot(e::slice(k)))
+    , mtx()
+    , values()
+    , readers()
+    , reading()
+    , executing_paxos()
+    , leader()
+    , leading()
+    , promises()
+    , accepted()
+    , rejected()
+    , max_accepted()
+    , version()
+    , proposed()
+    , round_start()
+    , phase2_start()
+    , conflicts()
+    , backing_off()
+    , holders()
+    , awaiting_holders()
+    , holders_deadline()
+{
+}
+
+#define STATE_POOL_DEPTH 256
+
+// Per-thread free list of write_state_machine allocations.  The garbage
+// collector frees state machines on whichever thread reaches a quiescent
+// state, so a thread's pool may be stocked by another thread's allocations.
+__thread void* s_state_pool[STATE_POOL_DEPTH];
+__thread size_t s_state_pool_sz;
+
+void*
+write_state_machine :: operator new(size_t sz)
+{
+    if (sz == sizeof(write_state_machine) && s_state_pool_sz > 0)
+    {
+        return s_state_pool[--s_state_pool_sz];
+    }
+
+    return ::operator new(sz);
+}
+
+void
+write_state_machine :: operator delete(void* p, size_t sz)
+{
+    if (p && sz == sizeof(write_state_machine) && s_state_pool_sz < STATE_POOL_DEPTH)
+    {
+        s_state_pool[s_state_pool_sz++] = p;
+        return;
+    }
+
+    ::operator delete(p);
+}
+
+const std::string&
+write_state_machine :: state_key()
+{
+    po6::threads::mutex::hold hold(&mtx);
+    return key;
+}
+
+bool
+write_state_machine :: finished()
+{
+    po6::threads::mutex::hold hold(&mtx);
+    return values.empty() && readers.empty() && reading.empty() && !awaiting_holders;
+}
+
+void
+write_state_machine :: write(uint64_t c, uint64_t nonce, const buffer_ref& buf, const e::slice& v,
+                             uint64_t forwarder, pocdaemon* d)
+{
+    po6::threads::mutex::hold hold(&mtx);
+    values.push_back(queued_put(c, nonce, buf, v, forwarder));
+    daemon_stats::record(&d->stats.queue_depth, values.size());
+    work_state_machine(d);
+}
+
+void
+write_state_machine :: read(uint64_t c, uint64_t nonce, pocdaemon* d)
+{
+    po6::threads::mutex::hold hold(&mtx);
+    readers.push_back(std::make_pair(c, nonce));
+    work_state_machine(d);
+}
+
+void
+write_state_machine :: phase1b(uint64_t c, uint64_t ver, const ballot& b, const pvalue& v, pocdaemon* d)
+{
+    po6::threads::mutex::hold hold(&mtx);
+
+    // the round committed already, and only waits on lease holders; a late
+    // reply to a round given up on must neither count as another conflict
+    // nor cut a backoff short
+    if (awaiting_holders || !executing_paxos || backing_off)
+    {
+        return;
+    }
+
+    if (b > leading && ver == version)
+    {
+        return preempted(b, version, d);
+    }
+
+    if (ver > version)
+    {
+        executing_paxos = false;
+        leader = false;
+        version = ver;
+        return work_state_machine(d);
+    }
+
+    // only a reply for this very ballot and version is a promise; anything
+    // else is stale or a duplicate of a retransmitted 'a'
+    if (ver != version || b != leading ||
+        std::find(promises.begin(), promises.end(), c) != promises.end())
+    {
+        return;
+    }
+
+    if (v.b != ballot() && v.b > max_accepted.b)
+    {
+        max_accepted = v;
+    }
+
+    promises.push_back(c);
+    work_state_machine(d);
+}
+
+void
+write_state_machine :: phase2b(uint64_t c, uint64_t ver, const ballot& b,
+                               const std::vector<std::pair<uint64_t, uint64_t> >& h,
+                               pocdaemon* d)
+{
+    po6::threads::mutex::hold hold(&mtx);
+
+    if (awaiting_holders || ver != version || b != leading ||
+        std::find(accepted.begin(), accepted.end(), c) != accepted.end())
+    {
+        return;
+    }
+
+    accepted.push_back(c);
+
+    for (size_t i = 0; i < h.size(); ++i)
+    {
+        size_t j = 0;
+
+        while (j < holders.size() && holders[j].first != h[i].first)
+        {
+            ++j;
+        }
+
+        if (j == holders.size())
+        {
+            holders.push_back(h[i]);
+        }
+        else
+        {
+            holders[j].second = std::max(holders[j].second, h[i].second);
+        }
+    }
+
+    work_state_machine(d);
+}
+
+void
+write_state_machine :: retry(uint64_t c, uint64_t ver, const ballot& b,
+                              uint64_t cur_ver, const ballot& cur_b, pocdaemon* d)
+{
+    po6::threads::mutex::hold hold(&mtx);
+
+    if (awaiting_holders || !executing_paxos || ver != version || b != leading ||
+        std::find(rejected.begin(), rejected.end(), c) != rejected.end())
+    {
+        return;
+    }
+
+    rejected.push_back(c);
+
+    // a lagging acceptor alone is no reason to abandon the ballot; only
+    // preemption, or too many rejections to form a quorum, forces Phase 1
+    if (!(cur_b > leading) && rejected.size() + QUORUM <= REPLICAS)
+    {
+        return;
+    }
+
+    if (cur_b > leading)
+    {
+        return preempted(cur_b, std::max(version + 1, cur_ver), d);
+    }
+
+    executing_paxos = false;
+    leader = false;
+    version = std::max(version + 1, cur_ver);
+    return work_state_machine(d);
+}
+
+void
+write_state_machine :: learned_by(uint64_t c, uint64_t ver, pocdaemon* d)
+{
+    po6::threads::mutex::hold hold(&mtx);
+
+    if (!awaiting_holders || ver != version)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < holders.size(); ++i)
+    {
+        if (holders[i].first == c)
+        {
+            holders.erase(holders.begin() + i);
+            break;
+        }
+    }
+
+    if (holders.empty())
+    {
+        finish_commit(d);
+    }
+}
+
+void
+write_state_machine :: resume(pocdaemon* d)
+{
+    po6::threads::mutex::hold hold(&mtx);
+
+    if (awaiting_holders)
+    {
+        const uint64_t now = po6::monotonic_time();
+
+        // holders yet to acknowledge have lost their leases by the deadline;
+        // the wheel's ticks are coarse, so it may fire a little early
+        if (now < holders_deadline)
+        {
+            d->timers.schedule(key, holders_deadline - now);
+            return;
+        }
+
+        return finish_commit(d);
+    }
+
+    if (!backing_off)
+    {
+        return;
+    }
+
+    backing_off = false;
+    work_state_machine(d);
+}
+
+// per-thread xorshift state for backoff jitter
+static __thread uint64_t s_jitter = 0;
+
+void
+write_state_machine :: preempted(const ballot& by, uint64_t next, pocdaemon* d)
+{
+    executing_paxos = false;
+    leader = false;
+    version = next;
+    ++conflicts;
+
+    if (conflicts == LIVELOCK_CONFLICTS)
+    {
+        daemon_stats::count(&d->stats.livelocks);
+    }
+
+    // the holder of the winning ballot is already running rounds for this
+    // key; handing it our puts lets one proposer commit them all
+    if (conflicts >= FORWARD_CONFLICTS && by.leader != d->host &&
+        is_replica(slot, by.leader))
+    {
+        forward_values(by.leader, d);
+    }
+
+    if (d->retry_backoff == 0)
+    {
+        return work_state_machine(d);
+    }
+
+    if (s_jitter == 0)
+    {
+        s_jitter = po6::monotonic_time() | 1;
+    }
+
+    s_jitter ^= s_jitter << 13;
+    s_jitter ^= s_jitter >> 7;
+    s_jitter ^= s_jitter << 17;
+    // a random point in a window that doubles with every preemption
+    const uint64_t window = d->retry_backoff << std::min(conflicts - 1, unsigned(MAX_BACKOFF_SHIFT));
+    backing_off = true;
+    daemon_stats::count(&d->stats.backoffs);
+    d->timers.schedule(key, window / 2 + s_jitter % (window / 2 + 1));
+}
+
+void
+write_state_machine :: forward_values(uint64_t to, pocdaemon* d)
+{
+    std::list<queued_put>::iterator it = values.begin();
+
+    while (it != values.end())
+    {
+        // a put is forwarded at most once, so two hosts never trade it back
+        // and forth
+        if (it->forwarder != 0)
+        {
+            ++it;
+            continue;
+        }
+
+        const size_t sz = BUSYBEE_HEADER_SIZE + 1 + 2 * sizeof(uint64_t)
+                        + pack_size(e::slice(key))
+                        + pack_size(it->value);
+        std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE)
+            << uint8_t('F') << e::slice(key) << it->client << it->nonce << it->value;
+        d->send(to, msg);
+        daemon_stats::count(&d->stats.forwarded);
+        it = dequeue(it, d);
+    }
+}
+
+std::list<queued_put>::iterator
+write_state_machine :: dequeue(std::list<queued_put>::iterator it, pocdaemon* d)
+{
+    d->discharge(it->value.size());
+    return values.erase(it);
+}
+
+void
+write_state_machine :: work_state_machine(pocdaemon* d)
+{
+    if (awaiting_holders)
+    {
+        return;
+    }
+    else if (!executing_paxos && (backing_off || (values.empty() && readers.empty())))
+    {
+        return;
+    }
+    else if (!executing_paxos)
+    {
+        executing_paxos = true;
+        reading.insert(reading.end(), readers.begin(), readers.end());
+        readers.clear();
+
+        // with nothing to write, the round exists to hear from a quorum
+        if (values.empty())
+        {
+            leader = false;
+        }
+
+        round_start = po6::monotonic_time();
+        phase2_start = 0;
+        daemon_stats::count(&d->stats.rounds);
+
+        if (!leader)
+        {
+            daemon_stats::count(&d->stats.phase1_rounds);
+            leading = ballot();
+            leading.number = po6::wallclock_time();
+            leading.leader = d->host;
+            uint64_t cur_ver;
+            ballot cur_b;
+            pvalue cur_v;
+
+            // start from what the local acceptor knows, not from scratch
+            if (d->get_acceptor_state(e::slice(key), &cur_ver, &cur_b, &cur_v) == POCDB_SUCCESS)
+            {
+                version = std::max(version, cur_ver);
+            }
+        }
+
+        promises.clear();
+        accepted.clear();
+        rejected.clear();
+        holders.clear();
+        max_accepted = pvalue();
+        proposed = 0;
+
+        // puts queued behind one another are concurrent (none has been
+        // acknowledged), so committing only the last of them is equivalent
+        // to committing each in order, and every one of them can be acked
+        if (!values.empty())
+        {
+            std::list<queued_put>::iterator it = values.begin();
+            std::list<queued_put>::iterator next = it;
+            proposed = 1;
+
+            while (proposed < d->coalesce && ++next != values.end())
+            {
+                it = next;
+                ++proposed;
+            }
+
+            max_accepted.v = it->value;
+            max_accepted.buf = it->buf;
+        }
+    }
+
+    if (max_accepted.b > leading)
+    {
+        executing_paxos = false;
+        leader = false;
+        return work_state_machine(d);
+    }
+
+    if (!leader && promises.size() < QUORUM)
+    {
+        const size_t sz = BUSYBEE_HEADER_SIZE
+                        + 1 + sizeof(uint64_t)
+                        + pack_size(e::slice(key))
+                        + pack_size(leading);
+
+        std::vector<uint64_t> to;
+
+        for (unsigned i = 0; i < REPLICAS; ++i)
+        {
+            const uint64_t r = slot_replica(slot, i);
+
+            if (std::find(promises.begin(), promises.end(), r) == promises.end())
+            {
+                to.push_back(r);
+            }
+        }
+
+        std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE)
+            << uint8_t('a') << e::slice(key) << version << leading;
+        d->send(to, msg);
+    }
+    else if (proposed == 0 && max_accepted.b == ballot())
+    {
+        // a quorum promised and none has accepted anything for this
+        // version, so every chosen version precedes it
+        daemon_stats::record(&d->stats.phase1_us, (po6::monotonic_time() - round_start) / PO6_MICROS);
+        executing_paxos = false;
+        leader = d->stable_ballots;
+        conflicts = 0;
+        reply_readers(version, d);
+        work_state_machine(d);
+    }
+    else if (accepted.size() < QUORUM)
+    {
+        if (phase2_start == 0)
+        {
+            phase2_start = po6::monotonic_time();
+
+            // a stable leader skips Phase 1 and gathers no promises
+            if (!promises.empty())
+            {
+                daemon_stats::record(&d->stats.phase1_us, (phase2_start - round_start) / PO6_MICROS);
+            }
+        }
+
+        max_accepted.b = leading;
+        const size_t sz = BUSYBEE_HEADER_SIZE
+                        + 1 + sizeof(uint64_t)
+                        + pack_size(e::slice(key))
+                        + pack_size(leading)
+                        + pack_size(max_accepted);
+
+        std::vector<uint64_t> to;
+
+        for (unsigned i = 0; i < REPLICAS; ++i)
+        {
+            const uint64_t r = slot_replica(slot, i);
+
+            if (std::find(accepted.begin(), accepted.end(), r) == accepted.end())
+            {
+                to.push_back(r);
+            }
+        }
+
+        std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE)
+            << uint8_t('A') << e::slice(key) << version << leading << max_accepted;
+        d->send(to, msg);
+    }
+    else
+    {
+        // acceptors that accepted the value already hold it, so they need
+        // only hear which ballot won; the rest get the value itself
+        std::vector<uint64_t> notify;
+        std::vector<uint64_t> to;
+
+        for (unsigned i = 0; i < REPLICAS; ++i)
+        {
+            const uint64_t r = slot_replica(slot, i);
+
+            if (r == d->host)
+            {
+                continue;
+            }
+
+            (std::find(accepted.begin(), accepted.end(), r) != accepted.end()
+                ? notify : to).push_back(r);
+        }
+
+        if (!notify.empty())
+        {
+            const size_t sz = BUSYBEE_HEADER_SIZE
+                            + 1 + sizeof(uint64_t)
+                            + pack_size(e::slice(key))
+                            + pack_size(leading);
+            std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+            msg->pack_at(BUSYBEE_HEADER_SIZE)
+                << uint8_t('N') << e::slice(key) << version << leading;
+            d->send(notify, msg);
+        }
+
+        if (!to.empty())
+        {
+            const size_t sz = BUSYBEE_HEADER_SIZE
+                            + 1 + sizeof(uint64_t)
+                            + pack_size(e::slice(key))
+                            + pack_size(max_accepted.v);
+            std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+            msg->pack_at(BUSYBEE_HEADER_SIZE)
+                << uint8_t('L') << e::slice(key) << version << max_accepted.v;
+            d->send(to, msg);
+        }
+
+        if (phase2_start != 0)
+        {
+            daemon_stats::record(&d->stats.phase2_us, (po6::monotonic_time() - phase2_start) / PO6_MICROS);
+        }
+
+        // learn locally rather than through the network so the client's
+        // reply can wait on the group commit that makes it durable here
+        d->learn(e::slice(key), version, max_accepted.v);
+        const uint64_t now = po6::monotonic_time();
+        holders_deadline = 0;
+
+        // this host learned the value already, and an ended lease needs no
+        // waiting on
+        for (size_t i = 0; i < holders.size(); )
+        {
+            if (holders[i].first == d->host || holders[i].second <= now)
+            {
+                holders.erase(holders.begin() + i);
+            }
+            else
+            {
+                holders_deadline = std::max(holders_deadline, holders[i].second);
+                ++i;
+            }
+        }
+
+        if (!holders.empty())
+        {
+            daemon_stats::count(&d->stats.lease_waits);
+            awaiting_holders = true;
+            d->timers.schedule(key, holders_deadline - now);
+            return;
+        }
+
+        finish_commit(d);
+    }
+}
+
+void
+write_state_machine :: finish_commit(pocdaemon* d)
+{
+    awaiting_holders = false;
+    holders.clear();
+    executing_paxos = false;
+    // a quorum's promise for "leading" carries to the next version
+    leader = d->stable_ballots;
+    conflicts = 0;
+    ++version;
+
+    reply_readers(version, d);
+    std::list<queued_put>::iterator last = values.begin();
+
+    if (proposed > 0)
+    {
+        std::advance(last, proposed - 1);
+    }
+
+    if (proposed > 0 && max_accepted.v == last->value)
+    {
+        for (size_t i = 0; i < proposed; ++i)
+        {
+            const queued_put& p(values.front());
+            const size_t ack_sz = BUSYBEE_HEADER_SIZE + 2 * sizeof(uint64_t) + 2;
+            std::auto_ptr<e::buffer> msg(acquire_buffer(ack_sz));
+            e::packer pa = msg->pack_at(BUSYBEE_HEADER_SIZE);
+
+            if (p.forwarder != 0)
+            {
+                pa = pa << uint8_t('f') << p.client;
+            }
+
+            pa << p.nonce << e::pack_uint8<pocdb_returncode>(POCDB_SUCCESS);
+            d->commit.reply(p.forwarder != 0 ? p.forwarder : p.client, msg);
+            dequeue(values.begin(), d);
+        }
+    }
+
+    work_state_machine(d);
+}
+
+void
+write_state_machine :: reply_readers(uint64_t next, pocdaemon* d)
+{
+    if (reading.empty())
+    {
+        return;
+    }
+
+    uint64_t ver;
+    std::string val;
+    pocdb_returncode rc = d->get_learned(e::slice(key), &ver, &val);
+    const size_t sz = BUSYBEE_HEADER_SIZE
+                    + 3 * sizeof(uint64_t) + 1
+                    + pack_size(e::slice(val));
+
+    for (size_t i = 0; i < reading.size(); ++i)
+    {
+        std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE)
+            << reading[i].second << e::pack_uint8<pocdb_returncode>(rc)
+            << next << ver << e::slice(val);
+        d->send(reading[i].first, msg);
+    }
+
+    reading.clear();
+}
+
+group_commit :: group_commit(pocdaemon* _d, uint64_t _max_delay, size_t _max_batch)
+    : d(_d)
+    , max_delay(_max_delay)
+    , max_batch(_max_batch)
+    , mtx()
+    , cond(&mtx)
+    , stop(false)
+    , flushing(false)
+    , seqno(0)
+    , batch_start_seqno(0)
+    , batch_start(0)
+    , batch_keys()
+    , replies()
+    , pending()
+    , flusher(po6::threads::make_obj_func(&group_commit::flush_loop, this))
+{
+}
+
+group_commit :: ~group_commit() throw ()
+{
+    for (size_t i = 0; i < replies.size(); ++i)
+    {
+        release_buffer(replies[i].second);
+    }
+}
+
+void
+group_commit :: start()
+{
+    flusher.start();
+}
+
+void
+group_commit :: shutdown()
+{
+    {
+        po6::threads::mutex::hold hold(&mtx);
+        stop = true;
+        cond.broadcast();
+    }
+
+    flusher.join();
+}
+
+void
+group_commit :: put(const std::string& key, std::string* val)
+{
+    po6::threads::mutex::hold hold(&mtx);
+
+    if (batch_keys.empty())
+    {
+        batch_start = po6::monotonic_time();
+    }
+
+    std::pair<uint64_t, std::string>& p(pending[key]);
+
+    // a key written twice before its sync only needs its latest value synced
+    if (p.first <= batch_start_seqno)
+    {
+        batch_keys.push_back(key);
+    }
+
+    p.first = ++seqno;
+    p.second.swap(*val);
+    cond.signal();
+}
+
+void
+group_commit :: del(const std::string& key)
+{
+    std::string empty;
+    put(key, &empty);
+}
+
+bool
+group_commit :: get(const std::string& key, std::string* val)
+{
+    po6::threads::mutex::hold hold(&mtx);
+    std::map<std::string, std::pair<uint64_t, std::string> >::iterator it;
+    it = pending.find(key);
+
+    if (it == pending.end())
+    {
+        return false;
+    }
+
+    *val = it->second.second;
+    return true;
+}
+
+void
+group_commit :: reply(uint64_t to, std::auto_ptr<e::buffer> msg)
+{
+    {
+        po6::threads::mutex::hold hold(&mtx);
+
+        if (!pending.empty() || flushing)
+        {
+            replies.push_back(std::make_pair(to, msg.release()));
+            cond.signal();
+            return;
+        }
+    }
+
+    d->send(to, msg);
+}
+
+void
+group_commit :: flush_loop()
+{
+    leveldb::WriteBatch b;
+    leveldb::WriteBatch lb;
+    std::vector<std::string> keys;
+    std::vector<std::pair<uint64_t, e::buffer*> > r;
+    unsigned failures = 0;
+
+    while (true)
+    {
+        uint64_t seq;
+
+        {
+            po6::threads::mutex::hold hold(&mtx);
+
+            while (!stop && batch_keys.empty() && replies.empty())
+            {
+                cond.wait();
+            }
+
+            if (stop && batch_keys.empty() && replies.empty())
+            {
+                return;
+            }
+
+            // give writes that arrive close together a chance to share a sync
+            while (!stop && !batch_keys.empty() && batch_keys.size() < max_batch)
+            {
+                const uint64_t now = po6::monotonic_time();
+
+                if (now >= batch_start + max_delay)
+                {
+                    break;
+                }
+
+                cond.wait(batch_start + max_delay - now);
+            }
+
+            keys.swap(batch_keys);
+            r.swap(replies);
+
+            const bool split = d->learned_db != d->db;
+
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                const bool is_learned = split && !keys[i].empty() &&
+                                        keys[i][keys[i].size() - 1] == LEARNED_TAG;
+                const std::string& val(pending[keys[i]].second);
+
+                if (val.empty())
+                {
+                    (is_learned ? lb : b).Delete(keys[i]);
+                }
+                else
+                {
+                    (is_learned ? lb : b).Put(keys[i], val);
+                }
+            }
+
+            seq = seqno;
+            batch_start_seqno = seqno;
+            flushing = true;
+        }
+
+        bool durable = true;
+
+        if (!keys.empty())
+        {
+            leveldb::WriteOptions opts;
+            opts.sync = true;
+            const uint64_t began = po6::monotonic_time();
+            leveldb::Status st;
+
+            // learned values first: an acceptor must not move past an
+            // instance whose learned value this store could still lose
+            if (d->learned_db != d->db)
+            {
+                st = d->learned_db->Write(opts, &lb);
+            }
+
+            if (st.ok())
+            {
+                st = d->db->Write(opts, &b);
+            }
+
+            daemon_stats::record(&d->stats.sync_us, (po6::monotonic_time() - began) / PO6_MICROS);
+            daemon_stats::record(&d->stats.sync_writes, keys.size());
+            daemon_stats::count(&d->stats.syncs);
+
+            if (!st.ok())
+            {
+                LOG(ERROR) << "leveldb error: " << st.ToString();
+                daemon_stats::count(&d->stats.sync_failures);
+                durable = false;
+            }
+        }
+
+        {
+            po6::threads::mutex::hold hold(&mtx);
+
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                std::map<std::string, std::pair<uint64_t, std::string> >::iterator it;
+                it = pending.find(keys[i]);
+
+                if (it == pending.end() || it->second.first > seq)
+                {
+                    // written again since, and so already in the next batch
+                    continue;
+                }
+
+                if (durable)
+                {
+                    pending.erase(it);
+                }
+                else
+                {
+                    batch_keys.push_back(keys[i]);
+                }
+            }
+
+            if (!durable)
+            {
+                // retried at once, ahead of replies that came since
+                batch_start = 0;
+                replies.insert(replies.begin(), r.begin(), r.end());
+                r.clear();
+            }
+
+            flushing = false;
+        }
+
+        if (!durable)
+        {
+            LOG_IF(FATAL, ++failures >= SYNC_RETRIES) << "could not sync after "
+                                                      << failures << " attempts";
+            const uint64_t delay = uint64_t(SYNC_RETRY_DELAY) << (failures - 1);
+            struct timespec ts;
+            ts.tv_sec = delay / PO6_SECONDS;
+            ts.tv_nsec = delay % PO6_SECONDS;
+            nanosleep(&ts, NULL);
+            b.Clear();
+            lb.Clear();
+            keys.clear();
+            continue;
+        }
+
+        failures = 0;
+        outbox ob(acquire_buffer, release_buffer);
+
+        for (size_t i = 0; i < r.size(); ++i)
+        {
+            std::auto_ptr<e::buffer> msg(r[i].second);
+            ob.add(r[i].first, msg);
+        }
+
+        d->send(&ob);
+
+        b.Clear();
+        lb.Clear();
+        keys.clear();
+        r.clear();
+    }
+}
+
+learned_cache :: learned_cache(uint64_t max_bytes)
+    : shard_bytes(max_bytes / LEARNED_CACHE_SHARDS)
+    , shards()
+{
+}
+
+bool
+learned_cache :: get(const e::slice& k, uint64_t* ver, std::string* val)
+{
+    shard* s = get_shard(k);
+    po6::threads::mutex::hold hold(&s->mtx);
+    std::map<std::string, entry>::iterator it = s->entries.find(k.str());
+
+    if (it == s->entries.end())
+    {
+        ++s->misses;
+        return false;
+    }
+
+    ++s->hits;
+    s->lru.splice(s->lru.begin(), s->lru, it->second.lru);
+    *ver = it->second.ver;
+    *val = it->second.val;
+    return true;
+}
+
+void
+learned_cache :: put(const e::slice& k, uint64_t ver, const e::slice& val)
+{
+    if (shard_bytes == 0)
+    {
+        return;
+    }
+
+    shard* s = get_shard(k);
+    po6::threads::mutex::hold hold(&s->mtx);
+    std::map<std::string, entry>::iterator it = s->entries.find(k.str());
+
+    // a value too big to cache replaces, and so evicts, an older one
+    if (k.size() + val.size() > shard_bytes)
+    {
+        if (it != s->entries.end() && it->second.ver <= ver)
+        {
+            s->bytes -= it->first.size() + it->second.val.size();
+            s->lru.erase(it->second.lru);
+            s->entries.erase(it);
+        }
+
+        return;
+    }
+
+    if (it == s->entries.end())
+    {
+        it = s->entries.insert(std::make_pair(k.str(), entry())).first;
+        s->lru.push_front(it->first);
+        it->second.lru = s->lru.begin();
+        s->bytes += k.size();
+    }
+    else if (it->second.ver > ver)
+    {
+        return;
+    }
+    else
+    {
+        s->lru.splice(s->lru.begin(), s->lru, it->second.lru);
+        s->bytes -= it->second.val.size();
+    }
+
+    it->second.ver = ver;
+    it->second.val.assign(val.cdata(), val.size());
+    s->bytes += val.size();
+    evict(s);
+}
+
+void
+learned_cache :: stats(uint64_t* hits, uint64_t* misses, uint64_t* bytes)
+{
+    *hits = 0;
+    *misses = 0;
+    *bytes = 0;
+
+    for (size_t i = 0; i < LEARNED_CACHE_SHARDS; ++i)
+    {
+        po6::threads::mutex::hold hold(&shards[i].mtx);
+        *hits += shards[i].hits;
+        *misses += shards[i].misses;
+        *bytes += shards[i].bytes;
+    }
+}
+
+learned_cache::shard*
+learned_cache :: get_shard(const e::slice& k)
+{
+    // the top bits, so shards stay independent of the acceptor stripes
+    return &shards[(key_hash(k) >> 32) % LEARNED_CACHE_SHARDS];
+}
+
+void
+learned_cache :: evict(shard* s)
+{
+    while (s->bytes > shard_bytes && !s->lru.empty())
+    {
+        std::map<std::string, entry>::iterator it = s->entries.find(s->lru.back());
+        s->bytes -= it->first.size() + it->second.val.size();
+        s->lru.pop_back();
+        s->entries.erase(it);
+    }
+}
+
+daemon_stats :: daemon_stats()
+    : puts()
+    , gets()
+    , read_probes()
+    , read_repairs()
+    , rounds()
+    , phase1_rounds()
+    , retries()
+    , orphans()
+    , busy()
+    , learns()
+    , syncs()
+    , sync_failures()
+    , ae_rounds()
+    , ae_mismatched()
+    , ae_pushed()
+    , acceptors_retired()
+    , backoffs()
+    , livelocks()
+    , forwarded()
+    , commit_notices()
+    , notice_pulls()
+    , lease_reads()
+    , lease_misses()
+    , lease_waits()
+    , client_queued()
+    , client_throttled()
+    , client_refused()
+    , phase1_us()
+    , phase2_us()
+    , sync_us()
+    , sync_writes()
+    , queue_depth()
+{
+}
+
+void
+daemon_stats :: record(histogram* h, uint64_t v)
+{
+    e::atomic::increment_64_nobarrier(&h->counts[histogram::bucket(v)], 1);
+    e::atomic::increment_64_nobarrier(&h->total, 1);
+    uint64_t m = e::atomic::load_64_nobarrier(&h->maximum);
+
+    while (v > m)
+    {
+        const uint64_t witnessed = e::atomic::compare_and_swap_64_nobarrier(&h->maximum, m, v);
+
+        if (witnessed == m)
+        {
+            break;
+        }
+
+        m = witnessed;
+    }
+}
+
+static void
+summarize(const char* name, histogram* h,
+          std::vector<std::pair<std::string, uint64_t> >* out)
+{
+    histogram copy;
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        copy.counts[i] = e::atomic::load_64_nobarrier(&h->counts[i]);
+        copy.total += copy.counts[i];
+    }
+
+    copy.maximum = e::atomic::load_64_nobarrier(&h->maximum);
+    const std::string n(name);
+    out->push_back(std::make_pair(n + ".count", copy.total));
+    out->push_back(std::make_pair(n + ".p50", copy.percentile(0.5)));
+    out->push_back(std::make_pair(n + ".p99", copy.percentile(0.99)));
+    out->push_back(std::make_pair(n + ".p999", copy.percentile(0.999)));
+    out->push_back(std::make_pair(n + ".max", copy.maximum));
+}
+
+void
+daemon_stats :: snapshot(std::vector<std::pair<std::string, uint64_t> >* out)
+{
+#define STAT_COUNTER(X) out->push_back(std::make_pair(std::string(#X), e::atomic::load_64_nobarrier(&X)))
+    STAT_COUNTER(puts);
+    STAT_COUNTER(gets);
+    STAT_COUNTER(read_probes);
+    STAT_COUNTER(read_repairs);
+    STAT_COUNTER(rounds);
+    STAT_COUNTER(phase1_rounds);
+    STAT_COUNTER(retries);
+    STAT_COUNTER(orphans);
+    STAT_COUNTER(busy);
+    STAT_COUNTER(learns);
+    STAT_COUNTER(syncs);
+    STAT_COUNTER(sync_failures);
+    STAT_COUNTER(ae_rounds);
+    STAT_COUNTER(ae_mismatched);
+    STAT_COUNTER(ae_pushed);
+    STAT_COUNTER(acceptors_retired);
+    STAT_COUNTER(backoffs);
+    STAT_COUNTER(livelocks);
+    STAT_COUNTER(forwarded);
+    STAT_COUNTER(commit_notices);
+    STAT_COUNTER(notice_pulls);
+    STAT_COUNTER(lease_reads);
+    STAT_COUNTER(lease_misses);
+    STAT_COUNTER(lease_waits);
+    STAT_COUNTER(client_queued);
+    STAT_COUNTER(client_throttled);
+    STAT_COUNTER(client_refused);
+#undef STAT_COUNTER
+    summarize("phase1_us", &phase1_us, out);
+    summarize("phase2_us", &phase2_us, out);
+    summarize("sync_us", &sync_us, out);
+    summarize("sync_writes", &sync_writes, out);
+    summarize("queue_depth", &queue_depth, out);
+}
+
+// counts learns on this thread, for sampling without shared state
+__thread uint64_t s_trace_tick = 0;
+
+tracer :: tracer(uint64_t s, bool v)
+    : sample(s)
+    , values(v)
+    , mtx()
+    , cond(&mtx)
+    , stop(false)
+    , queue()
+    , dropped(0)
+    , writer(po6::threads::make_obj_func(&tracer::trace_loop, this))
+{
+}
+
+tracer :: ~tracer() throw ()
+{
+}
+
+void
+tracer :: start()
+{
+    writer.start();
+}
+
+void
+tracer :: shutdown()
+{
+    {
+        po6::threads::mutex::hold hold(&mtx);
+        stop = true;
+        cond.broadcast();
+    }
+
+    writer.join();
+}
+
+void
+tracer :: learn(const e::slice& k, uint64_t ver, const e::slice& v)
+{
+    if (sample == 0 || ++s_trace_tick % sample != 0)
+    {
+        return;
+    }
+
+    po6::threads::mutex::hold hold(&mtx);
+
+    if (queue.size() >= TRACE_QUEUE_MAX)
+    {
+        e::atomic::increment_64_nobarrier(&dropped, 1);
+        return;
+    }
+
+    queue.push_back(record());
+    record& r(queue.back());
+    r.key.assign(k.cdata(), k.size());
+    r.ver = ver;
+    r.size = v.size();
+
+    if (values)
+    {
+        r.value.assign(v.cdata(), v.size());
+    }
+
+    cond.signal();
+}
+
+void
+tracer :: trace_loop()
+{
+    std::vector<record> q;
+
+    while (true)
+    {
+        {
+            po6::threads::mutex::hold hold(&mtx);
+
+            while (!stop && queue.empty())
+            {
+                cond.wait();
+            }
+
+            if (stop && queue.empty())
+            {
+                return;
+            }
+
+            q.swap(queue);
+        }
+
+        for (size_t i = 0; i < q.size(); ++i)
+        {
+            if (values)
+            {
+                LOG(INFO) << "learn key=\"" << e::strescape(q[i].key) << "\" ver=" << q[i].ver
+                          << " size=" << q[i].size << " value=\"" << e::strescape(q[i].value) << "\"";
+            }
+            else
+            {
+                LOG(INFO) << "learn key=\"" << e::strescape(q[i].key) << "\" ver=" << q[i].ver
+                          << " size=" << q[i].size;
+            }
+        }
+
+        q.clear();
+    }
+}
+
+anti_entropy :: anti_entropy(pocdaemon* _d, uint64_t _interval, uint64_t _rate)
+    : d(_d)
+    , interval(_interval)
+    , rate(_rate)
+    , mtx()
+    , cond(&mtx)
+    , stop(false)
+    , have_digests(false)
+    , digest(NUM_SLOTS)
+    , requests()
+    , worker(po6::threads::make_obj_func(&anti_entropy::ae_loop, this))
+{
+}
+
+anti_entropy :: ~anti_entropy() throw ()
+{
+}
+
+void
+anti_entropy :: start()
+{
+    if (interval > 0)
+    {
+        worker.start();
+    }
+}
+
+void
+anti_entropy :: shutdown()
+{
+    if (interval > 0)
+    {
+        {
+            po6::threads::mutex::hold hold(&mtx);
+            stop = true;
+            cond.broadcast();
+        }
+
+        worker.join();
+    }
+}
+
+void
+anti_entropy :: digests(uint64_t from, e::unpacker up)
+{
+    uint32_t n;
+    up = up >> n;
+    CHECK_UNPACK(up);
+    std::vector<uint32_t> differ;
+
+    {
+        po6::threads::mutex::hold hold(&mtx);
+
+        if (!have_digests)
+        {
+            return;
+        }
+
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            uint32_t slot;
+            uint64_t dig;
+            up = up >> slot >> dig;
+            CHECK_UNPACK(up);
+
+            if (slot < NUM_SLOTS && is_replica(slot, d->host) &&
+                is_replica(slot, from) && digest[slot] != dig)
+            {
+                differ.push_back(slot);
+            }
+        }
+    }
+
+    if (differ.empty())
+    {
+        return;
+    }
+
+    e::atomic::increment_64_nobarrier(&d->stats.ae_mismatched, differ.size());
+    const size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint32_t)
+                    + differ.size() * sizeof(uint32_t);
+    std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+    e::packer pa = msg->pack_at(BUSYBEE_HEADER_SIZE);
+    pa = pa << uint8_t('M') << uint32_t(differ.size());
+
+    for (size_t i = 0; i < differ.size(); ++i)
+    {
+        pa = pa << differ[i];
+    }
+
+    d->send(from, msg);
+}
+
+void
+anti_entropy :: mismatched(uint64_t from, e::unpacker up)
+{
+    uint32_t n;
+    up = up >> n;
+    CHECK_UNPACK(up);
+    std::vector<bool> want(NUM_SLOTS, false);
+
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        uint32_t slot;
+        up = up >> slot;
+        CHECK_UNPACK(up);
+
+        if (slot < NUM_SLOTS && is_replica(slot, d->host) && is_replica(slot, from))
+        {
+            want[slot] = true;
+        }
+    }
+
+    // scanning is the worker's job, never a network thread's
+    po6::threads::mutex::hold hold(&mtx);
+    requests.push_back(std::make_pair(from, want));
+    cond.signal();
+}
+
+void
+anti_entropy :: versions(uint64_t from, e::unpacker up)
+{
+    uint32_t n;
+    up = up >> n;
+    CHECK_UNPACK(up);
+    std::vector<e::slice> wanted;
+
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        e::slice k;
+        uint64_t theirs;
+        up = up >> k >> theirs;
+        CHECK_UNPACK(up);
+
+        // only the slot's replicas trade its records
+        if (!is_replica(key_slot(k), d->host) || !is_replica(key_slot(k), from))
+        {
+            continue;
+        }
+
+        uint64_t ours;
+        std::string val;
+        pocdb_returncode rc = d->get_learned(k, &ours, &val);
+
+        if (rc == POCDB_SUCCESS && ours > theirs)
+        {
+            const size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint64_t)
+                            + pack_size(k) + pack_size(e::slice(val));
+            std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+            msg->pack_at(BUSYBEE_HEADER_SIZE)
+                << uint8_t('L') << k << ours << e::slice(val);
+            d->send(from, msg);
+            daemon_stats::count(&d->stats.ae_pushed);
+        }
+        else if (rc == POCDB_NOT_FOUND || (rc == POCDB_SUCCESS && ours < theirs))
+        {
+            wanted.push_back(k);
+        }
+    }
+
+    if (wanted.empty())
+    {
+        return;
+    }
+
+    size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint32_t);
+
+    for (size_t i = 0; i < wanted.size(); ++i)
+    {
+        sz += pack_size(wanted[i]);
+    }
+
+    std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+    e::packer pa = msg->pack_at(BUSYBEE_HEADER_SIZE);
+    pa = pa << uint8_t('Q') << uint32_t(wanted.size());
+
+    for (size_t i = 0; i < wanted.size(); ++i)
+    {
+        pa = pa << wanted[i];
+    }
+
+    d->send(from, msg);
+}
+
+void
+anti_entropy :: pull(uint64_t from, e::unpacker up)
+{
+    uint32_t n;
+    up = up >> n;
+    CHECK_UNPACK(up);
+
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        e::slice k;
+        up = up >> k;
+        CHECK_UNPACK(up);
+        uint64_t ver;
+        std::string val;
+
+        if (!is_replica(key_slot(k), d->host) || !is_replica(key_slot(k), from) ||
+            d->get_learned(k, &ver, &val) != POCDB_SUCCESS)
+        {
+            continue;
+        }
+
+        const size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint64_t)
+                        + pack_size(k) + pack_size(e::slice(val));
+        std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE)
+            << uint8_t('L') << k << ver << e::slice(val);
+        d->send(from, msg);
+        daemon_stats::count(&d->stats.ae_pushed);
+    }
+}
+
+void
+anti_entropy :: ae_loop()
+{
+    uint64_t next_round = po6::monotonic_time() + interval;
+
+    while (true)
+    {
+        std::pair<uint64_t, std::vector<bool> > req;
+
+        {
+            po6::threads::mutex::hold hold(&mtx);
+
+            uint64_t now;
+
+            while (!stop && requests.empty() && (now = po6::monotonic_time()) < next_round)
+            {
+                cond.wait(next_round - now);
+            }
+
+            if (stop)
+            {
+                return;
+            }
+
+            if (!requests.empty())
+            {
+                req = requests.front();
+                requests.pop_front();
+            }
+        }
+
+        if (req.first != 0)
+        {
+            scan(&req.second, NULL, req.first);
+            continue;
+        }
+
+        std::vector<uint64_t> dig(NUM_SLOTS, 0);
+        scan(NULL, &dig, 0);
+        daemon_stats::count(&d->stats.ae_rounds);
+
+        {
+            po6::threads::mutex::hold hold(&mtx);
+            digest.swap(dig);
+            have_digests = true;
+        }
+
+        for (unsigned h = 0; h < NUM_HOSTS; ++h)
+        {
+            const uint64_t peer = HOSTS[h];
+            std::vector<uint32_t> shared;
+
+            for (uint32_t slot = 0; peer != d->host && slot < NUM_SLOTS; ++slot)
+            {
+                if (is_replica(slot, d->host) && is_replica(slot, peer))
+                {
+                    shared.push_back(slot);
+                }
+            }
+
+            if (shared.empty())
+            {
+                continue;
+            }
+
+            const size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint32_t)
+                            + shared.size() * (sizeof(uint32_t) + sizeof(uint64_t));
+            std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+            e::packer pa = msg->pack_at(BUSYBEE_HEADER_SIZE);
+            pa = pa << uint8_t('D') << uint32_t(shared.size());
+
+            for (size_t i = 0; i < shared.size(); ++i)
+            {
+                pa = pa << shared[i] << digest[shared[i]];
+            }
+
+            d->send(peer, msg);
+        }
+
+        next_round = po6::monotonic_time() + interval;
+    }
+}
+
+void
+anti_entropy :: scan(const std::vector<bool>* want, std::vector<uint64_t>* dig, uint64_t to)
+{
+    // batches of versions are kept well under the envelope limit
+    const size_t max_batch = BATCH_MAX_SIZE / 4;
+    std::vector<std::pair<std::string, uint64_t> > batch;
+    size_t batch_sz = 0;
+    const uint64_t began = po6::monotonic_time();
+    uint64_t records = 0;
+    leveldb::ReadOptions opts;
+    opts.fill_cache = false;
+    std::auto_ptr<leveldb::Iterator> it(d->learned_db->NewIterator(opts));
+
+    for (it->SeekToFirst(); it->Valid(); it->Next())
+    {
+        const leveldb::Slice key = it->key();
+
+        if (key.size() == 0 || key[key.size() - 1] != LEARNED_TAG)
+        {
+            continue;
+        }
+
+        const e::slice k(key.data(), key.size() - 1);
+        const unsigned slot = key_slot(k);
+        uint64_t ver;
+        size_t off;
+
+        if ((want && !(*want)[slot]) ||
+            !decode_learned(e::slice(it->value().data(), it->value().size()), &ver, &off))
+        {
+            continue;
+        }
+
+        if (dig)
+        {
+            // mix so that equal keys at different versions differ widely
+            uint64_t h = key_hash(k) ^ (ver * 0x9e3779b97f4a7c15ULL);
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            (*dig)[slot] ^= h;
+        }
+
+        if (to)
+        {
+            batch.push_back(std::make_pair(k.str(), ver));
+            batch_sz += pack_size(k) + sizeof(uint64_t);
+        }
+
+        if (to && (batch_sz >= max_batch))
+        {
+            send_versions(to, &batch);
+            batch_sz = 0;
+        }
+
+        if (++records % 1024 == 0)
+        {
+            throttle(began, records);
+        }
+    }
+
+    if (!it->status().ok())
+    {
+        LOG(ERROR) << "anti-entropy scan failed: " << it->status().ToString();
+    }
+
+    if (to && !batch.empty())
+    {
+        send_versions(to, &batch);
+    }
+}
+
+void
+anti_entropy :: send_versions(uint64_t to, std::vector<std::pair<std::string, uint64_t> >* batch)
+{
+    size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint32_t);
+
+    for (size_t i = 0; i < batch->size(); ++i)
+    {
+        sz += pack_size(e::slice((*batch)[i].first)) + sizeof(uint64_t);
+    }
+
+    std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+    e::packer pa = msg->pack_at(BUSYBEE_HEADER_SIZE);
+    pa = pa << uint8_t('K') << uint32_t(batch->size());
+
+    for (size_t i = 0; i < batch->size(); ++i)
+    {
+        pa = pa << e::slice((*batch)[i].first) << (*batch)[i].second;
+    }
+
+    d->send(to, msg);
+    batch->clear();
+}
+
+void
+anti_entropy :: throttle(uint64_t began, uint64_t records)
+{
+    const uint64_t due = began + records * PO6_SECONDS / rate;
+    const uint64_t now = po6::monotonic_time();
+
+    if (due > now)
+    {
+        struct timespec ts;
+        ts.tv_sec = (due - now) / PO6_SECONDS;
+        ts.tv_nsec = (due - now) % PO6_SECONDS;
+        nanosleep(&ts, NULL);
+    }
+}
+
+timer_wheel :: timer_wheel(pocdaemon* _d)
+    : d(_d)
+    , mtx()
+    , cond(&mtx)
+    , stop(false)
+    , cursor(0)
+    , ticker(po6::threads::make_obj_func(&timer_wheel::timer_loop, this))
+{
+}
+
+timer_wheel :: ~timer_wheel() throw ()
+{
+}
+
+void
+timer_wheel :: start()
+{
+    ticker.start();
+}
+
+void
+timer_wheel :: shutdown()
+{
+    {
+        po6::threads::mutex::hold hold(&mtx);
+        stop = true;
+        cond.broadcast();
+    }
+
+    ticker.join();
+}
+
+void
+timer_wheel :: schedule(const std::string& key, uint64_t delay)
+{
+    const uint64_t ticks = std::max(uint64_t(delay / TIMER_TICK), uint64_t(1));
+    po6::threads::mutex::hold hold(&mtx);
+    const size_t slot = (cursor + ticks) % TIMER_WHEEL_SLOTS;
+    slots[slot].push_back(std::make_pair((ticks - 1) / TIMER_WHEEL_SLOTS, key));
+}
+
+void
+timer_wheel :: timer_loop()
+{
+    e::garbage_collector::thread_state ts;
+    d->gc.register_thread(&ts);
+    std::vector<std::string> expired;
+    uint64_t next_tick = po6::monotonic_time() + TIMER_TICK;
+
+    while (true)
+    {
+        {
+            po6::threads::mutex::hold hold(&mtx);
+            uint64_t now;
+
+            while (!stop && (now = po6::monotonic_time()) < next_tick)
+            {
+                cond.wait(next_tick - now);
+            }
+
+            if (stop)
+            {
+                break;
+            }
+
+            cursor = (cursor + 1) % TIMER_WHEEL_SLOTS;
+            std::vector<std::pair<uint64_t, std::string> >& s(slots[cursor]);
+            size_t kept = 0;
+
+            for (size_t i = 0; i < s.size(); ++i)
+            {
+                if (s[i].first == 0)
+                {
+                    expired.push_back(s[i].second);
+                }
+                else
+                {
+                    --s[i].first;
+                    s[kept++] = s[i];
+                }
+            }
+
+            s.resize(kept);
+        }
+
+        // a stalled tick catches up rather than drifting
+        next_tick += TIMER_TICK;
+        outbox ob(acquire_buffer, release_buffer);
+        s_outbox = &ob;
+
+        for (size_t i = 0; i < expired.size(); ++i)
+        {
+            pocdaemon::write_map_t::state_reference sr;
+            const uint64_t h = key_hash(e::slice(expired[i]));
+            write_state_machine* sm = d->write_map(h).get_state(expired[i], &sr);
+
+            if (sm)
+            {
+                sm->resume(d);
+            }
+        }
+
+        s_outbox = NULL;
+        d->send(&ob);
+        expired.clear();
+        d->gc.quiescent_state(&ts);
+    }
+
+    d->gc.deregister_thread(&ts);
+}
+
+lease_table :: lease_table(pocdaemon* _d, uint64_t _term, uint64_t _skew)
+    : d(_d)
+    , term(_term)
+    , skew(_skew)
+    , locks()
+    , slots()
+{
+}
+
+bool
+lease_table :: held(unsigned slot, const e::slice& k)
+{
+    if (term == 0)
+    {
+        return false;
+    }
+
+    const uint64_t now = po6::monotonic_time();
+    const std::string key(k.str());
+    bool valid;
+    bool ask = false;
+    bool check = false;
+
+    {
+        po6::threads::mutex::hold hold(&locks[slot % LEASE_LOCK_STRIPES]);
+        slot_lease* sl = &slots[slot];
+        valid = now < sl->until && sl->checked.find(key) != sl->checked.end();
+
+        // check the key once the lease is in force, and again should a
+        // grantor's answer go missing
+        if (now < sl->until && !valid)
+        {
+            std::map<std::string, key_check>::iterator it = sl->checking.find(key);
+
+            if (it == sl->checking.end() || it->second.asked + term / 2 <= now)
+            {
+                sl->checking[key] = key_check(now);
+                check = true;
+            }
+        }
+
+        // renew once half the lease is gone, asking at most every half term;
+        // leases on slots nobody reads are left to lapse
+        if (sl->until < now + term / 2 && sl->asked + term / 2 <= now)
+        {
+            sl->asked = now;
+            ask = true;
+        }
+    }
+
+    std::vector<uint64_t> to;
+
+    for (unsigned i = 0; (ask || check) && i < REPLICAS; ++i)
+    {
+        to.push_back(slot_replica(slot, i));
+    }
+
+    if (ask)
+    {
+        const size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint32_t) + sizeof(uint64_t);
+        std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('E') << uint32_t(slot) << now;
+        d->send(to, msg);
+    }
+
+    if (check)
+    {
+        const size_t sz = BUSYBEE_HEADER_SIZE
+                        + 1 + sizeof(uint32_t) + sizeof(uint64_t)
+                        + pack_size(k);
+        std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+        msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('v') << uint32_t(slot) << now << k;
+        d->send(to, msg);
+    }
+
+    return valid;
+}
+
+bool
+lease_table :: acknowledges(unsigned slot)
+{
+    if (term == 0)
+    {
+        return false;
+    }
+
+    // a grant lasts term + skew from when the grantor heard the ask
+    po6::threads::mutex::hold hold(&locks[slot % LEASE_LOCK_STRIPES]);
+    return slots[slot].asked != 0 &&
+           po6::monotonic_time() < slots[slot].asked + 2 * (term + skew);
+}
+
+void
+lease_table :: granted(uint64_t grantor, unsigned slot, uint64_t asked)
+{
+    const unsigned idx = replica_index(slot, grantor);
+
+    if (term == 0 || idx >= REPLICAS)
+    {
+        return;
+    }
+
+    const uint64_t now = po6::monotonic_time();
+    po6::threads::mutex::hold hold(&locks[slot % LEASE_LOCK_STRIPES]);
+    slot_lease* sl = &slots[slot];
+    sl->holding[idx] = std::max(sl->holding[idx], asked + term);
+    // the lease lasts as long as the quorum's shortest grant
+    uint64_t ends[REPLICAS];
+    std::copy(sl->holding, sl->holding + REPLICAS, ends);
+    std::sort(ends, ends + REPLICAS);
+    const uint64_t until = ends[REPLICAS - QUORUM];
+
+    if (until <= now)
+    {
+        return;
+    }
+
+    // a lease that lapsed is a fresh lease, whose keys need checking anew
+    if (sl->until <= now)
+    {
+        sl->checked.clear();
+        sl->checking.clear();
+    }
+
+    sl->until = until;
+}
+
+void
+lease_table :: checked(uint64_t grantor, unsigned slot, uint64_t asked,
+                       const e::slice& k, bool ok, uint64_t ver)
+{
+    if (term == 0 || replica_index(slot, grantor) >= REPLICAS)
+    {
+        return;
+    }
+
+    const std::string key(k.str());
+    uint64_t newest;
+
+    {
+        po6::threads::mutex::hold hold(&locks[slot % LEASE_LOCK_STRIPES]);
+        slot_lease* sl = &slots[slot];
+        std::map<std::string, key_check>::iterator it = sl->checking.find(key);
+
+        // answers to an earlier check, or to one the lease outlived, are stale
+        if (it == sl->checking.end() || it->second.asked != asked)
+        {
+            return;
+        }
+
+        key_check* kc = &it->second;
+
+        if (!ok)
+        {
+            if (++kc->refused > REPLICAS - QUORUM)
+            {
+                sl->checking.erase(it);
+            }
+
+            return;
+        }
+
+        kc->ver = std::max(kc->ver, ver);
+
+        if (++kc->answered != QUORUM)
+        {
+            return;
+        }
+
+        newest = kc->ver;
+    }
+
+    // this host must have learned the newest version its grantors learned;
+    // if it has yet to, the next get checks the key again
+    uint64_t mine;
+    std::string val;
+    const bool current = d->get_learned(k, &mine, &val) != POCDB_SERVER_ERROR &&
+                         mine >= newest;
+    po6::threads::mutex::hold hold(&locks[slot % LEASE_LOCK_STRIPES]);
+    slot_lease* sl = &slots[slot];
+    std::map<std::string, key_check>::iterator it = sl->checking.find(key);
+
+    if (it == sl->checking.end() || it->second.asked != asked)
+    {
+        return;
+    }
+
+    sl->checking.erase(it);
+
+    if (current)
+    {
+        if (sl->checked.size() >= LEASE_CHECKED_KEYS)
+        {
+            sl->checked.clear();
+        }
+
+        sl->checked.insert(key);
+    }
+}
+
+void
+lease_table :: grant(uint64_t holder, unsigned slot, uint64_t asked)
+{
+    const unsigned idx = replica_index(slot, holder);
+
+    if (term == 0 || idx >= REPLICAS)
+    {
+        return;
+    }
+
+    {
+        po6::threads::mutex::hold hold(&locks[slot % LEASE_LOCK_STRIPES]);
+        uint64_t* g = &slots[slot].granting[idx];
+        *g = std::max(*g, po6::monotonic_time() + term + skew);
+    }
+
+    const size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint32_t) + sizeof(uint64_t);
+    std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+    msg->pack_at(BUSYBEE_HEADER_SIZE) << uint8_t('e') << uint32_t(slot) << asked;
+    d->send(holder, msg);
+}
+
+bool
+lease_table :: grants(uint64_t holder, unsigned slot)
+{
+    const unsigned idx = replica_index(slot, holder);
+
+    if (term == 0 || idx >= REPLICAS)
+    {
+        return false;
+    }
+
+    po6::threads::mutex::hold hold(&locks[slot % LEASE_LOCK_STRIPES]);
+    return po6::monotonic_time() < slots[slot].granting[idx];
+}
+
+void
+lease_table :: holders(unsigned slot, std::vector<std::pair<uint64_t, uint64_t> >* out)
+{
+    if (term == 0)
+    {
+        return;
+    }
+
+    const uint64_t now = po6::monotonic_time();
+    po6::threads::mutex::hold hold(&locks[slot % LEASE_LOCK_STRIPES]);
+
+    for (unsigned i = 0; i < REPLICAS; ++i)
+    {
+        if (slots[slot].granting[i] > now)
+        {
+            out->push_back(std::make_pair(slot_replica(slot, i), slots[slot].granting[i] - now));
+        }
+    }
+}
+
+scheduler :: scheduler(pocdaemon* _d, uint64_t r, uint64_t b, uint64_t mb)
+    : d(_d)
+    , rate(r)
+    , interval(r ? std::max(uint64_t(PO6_SECONDS) / r, uint64_t(1)) : 0)
+    , burst(b)
+    , max_bytes(mb)
+    , mtx()
+    , clients()
+    , active()
+{
+}
+
+bool
+scheduler :: enqueue(uint64_t c, const buffer_ref& msg, uint64_t puts, uint64_t now)
+{
+    po6::threads::mutex::hold hold(&mtx);
+    client_map_t::iterator it = clients.find(c);
+
+    if (it == clients.end())
+    {
+        if (clients.size() >= SCHEDULER_SWEEP)
+        {
+            // forget idle clients whose buckets have refilled
+            for (client_map_t::iterator i = clients.begin(); i != clients.end(); )
+            {
+                refill(&i->second, now);
+
+                if (!i->second.active && i->second.tokens >= int64_t(burst))
+                {
+                    clients.erase(i++);
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+        }
+
+        it = clients.insert(std::make_pair(c, client_queue())).first;
+        it->second.tokens = burst;
+        it->second.refilled = now;
+    }
+
+    client_queue* q = &it->second;
+
+    // a client with nothing queued is always admitted
+    if (q->bytes > 0 && q->bytes + msg->size() > max_bytes)
+    {
+        return false;
+    }
+
+    q->requests.push_back(request(msg, puts));
+    q->bytes += msg->size();
+    daemon_stats::count(&d->stats.client_queued);
+
+    if (!q->active)
+    {
+        q->active = true;
+        active.push_back(it);
+    }
+
+    return true;
+}
+
+bool
+scheduler :: dequeue(uint64_t now, uint64_t* c, buffer_ref* msg, uint64_t* wait)
+{
+    po6::threads::mutex::hold hold(&mtx);
+    size_t blocked = 0;
+
+    while (!active.empty() && blocked < active.size())
+    {
+        client_map_t::iterator it = active.front();
+        client_queue* q = &it->second;
+        const request& r(q->requests.front());
+        const uint64_t need = shortfall(q, now);
+
+        if (need > 0)
+        {
+            // sits out this turn, keeping its deficit
+            *wait = std::min(*wait, need);
+            daemon_stats::count(&d->stats.client_throttled);
+            ++blocked;
+            active.splice(active.end(), active, active.begin());
+            continue;
+        }
+
+        blocked = 0;
+
+        if (r.msg->size() > q->deficit)
+        {
+            q->deficit += SCHEDULER_QUANTUM;
+            active.splice(active.end(), active, active.begin());
+            continue;
+        }
+
+        *c = it->first;
+        *msg = r.msg;
+        q->deficit -= r.msg->size();
+        q->bytes -= r.msg->size();
+        q->tokens -= rate ? int64_t(r.puts) : 0;
+        q->requests.pop_front();
+
+        if (q->requests.empty())
+        {
+            q->deficit = 0;
+            q->active = false;
+            active.pop_front();
+
+            if (rate == 0)
+            {
+                clients.erase(it);
+            }
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+void
+scheduler :: refill(client_queue* q, uint64_t now)
+{
+    if (rate == 0 || now <= q->refilled)
+    {
+        return;
+    }
+
+    const uint64_t tokens = (now - q->refilled) / interval;
+
+    if (q->tokens + int64_t(std::min(tokens, burst)) >= int64_t(burst))
+    {
+        q->tokens = burst;
+        q->refilled = now;
+    }
+    else
+    {
+        q->tokens += tokens;
+        q->refilled += tokens * interval;
+    }
+}
+
+uint64_t
+scheduler :: shortfall(client_queue* q, uint64_t now)
+{
+    const uint64_t puts = q->requests.front().puts;
+
+    if (rate == 0 || puts == 0)
+    {
+        return 0;
+    }
+
+    refill(q, now);
+    // a request holding more than a burst waits for a full bucket, then
+    // leaves the bucket in debt
+    const int64_t need = int64_t(std::min(puts, burst));
+
+    if (q->tokens >= need)
+    {
+        return 0;
+    }
+
+    return uint64_t(need - q->tokens) * interval - (now - q->refilled);
+}
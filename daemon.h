@@ -0,0 +1,1004 @@
+// Copyright (c) 2017, Robert Escriva
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of pocdb nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef pocdb_daemon_h_
+#define pocdb_daemon_h_
+
+// C
+#include <stdlib.h>
+#include <string.h>
+
+// STL
+#include <new>
+#include <set>
+
+// Google Log
+#include <glog/logging.h>
+
+// LevelDB
+#include <leveldb/cache.h>
+#include <leveldb/comparator.h>
+#include <leveldb/db.h>
+#include <leveldb/filter_policy.h>
+#include <leveldb/write_batch.h>
+
+// po6
+#include <po6/threads/cond.h>
+#include <po6/threads/mutex.h>
+#include <po6/threads/thread.h>
+#include <po6/time.h>
+
+// e
+#include <e/atomic.h>
+#include <e/compat.h>
+#include <e/state_hash_table.h>
+
+// pocdb
+#include <pocdb.h>
+#include "common.h"
+#include "histogram.h"
+
+#define CHECK_UNPACK(UNPACKER) \
+    do \
+    { \
+        if (UNPACKER.error()) \
+        { \
+            LOG(WARNING) << __FILE__ << ":" << __LINE__ << " received corrupt message"; \
+            return; \
+        } \
+    } while (0)
+
+#define ACCEPTOR_LOCK_STRIPES 1024
+#define WRITE_MAP_SHARDS 64
+#define CACHE_LINE_SIZE 64
+
+struct pocdaemon;
+
+// Counters and histograms reported by the 'S' message.  Recording uses
+// relaxed atomics, so hot paths never take a lock for it; readers may see a
+// histogram mid-update, which is harmless for monitoring.
+struct daemon_stats
+{
+    daemon_stats();
+
+    static void count(uint64_t* c) { e::atomic::increment_64_nobarrier(c, 1); }
+    static void record(histogram* h, uint64_t v);
+    // a snapshot of everything, histograms summarized, as (name, value)
+    void snapshot(std::vector<std::pair<std::string, uint64_t> >* out);
+
+    uint64_t puts;
+    uint64_t gets;
+    uint64_t read_probes;
+    uint64_t read_repairs;
+    uint64_t rounds;
+    uint64_t phase1_rounds;
+    uint64_t retries;
+    // phase replies for keys with no round in progress
+    uint64_t orphans;
+    // puts refused because too many bytes were queued
+    uint64_t busy;
+    uint64_t learns;
+    uint64_t syncs;
+    uint64_t sync_failures;
+    // anti-entropy rounds, slots found to differ, and records sent
+    uint64_t ae_rounds;
+    uint64_t ae_mismatched;
+    uint64_t ae_pushed;
+    // acceptor records deleted once their version was learned
+    uint64_t acceptors_retired;
+    // backoffs after preemption, keys that were preempted repeatedly, and
+    // puts handed to the proposer that preempted this one
+    uint64_t backoffs;
+    uint64_t livelocks;
+    uint64_t forwarded;
+    // commit notices received, and those that had to pull the value
+    uint64_t commit_notices;
+    uint64_t notice_pulls;
+    // consistent gets served under a read lease, those that found no lease,
+    // and rounds that held their replies until lease holders learned them
+    uint64_t lease_reads;
+    uint64_t lease_misses;
+    uint64_t lease_waits;
+    // client messages that waited in the scheduler, turns a client sat out
+    // for want of tokens, and requests refused because its queue was full
+    uint64_t client_queued;
+    uint64_t client_throttled;
+    uint64_t client_refused;
+    // latencies in microseconds
+    histogram phase1_us;
+    histogram phase2_us;
+    histogram sync_us;
+    // writes per sync, and queued puts per key as each arrives
+    histogram sync_writes;
+    histogram queue_depth;
+
+    private:
+        daemon_stats(const daemon_stats&);
+        daemon_stats& operator = (const daemon_stats&);
+};
+
+struct ballot
+{
+    uint64_t number;
+    uint64_t leader;
+
+    bool operator < (const ballot& rhs) const
+    { return number < rhs.number ||
+             (number == rhs.number && leader < rhs.leader); }
+    bool operator == (const ballot& rhs) const
+    { return number == rhs.number && leader == rhs.leader; }
+    bool operator != (const ballot& rhs) const
+    { return !(*this == rhs); }
+    bool operator > (const ballot& rhs) const
+    { return rhs < *this; }
+};
+
+inline e::packer
+operator << (e::packer pa, const ballot& rhs)
+{
+    return pa << rhs.number << rhs.leader;
+}
+
+inline e::unpacker
+operator >> (e::unpacker up, ballot& rhs)
+{
+    return up >> rhs.number >> rhs.leader;
+}
+
+inline size_t
+pack_size(const ballot&)
+{
+    return 2 * sizeof(uint64_t);
+}
+
+typedef e::compat::shared_ptr<e::buffer> buffer_ref;
+
+// "v" points into "buf", which it keeps alive; copying a pvalue copies no
+// value bytes.  Unpacking sets only "v", so whoever unpacks one must also
+// set "buf" to the buffer it was unpacked from.
+struct pvalue
+{
+    pvalue() : b(), v(), buf() {}
+
+    ballot b;
+    e::slice v;
+    buffer_ref buf;
+};
+
+inline e::packer
+operator << (e::packer pa, const pvalue& rhs)
+{
+    return pa << rhs.b << rhs.v;
+}
+
+inline e::unpacker
+operator >> (e::unpacker up, pvalue& rhs)
+{
+    return up >> rhs.b >> rhs.v;
+}
+
+inline size_t
+pack_size(const pvalue& p)
+{
+    return pack_size(p.b) + pack_size(p.v);
+}
+
+// On-disk records.  Each of a key's records lives under the key followed by a
+// one-byte tag, and tagged_key_comparator keeps a key's records adjacent.  A
+// record starts with a format byte followed by varint fields, and the value,
+// if any, runs to the end:
+//   'A' acceptor:  format, ver, promised ballot, accepted ballot, accepted value
+//   'L' learned:   format, ver, value
+// A store also holds one 'F' record, under the empty key, naming the record
+// format it was created with.  Stores from before this layout used leveldb's
+// bytewise comparator, and leveldb refuses to open them under this one.
+#define RECORD_FORMAT 1
+#define ACCEPTOR_TAG 'A'
+#define LEARNED_TAG 'L'
+#define FORMAT_TAG 'F'
+
+class tagged_key_comparator : public leveldb::Comparator
+{
+    public:
+        tagged_key_comparator() {}
+        virtual ~tagged_key_comparator() throw () {}
+
+    public:
+        virtual int Compare(const leveldb::Slice& a, const leveldb::Slice& b) const;
+        virtual const char* Name() const { return "pocdb.TaggedKeyComparator.v1"; }
+        // keys are short, so index blocks keep them whole
+        virtual void FindShortestSeparator(std::string*, const leveldb::Slice&) const {}
+        virtual void FindShortSuccessor(std::string*) const {}
+};
+
+
+inline std::string
+record_key(const e::slice& k, char tag)
+{
+    std::string key;
+    key.reserve(k.size() + 1);
+    key.assign(k.cdata(), k.size());
+    key.push_back(tag);
+    return key;
+}
+
+inline void
+pack_varint(std::string* s, uint64_t x)
+{
+    while (x >= 0x80)
+    {
+        s->push_back(char(x | 0x80));
+        x >>= 7;
+    }
+
+    s->push_back(char(x));
+}
+
+inline bool
+unpack_varint(const uint8_t** p, const uint8_t* end, uint64_t* x)
+{
+    *x = 0;
+
+    for (unsigned shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        const uint8_t b = *(*p)++;
+        *x |= uint64_t(b & 0x7f) << shift;
+
+        if (!(b & 0x80))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+inline void
+encode_acceptor(std::string* rec, uint64_t ver, const ballot& b, const pvalue& v)
+{
+    rec->clear();
+    rec->reserve(1 + 5 * 10 + v.v.size());
+    rec->push_back(char(RECORD_FORMAT));
+    pack_varint(rec, ver);
+    pack_varint(rec, b.number);
+    pack_varint(rec, b.leader);
+    pack_varint(rec, v.b.number);
+    pack_varint(rec, v.b.leader);
+    rec->append(v.v.cdata(), v.v.size());
+}
+
+// v->v points into "rec"; the caller sets v->buf
+inline bool
+decode_acceptor(const e::slice& rec, uint64_t* ver, ballot* b, pvalue* v)
+{
+    const uint8_t* p = rec.data();
+    const uint8_t* end = p + rec.size();
+
+    if (p == end || *p++ != RECORD_FORMAT ||
+        !unpack_varint(&p, end, ver) ||
+        !unpack_varint(&p, end, &b->number) ||
+        !unpack_varint(&p, end, &b->leader) ||
+        !unpack_varint(&p, end, &v->b.number) ||
+        !unpack_varint(&p, end, &v->b.leader))
+    {
+        return false;
+    }
+
+    v->v = e::slice(p, end - p);
+    return true;
+}
+
+inline void
+encode_learned(std::string* rec, uint64_t ver, const e::slice& v)
+{
+    rec->clear();
+    rec->reserve(1 + 10 + v.size());
+    rec->push_back(char(RECORD_FORMAT));
+    pack_varint(rec, ver);
+    rec->append(v.cdata(), v.size());
+}
+
+// the value is the rest of the record from offset *off on
+inline bool
+decode_learned(const e::slice& rec, uint64_t* ver, size_t* off)
+{
+    const uint8_t* p = rec.data();
+    const uint8_t* end = p + rec.size();
+
+    if (p == end || *p++ != RECORD_FORMAT ||
+        !unpack_varint(&p, end, ver))
+    {
+        return false;
+    }
+
+    *off = p - rec.data();
+    return true;
+}
+
+// a client's put, queued until a round commits it; the value stays in the
+// client's message
+struct queued_put
+{
+    queued_put(uint64_t c, uint64_t n, const buffer_ref& b, const e::slice& v, uint64_t f)
+        : client(c), nonce(n), buf(b), value(v), forwarder(f) {}
+
+    uint64_t client;
+    uint64_t nonce;
+    buffer_ref buf;
+    e::slice value;
+    // the host that forwarded the put here and relays the reply, or zero
+    uint64_t forwarder;
+};
+
+// consecutive preemptions of a key after which its proposer forwards queued
+// puts to the ballot holder, and after which it counts as livelocked
+#define FORWARD_CONFLICTS 2
+#define LIVELOCK_CONFLICTS 4
+// the backoff window stops doubling after this many preemptions
+#define MAX_BACKOFF_SHIFT 8
+
+struct write_state_machine
+{
+    write_state_machine(const std::string& k);
+
+    // state machines come and go with every write burst, so they are
+    // recycled through a per-thread pool rather than the general heap
+    static void* operator new(size_t sz);
+    static void operator delete(void* p, size_t sz);
+
+    const std::string& state_key();
+    bool finished();
+    void write(uint64_t c, uint64_t nonce, const buffer_ref& buf, const e::slice& v,
+               uint64_t forwarder, pocdaemon* d);
+    void read(uint64_t c, uint64_t nonce, pocdaemon* d);
+    void phase1b(uint64_t c, uint64_t ver, const ballot& b, const pvalue& v, pocdaemon* d);
+    // "holders" are the read lease holders the acceptor granted, each with
+    // the time by which its lease has surely ended
+    void phase2b(uint64_t c, uint64_t ver, const ballot& b,
+                 const std::vector<std::pair<uint64_t, uint64_t> >& holders, pocdaemon* d);
+    void retry(uint64_t c, uint64_t ver, const ballot& b,
+               uint64_t cur_ver, const ballot& cur_b, pocdaemon* d);
+    // lease holder "c" learned version "ver"
+    void learned_by(uint64_t c, uint64_t ver, pocdaemon* d);
+
+    // the backoff or lease timer fired
+    void resume(pocdaemon* d);
+
+    void work_state_machine(pocdaemon* d);
+    // a higher ballot "by" took the key; back off before competing again
+    void preempted(const ballot& by, uint64_t next, pocdaemon* d);
+    void forward_values(uint64_t to, pocdaemon* d);
+    // every put leaves "values" through here, which returns the bytes that
+    // admitting it counted
+    std::list<queued_put>::iterator dequeue(std::list<queued_put>::iterator it, pocdaemon* d);
+    void reply_readers(uint64_t next, pocdaemon* d);
+    // the round committed and every lease holder learned it, or its lease
+    // ended; reply, and move on to the next version
+    void finish_commit(pocdaemon* d);
+
+    const std::string key;
+    // the slot of "key", whose replicas are this key's acceptors
+    const unsigned slot;
+    po6::threads::mutex mtx;
+    std::list<queued_put> values;
+    // consistent reads waiting for a round to start, and those that the
+    // current round answers; both are (client, nonce)
+    std::vector<std::pair<uint64_t, uint64_t> > readers;
+    std::vector<std::pair<uint64_t, uint64_t> > reading;
+
+    // paxos state
+    bool executing_paxos;
+    // a quorum promised "leading" and the promise carries to later versions
+    bool leader;
+    ballot leading;
+    std::vector<uint64_t> promises;
+    std::vector<uint64_t> accepted;
+    std::vector<uint64_t> rejected;
+    pvalue max_accepted;
+    uint64_t version;
+    // number of queued values, from the front, that the round commits
+    size_t proposed;
+    // when this round began, and when it began Phase 2 (zero if not yet)
+    uint64_t round_start;
+    uint64_t phase2_start;
+    // preemptions since this proposer last committed, and whether it is
+    // waiting out a backoff before its next round
+    unsigned conflicts;
+    bool backing_off;
+    // lease holders that must learn this round's value before any reply
+    // reveals it, and whether the committed round is waiting on them, at
+    // the latest until "holders_deadline"
+    std::vector<std::pair<uint64_t, uint64_t> > holders;
+    bool awaiting_holders;
+    uint64_t holders_deadline;
+
+    private:
+        write_state_machine(const write_state_machine&);
+        write_state_machine& operator = (const write_state_machine&);
+};
+
+// Collects acceptor and learner writes that arrive close together into a
+// single synchronous leveldb::WriteBatch.  Replies that depend upon those
+// writes are held until the batch containing them is durable.  Writes that
+// are staged but not yet durable are visible through "get" so that handlers
+// always see their own writes.  A batch that fails to sync stays staged, and
+// its replies held, while it is retried; a store that still cannot sync after
+// SYNC_RETRIES attempts brings down the daemon, whose handlers have already
+// acted on those writes.
+#define SYNC_RETRIES 8
+#define SYNC_RETRY_DELAY (10 * PO6_MILLIS)
+
+struct group_commit
+{
+    group_commit(pocdaemon* d, uint64_t max_delay, size_t max_batch);
+    ~group_commit() throw ();
+
+    void start();
+    void shutdown();
+
+    // takes the contents of "val" rather than copying them
+    void put(const std::string& key, std::string* val);
+    // a staged delete is an empty value; records are never empty
+    void del(const std::string& key);
+    bool get(const std::string& key, std::string* val);
+    // send msg to "to" once every write staged before this call is durable
+    void reply(uint64_t to, std::auto_ptr<e::buffer> msg);
+
+    void flush_loop();
+
+    pocdaemon* const d;
+    const uint64_t max_delay;
+    const size_t max_batch;
+    po6::threads::mutex mtx;
+    po6::threads::cond cond;
+    bool stop;
+    bool flushing;
+    uint64_t seqno;
+    uint64_t batch_start_seqno;
+    uint64_t batch_start;
+    std::vector<std::string> batch_keys;
+    std::vector<std::pair<uint64_t, e::buffer*> > replies;
+    std::map<std::string, std::pair<uint64_t, std::string> > pending;
+    po6::threads::thread flusher;
+
+    private:
+        group_commit(const group_commit&);
+        group_commit& operator = (const group_commit&);
+};
+
+// leveldb tuning for one store; sizes are in the units the flags take
+struct store_config
+{
+    store_config()
+        : block_cache(64), write_buffer(4), block_size(4)
+        , bloom_bits(10), compression("snappy") {}
+
+    // megabytes
+    long block_cache;
+    long write_buffer;
+    // kilobytes
+    long block_size;
+    // zero disables the bloom filter
+    long bloom_bits;
+    // "snappy" or "none"
+    const char* compression;
+};
+
+#define TRACE_QUEUE_MAX 4096
+
+// Traces learned writes from a background thread, so that formatting and
+// logging stay off the network threads.  One in "sample" learns is traced
+// (none if zero), value bytes only when asked for, and records are dropped
+// rather than queued without bound when the writer falls behind.
+struct tracer
+{
+    tracer(uint64_t sample, bool values);
+    ~tracer() throw ();
+
+    void start();
+    void shutdown();
+
+    void learn(const e::slice& k, uint64_t ver, const e::slice& v);
+    void trace_loop();
+
+    struct record
+    {
+        record() : key(), ver(), size(), value() {}
+        std::string key;
+        uint64_t ver;
+        uint64_t size;
+        std::string value;
+    };
+
+    const uint64_t sample;
+    const bool values;
+    po6::threads::mutex mtx;
+    po6::threads::cond cond;
+    bool stop;
+    std::vector<record> queue;
+    uint64_t dropped;
+    po6::threads::thread writer;
+
+    private:
+        tracer(const tracer&);
+        tracer& operator = (const tracer&);
+};
+
+// Anti-entropy brings replicas of a slot back into agreement.  Every round,
+// a host scans its learned records, digests each slot as the XOR of a hash of
+// every (key, version) it holds, and sends the digests to each peer that
+// replicates some of the same slots ('D').  The peer answers with the slots
+// whose digests differ ('M'), the host sends the versions it holds in those
+// slots ('K'), and the peer pushes the records it has newer ('L') and pulls
+// those it lacks ('Q').  Work is proportional to the slots that differ, and
+// scans are throttled to "rate" records per second.  Each message is acted
+// on only for slots that both its sender and this host replicate.
+struct anti_entropy
+{
+    anti_entropy(pocdaemon* d, uint64_t interval, uint64_t rate);
+    ~anti_entropy() throw ();
+
+    void start();
+    void shutdown();
+
+    void digests(uint64_t from, e::unpacker up);
+    void mismatched(uint64_t from, e::unpacker up);
+    void versions(uint64_t from, e::unpacker up);
+    void pull(uint64_t from, e::unpacker up);
+
+    void ae_loop();
+    // visit learned records of the slots in "want" (every slot if NULL),
+    // digesting them into "digest" or, if "to" is non-zero, sending "to"
+    // their versions
+    void scan(const std::vector<bool>* want, std::vector<uint64_t>* digest, uint64_t to);
+    void send_versions(uint64_t to, std::vector<std::pair<std::string, uint64_t> >* batch);
+    void throttle(uint64_t began, uint64_t records);
+
+    pocdaemon* const d;
+    const uint64_t interval;
+    const uint64_t rate;
+    po6::threads::mutex mtx;
+    po6::threads::cond cond;
+    bool stop;
+    // digests from the most recent round, if there has been one
+    bool have_digests;
+    std::vector<uint64_t> digest;
+    // peers asking for the versions held in a set of slots
+    std::list<std::pair<uint64_t, std::vector<bool> > > requests;
+    po6::threads::thread worker;
+
+    private:
+        anti_entropy(const anti_entropy&);
+        anti_entropy& operator = (const anti_entropy&);
+};
+
+#define TIMER_WHEEL_SLOTS 512
+#define TIMER_TICK PO6_MILLIS
+
+// A hashed timer wheel that wakes write state machines once their backoff
+// expires.  Each slot is one tick; a timer further out than one revolution
+// waits out the remaining revolutions in its slot.  Timers are keyed by the
+// state machine's key, so an expired timer for a state machine that has since
+// been collected is a no-op.
+struct timer_wheel
+{
+    timer_wheel(pocdaemon* d);
+    ~timer_wheel() throw ();
+
+    void start();
+    void shutdown();
+    void schedule(const std::string& key, uint64_t delay);
+
+    void timer_loop();
+
+    pocdaemon* const d;
+    po6::threads::mutex mtx;
+    po6::threads::cond cond;
+    bool stop;
+    size_t cursor;
+    // each slot holds (revolutions remaining, key)
+    std::vector<std::pair<uint64_t, std::string> > slots[TIMER_WHEEL_SLOTS];
+    po6::threads::thread ticker;
+
+    private:
+        timer_wheel(const timer_wheel&);
+        timer_wheel& operator = (const timer_wheel&);
+};
+
+#define LEASE_LOCK_STRIPES 64
+#define LEASE_CHECKED_KEYS 1024
+
+// Read leases, one per slot.  A replica asks each of a slot's replicas,
+// itself included, for a grant lasting "term" from when it asked, and holds
+// the lease while grants from a quorum last.  Any quorum that accepts a put
+// then includes a grantor, whose 'B' names the replica, and the proposer
+// holds its replies until the replica has learned the put or its lease has
+// ended.  Puts committed before the grants were made went unwatched, so the
+// holder answers a consistent get from what it has learned only once it has
+// checked the key with a quorum of its grantors:  each reports the version it
+// learned and that it has no value accepted but not learned, and the holder
+// must have learned the newest of them.  A key needs checking once a lease,
+// as renewals that keep the lease unbroken leave no put unwatched.  A grantor
+// counts its grant as lasting "skew" longer than the holder does, which
+// covers the drift between their clocks over a term.
+struct lease_table
+{
+    lease_table(pocdaemon* d, uint64_t term, uint64_t skew);
+
+    // as holder:  true if gets of "k" in "slot" may be answered locally;
+    // asks for grants when the lease is due for them, and has "k" checked
+    // when this lease has yet to check it
+    bool held(unsigned slot, const e::slice& k);
+    // true if some grantor may count this host as holding "slot", in which
+    // case learns for the slot are acknowledged to their proposer
+    bool acknowledges(unsigned slot);
+    void granted(uint64_t grantor, unsigned slot, uint64_t asked);
+    // "grantor" reports learning "ver" of "k", or if not "ok", that it can
+    // vouch for no version
+    void checked(uint64_t grantor, unsigned slot, uint64_t asked,
+                 const e::slice& k, bool ok, uint64_t ver);
+    // as grantor
+    void grant(uint64_t holder, unsigned slot, uint64_t asked);
+    // true if this host's grant of "slot" to "holder" lasts
+    bool grants(uint64_t holder, unsigned slot);
+    // appends (holder, nanoseconds left of its grant) for "slot"
+    void holders(unsigned slot, std::vector<std::pair<uint64_t, uint64_t> >* out);
+
+    struct key_check
+    {
+        key_check() : asked(), answered(), refused(), ver() {}
+        key_check(uint64_t a) : asked(a), answered(), refused(), ver() {}
+        uint64_t asked;
+        unsigned answered;
+        unsigned refused;
+        uint64_t ver;
+    };
+    struct slot_lease
+    {
+        slot_lease() : asked(), until(), holding(), granting(), checked(), checking() {}
+        // when this host last asked for grants, and until when its lease
+        // lasts
+        uint64_t asked;
+        uint64_t until;
+        // by replica index:  when each replica's grant to this host ends,
+        // and when this host's grant to each replica ends
+        uint64_t holding[REPLICAS];
+        uint64_t granting[REPLICAS];
+        // the keys this lease has checked, and those being checked, each
+        // with when it was asked, the grantors that vouched or refused, and
+        // the newest version they learned
+        std::set<std::string> checked;
+        std::map<std::string, key_check> checking;
+    };
+
+    pocdaemon* const d;
+    // zero disables leases
+    const uint64_t term;
+    const uint64_t skew;
+    po6::threads::mutex locks[LEASE_LOCK_STRIPES];
+    slot_lease slots[NUM_SLOTS];
+
+    private:
+        lease_table(const lease_table&);
+        lease_table& operator = (const lease_table&);
+};
+
+#define SCHEDULER_QUANTUM (64U << 10)
+#define SCHEDULER_DRAIN 32
+#define SCHEDULER_SWEEP 1024
+
+// Orders the messages received from clients.  Messages from other hosts never
+// wait here:  the Paxos and anti-entropy traffic that every key's progress
+// depends on is handled as it arrives, and clients' requests only once a
+// thread finds nothing else waiting.  Each client has a queue of its own, and
+// queues take turns in deficit round robin weighted by bytes, so a client
+// sending batches of large puts gets no more of the daemon than one sending
+// small gets.  A client's puts also draw from a token bucket refilling at
+// "rate" puts a second, up to "burst"; a queue whose next request needs more
+// tokens than it has sits out until they refill.
+struct scheduler
+{
+    scheduler(pocdaemon* d, uint64_t rate, uint64_t burst, uint64_t max_bytes);
+
+    // queues client "c"'s message, which holds "puts" puts; false if "c"
+    // already has "max_bytes" queued, in which case its requests are refused
+    bool enqueue(uint64_t c, const buffer_ref& msg, uint64_t puts, uint64_t now);
+    // the next client message to handle; if none may be handled by "now",
+    // false, with "*wait" lowered to the nanoseconds until one may
+    bool dequeue(uint64_t now, uint64_t* c, buffer_ref* msg, uint64_t* wait);
+
+    struct request
+    {
+        request(const buffer_ref& m, uint64_t p) : msg(m), puts(p) {}
+        buffer_ref msg;
+        uint64_t puts;
+    };
+    struct client_queue
+    {
+        client_queue() : requests(), bytes(), deficit(), tokens(), refilled(), active() {}
+        std::list<request> requests;
+        uint64_t bytes;
+        uint64_t deficit;
+        // negative once a request holding more puts than a burst is let go
+        int64_t tokens;
+        uint64_t refilled;
+        bool active;
+    };
+    typedef std::map<uint64_t, client_queue> client_map_t;
+
+    void refill(client_queue* q, uint64_t now);
+    // zero if "q"'s next request has the tokens it needs, else the
+    // nanoseconds until it will
+    uint64_t shortfall(client_queue* q, uint64_t now);
+
+    pocdaemon* const d;
+    // puts a second per client, zero for no limit, and the time per token
+    const uint64_t rate;
+    const uint64_t interval;
+    const uint64_t burst;
+    const uint64_t max_bytes;
+    po6::threads::mutex mtx;
+    client_map_t clients;
+    // clients with requests queued, in the order they take turns
+    std::list<client_map_t::iterator> active;
+
+    private:
+        scheduler(const scheduler&);
+        scheduler& operator = (const scheduler&);
+};
+
+#define LEARNED_CACHE_SHARDS 64
+
+// A bounded cache of recently learned values, so that gets for a hot working
+// set are served without touching leveldb.  Keys hash onto shards, each with
+// its own lock, LRU order, and an equal share of the memory budget.  A shard
+// only ever replaces an entry with a newer version.
+struct learned_cache
+{
+    learned_cache(uint64_t max_bytes);
+
+    bool get(const e::slice& k, uint64_t* ver, std::string* val);
+    void put(const e::slice& k, uint64_t ver, const e::slice& val);
+    void stats(uint64_t* hits, uint64_t* misses, uint64_t* bytes);
+
+    struct entry
+    {
+        entry() : ver(), val(), lru() {}
+        uint64_t ver;
+        std::string val;
+        std::list<std::string>::iterator lru;
+    };
+    struct shard
+    {
+        shard() : mtx(), entries(), lru(), bytes(), hits(), misses() {}
+        po6::threads::mutex mtx;
+        std::map<std::string, entry> entries;
+        // most recently used at the front
+        std::list<std::string> lru;
+        uint64_t bytes;
+        uint64_t hits;
+        uint64_t misses;
+
+        private:
+            shard(const shard&);
+            shard& operator = (const shard&);
+    };
+
+    shard* get_shard(const e::slice& k);
+    void evict(shard* s);
+
+    const uint64_t shard_bytes;
+    shard shards[LEARNED_CACHE_SHARDS];
+
+    private:
+        learned_cache(const learned_cache&);
+        learned_cache& operator = (const learned_cache&);
+};
+
+// Where the daemon's messages come from and go to; the calls mirror
+// busybee_server's.  The daemon uses busybee unless something else, e.g. a
+// benchmark's loopback or an in-process cluster, is installed before it
+// starts.
+class transport
+{
+    public:
+        transport() {}
+        virtual ~transport() throw () {}
+
+    public:
+        virtual void send(uint64_t to, std::auto_ptr<e::buffer> msg) = 0;
+        virtual busybee_returncode recv(e::garbage_collector::thread_state* ts, int timeout,
+                                        uint64_t* from, std::auto_ptr<e::buffer>* msg) = 0;
+
+    private:
+        transport(const transport&);
+        transport& operator = (const transport&);
+};
+
+// How a daemon is tuned.  The defaults are those of pocdb-daemon's flags,
+// but times are in nanoseconds and sizes in bytes.
+struct daemon_options
+{
+    daemon_options()
+        : stable_ballots(true), coalesce(64)
+        , commit_delay(0), commit_batch(1024), cache_bytes(64ULL << 20)
+        , trace_sample(1024), trace_values(false), max_queued(256ULL << 20)
+        , ae_interval(60 * PO6_SECONDS), ae_rate(50000), retry_backoff(500 * PO6_MICROS)
+        , lease_term(1000 * PO6_MILLIS), lease_skew(50 * PO6_MILLIS)
+        , client_rate(0), client_burst(1000), client_queue(64ULL << 20) {}
+
+    bool stable_ballots;
+    // most queued puts to a key that commit in one round
+    size_t coalesce;
+    // how long a write waits for company, and how many share one sync
+    uint64_t commit_delay;
+    size_t commit_batch;
+    uint64_t cache_bytes;
+    // one in "trace_sample" learns is traced, zero for none
+    uint64_t trace_sample;
+    bool trace_values;
+    // bytes of put values queued before puts are refused as busy
+    uint64_t max_queued;
+    // zero disables anti-entropy; the rate is in records a second
+    uint64_t ae_interval;
+    uint64_t ae_rate;
+    uint64_t retry_backoff;
+    // zero disables read leases
+    uint64_t lease_term;
+    uint64_t lease_skew;
+    // puts a second per client (zero for no limit), the burst allowed, and
+    // the bytes one client may have waiting
+    uint64_t client_rate;
+    uint64_t client_burst;
+    uint64_t client_queue;
+};
+
+struct pocdaemon
+{
+    pocdaemon(uint64_t host, const daemon_options& opts);
+    ~pocdaemon() throw ();
+    // learned values get a store of their own if "learned" is non-NULL
+    int run(size_t threads, const store_config& acceptor, const store_config* learned);
+    // run's parts, for running daemons within another program:  stores go in
+    // "dir", and stop returns once every thread start started has exited
+    bool open_stores(const std::string& dir, const store_config& acceptor, const store_config* learned);
+    void start(size_t threads);
+    void stop();
+    bool open_store(const store_config& cfg, const char* path, int files, leveldb::DB** store);
+    // true if "store" holds records in RECORD_FORMAT, recording it if new
+    bool check_format(leveldb::DB* store, const char* path);
+    void loop(size_t thread);
+    // parses and dispatches one message, batching the sends it causes
+    void handle(uint64_t id, const buffer_ref& msg);
+    void dispatch(uint64_t id, uint8_t type, const buffer_ref& msg, e::unpacker up);
+    // sends made while handling a message are batched by destination
+    void send(uint64_t to, std::auto_ptr<e::buffer> msg);
+    // pack once, then send a byte-for-byte copy to each of "to"; the copies
+    // save re-packing, not the bytes themselves
+    void send(const std::vector<uint64_t>& to, std::auto_ptr<e::buffer> msg);
+    void send(outbox* ob);
+
+    void process_batch(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_put(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_get(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_read_probe(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_read_repair(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_lease_get(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_lease_ask(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_lease_grant(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_lease_check(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_lease_checked(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_learned_ack(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_phase1a(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_phase1b(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_phase2a(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_phase2b(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_learn(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_commit_notice(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_retry(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_forward(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_forwarded(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    void process_stats(uint64_t c, const buffer_ref& msg, e::unpacker up);
+    // tells the proposer "c" that this lease holder learned "ver" of "k"
+    void ack_learned(uint64_t c, const e::slice& k, uint64_t ver);
+    // true if this host replicates the key hashing to "h"; otherwise fails
+    // the client's request
+    bool serves(uint64_t c, uint64_t nonce, uint64_t h);
+    // true if "bytes" more may be queued, and counts them as queued until
+    // discharged
+    bool admit(size_t bytes);
+    void discharge(size_t bytes);
+    // tells client "c" that its request "nonce" was refused as busy
+    void refuse(uint64_t c, uint64_t nonce);
+
+    void learn(const e::slice& k, uint64_t ver, const e::slice& v);
+    pocdb_returncode get_learned(const e::slice& k, uint64_t* ver, std::string* val);
+    po6::threads::mutex* acceptor_lock(const e::slice& k);
+    pocdb_returncode get_acceptor_state(const e::slice& k, uint64_t* ver,
+                                        ballot* b, pvalue* v);
+    pocdb_returncode save_acceptor_state(const e::slice& k, uint64_t ver,
+                                         const ballot& b, const pvalue& v);
+
+    uint64_t host;
+    const bool stable_ballots;
+    const size_t coalesce;
+    // bytes of put values queued across every key, and the most allowed
+    const uint64_t max_queued;
+    uint64_t queued_bytes;
+    // the initial backoff window after a preemption; zero retries at once
+    const uint64_t retry_backoff;
+    e::garbage_collector gc;
+    controller control;
+    // created by run, and sent through unless "net" was installed first
+    std::auto_ptr<busybee_server> busybee;
+    std::auto_ptr<transport> busybee_net;
+    transport* net;
+    uint32_t stopping;
+    tagged_key_comparator comparator;
+    // acceptor state, and learned values (the same store unless split)
+    leveldb::DB* db;
+    leveldb::DB* learned_db;
+    group_commit commit;
+    tracer trace;
+    anti_entropy ae;
+    learned_cache learned;
+    daemon_stats stats;
+    typedef e::state_hash_table<std::string, write_state_machine> write_map_t;
+    // the table of the write state machines for keys hashing to "h"
+    write_map_t& write_map(uint64_t h);
+    // each shard starts its own cache line, so threads working on different
+    // shards never share one
+    struct write_shard
+    {
+        write_shard(e::garbage_collector* gc) : map(gc) {}
+        write_map_t map;
+    };
+    write_shard* write_shards[WRITE_MAP_SHARDS];
+    timer_wheel timers;
+    lease_table leases;
+    scheduler sched;
+    // serializes the read-modify-write of a key's acceptor/learner state
+    // across threads; keys hash onto stripes, so lock scope stays per-key
+    po6::threads::mutex acceptor_locks[ACCEPTOR_LOCK_STRIPES];
+    std::vector<e::compat::shared_ptr<po6::threads::thread> > threads;
+
+    private:
+        pocdaemon(const pocdaemon&);
+        pocdaemon& operator = (const pocdaemon&);
+};
+
+// message buffers come from, and return to, a per-thread pool; a thread
+// keeps a pool only between starting and stopping it, which frees the pool
+e::buffer* acquire_buffer(size_t sz);
+void release_buffer(e::buffer* b);
+void start_buffer_pool();
+void stop_buffer_pool();
+
+// the outbox collecting this thread's sends for the message it is handling
+extern __thread outbox* s_outbox;
+
+#endif // pocdb_daemon_h_
@@ -0,0 +1,1013 @@
+// Copyright (c) 2017, Robert Escriva
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of pocdb nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+// A whole cluster in one process.  Every host in HOSTS runs as a pocdaemon
+// whose transport is an in-memory network, which can delay, jitter and drop
+// messages, and a set of clients drives a put/get workload at it directly.
+// Nothing is provisioned and nothing listens on a port, so a sweep over value
+// size, contention or network conditions starts in milliseconds; the seed
+// makes the network's choices repeatable from run to run.
+
+// C
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX
+#include <sys/stat.h>
+#include <unistd.h>
+
+// STL
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+// e
+#include <e/popt.h>
+
+// pocdb
+#include "daemon.h"
+
+// One endpoint per daemon and client.  A message waits in its destination's
+// queue until its delivery time, so latency applies to each message rather
+// than to the link, and jitter may reorder messages as a real network would.
+class memory_network
+{
+    public:
+        memory_network(uint64_t latency, uint64_t jitter, double loss, long seed);
+        ~memory_network() throw ();
+
+    public:
+        // every endpoint must be added before any thread sends
+        void add(uint64_t id);
+        void deliver(uint64_t from, uint64_t to, std::auto_ptr<e::buffer> msg);
+        busybee_returncode recv(uint64_t id, int timeout,
+                                uint64_t* from, std::auto_ptr<e::buffer>* msg);
+
+    public:
+        uint64_t sent;
+        uint64_t dropped;
+
+    private:
+        struct endpoint;
+        typedef std::map<uint64_t, endpoint*> endpoint_map_t;
+        const uint64_t m_latency;
+        const uint64_t m_jitter;
+        const double m_loss;
+        const long m_seed;
+        endpoint_map_t m_endpoints;
+
+    private:
+        memory_network(const memory_network&);
+        memory_network& operator = (const memory_network&);
+};
+
+struct memory_network::endpoint
+{
+    endpoint(uint64_t id, long seed);
+    ~endpoint() throw ();
+
+    po6::threads::mutex mtx;
+    po6::threads::cond cnd;
+    // (delivery time, arrival order) -> (sender, message)
+    std::map<std::pair<uint64_t, uint64_t>, std::pair<uint64_t, e::buffer*> > queue;
+    uint64_t arrivals;
+    // for loss and jitter on messages to this endpoint, guarded by mtx
+    unsigned short rng[3];
+
+    private:
+        endpoint(const endpoint&);
+        endpoint& operator = (const endpoint&);
+};
+
+memory_network::endpoint :: endpoint(uint64_t id, long seed)
+    : mtx()
+    , cnd(&mtx)
+    , queue()
+    , arrivals(0)
+{
+    rng[0] = seed;
+    rng[1] = id >> 32;
+    rng[2] = id;
+}
+
+memory_network::endpoint :: ~endpoint() throw ()
+{
+    for (std::map<std::pair<uint64_t, uint64_t>, std::pair<uint64_t, e::buffer*> >::iterator it = queue.begin();
+            it != queue.end(); ++it)
+    {
+        release_buffer(it->second.second);
+    }
+}
+
+memory_network :: memory_network(uint64_t latency, uint64_t jitter, double loss, long seed)
+    : sent(0)
+    , dropped(0)
+    , m_latency(latency)
+    , m_jitter(jitter)
+    , m_loss(loss)
+    , m_seed(seed)
+    , m_endpoints()
+{
+}
+
+memory_network :: ~memory_network() throw ()
+{
+    for (endpoint_map_t::iterator it = m_endpoints.begin(); it != m_endpoints.end(); ++it)
+    {
+        delete it->second;
+    }
+}
+
+void
+memory_network :: add(uint64_t id)
+{
+    assert(m_endpoints.find(id) == m_endpoints.end());
+    m_endpoints[id] = new endpoint(id, m_seed);
+}
+
+void
+memory_network :: deliver(uint64_t from, uint64_t to, std::auto_ptr<e::buffer> msg)
+{
+    e::atomic::increment_64_nobarrier(&sent, 1);
+    endpoint_map_t::iterator it = m_endpoints.find(to);
+
+    if (it == m_endpoints.end())
+    {
+        e::atomic::increment_64_nobarrier(&dropped, 1);
+        release_buffer(msg.release());
+        return;
+    }
+
+    endpoint* ep = it->second;
+    po6::threads::mutex::hold hold(&ep->mtx);
+
+    if (m_loss > 0 && erand48(ep->rng) < m_loss)
+    {
+        e::atomic::increment_64_nobarrier(&dropped, 1);
+        release_buffer(msg.release());
+        return;
+    }
+
+    uint64_t when = po6::monotonic_time() + m_latency;
+
+    if (m_jitter > 0)
+    {
+        when += uint64_t(erand48(ep->rng) * m_jitter);
+    }
+
+    const bool earliest = ep->queue.empty() || when < ep->queue.begin()->first.first;
+    ep->queue[std::make_pair(when, ep->arrivals++)] = std::make_pair(from, msg.release());
+
+    if (earliest)
+    {
+        ep->cnd.broadcast();
+    }
+}
+
+busybee_returncode
+memory_network :: recv(uint64_t id, int timeout,
+                       uint64_t* from, std::auto_ptr<e::buffer>* msg)
+{
+    endpoint_map_t::iterator it = m_endpoints.find(id);
+    assert(it != m_endpoints.end());
+    endpoint* ep = it->second;
+    const uint64_t deadline = po6::monotonic_time() + timeout * PO6_MILLIS;
+    po6::threads::mutex::hold hold(&ep->mtx);
+
+    while (true)
+    {
+        const uint64_t now = po6::monotonic_time();
+
+        if (!ep->queue.empty() && ep->queue.begin()->first.first <= now)
+        {
+            *from = ep->queue.begin()->second.first;
+            msg->reset(ep->queue.begin()->second.second);
+            ep->queue.erase(ep->queue.begin());
+            return BUSYBEE_SUCCESS;
+        }
+
+        if (now >= deadline)
+        {
+            return BUSYBEE_TIMEOUT;
+        }
+
+        uint64_t until = deadline;
+
+        if (!ep->queue.empty())
+        {
+            until = std::min(until, ep->queue.begin()->first.first);
+        }
+
+        ep->cnd.wait(until - now);
+    }
+}
+
+// what one daemon sees of the network
+class memory_transport : public transport
+{
+    public:
+        memory_transport(memory_network* n, uint64_t s) : net(n), self(s) {}
+        virtual ~memory_transport() throw () {}
+
+    public:
+        virtual void send(uint64_t to, std::auto_ptr<e::buffer> msg)
+        { net->deliver(self, to, msg); }
+        virtual busybee_returncode recv(e::garbage_collector::thread_state*, int timeout,
+                                        uint64_t* from, std::auto_ptr<e::buffer>* msg)
+        { return net->recv(self, timeout, from, msg); }
+
+    private:
+        memory_network* net;
+        uint64_t self;
+};
+
+struct harness_options
+{
+    harness_options();
+
+    long keys;
+    long value_size;
+    long ops;
+    long clients;
+    long outstanding;
+    double reads;
+    long timeout;
+    bool consistent;
+    bool check;
+};
+
+harness_options :: harness_options()
+    : keys(100000)
+    , value_size(100)
+    , ops(100000)
+    , clients(4)
+    , outstanding(16)
+    , reads(0.5)
+    , timeout(1000)
+    , consistent(false)
+    , check(false)
+{
+}
+
+// the digits of the put number a checked value starts with
+#define CHECK_DIGITS 16
+
+// A client speaking the wire protocol straight to the replicas, so that its
+// ops cost the harness nothing beyond the messages themselves.  Ops the
+// network lost are abandoned after the timeout.  Consistent gets go through
+// the same steps as pocdb_get_consistent:  the lease holder, then a quorum
+// probe, then a read repair.
+//
+// When checking, every key has one writer, each put numbers its value, and
+// a consistent get must see a put at least as new as every put acknowledged
+// before it began, or one whose outcome the client never learned.
+class harness_client
+{
+    public:
+        harness_client(const harness_options* opts, memory_network* net,
+                       uint64_t id, uint64_t ops);
+
+    public:
+        void run();
+
+    public:
+        histogram puts;
+        histogram gets;
+        uint64_t errors;
+        uint64_t lost;
+        uint64_t violations;
+
+    private:
+        enum kind_t { PUT, GET, CONSISTENT };
+        enum phase_t { LEASE, PROBE, REPAIR };
+        struct op
+        {
+            op() : began(), kind(), key(), seq(), floor(), phase(), start(), attempt()
+                 , replies(), agree(), in_flight(), newest_host(), newest_rc(), newest_ver()
+                 , newest_val() {}
+            uint64_t began;
+            kind_t kind;
+            std::string key;
+            // a put's number, or the newest acknowledged when a get began
+            uint64_t seq;
+            uint64_t floor;
+            // where a consistent get is, as pending_get_consistent keeps it
+            phase_t phase;
+            unsigned start;
+            unsigned attempt;
+            unsigned replies;
+            bool agree;
+            bool in_flight;
+            uint64_t newest_host;
+            pocdb_returncode newest_rc;
+            uint64_t newest_ver;
+            std::string newest_val;
+        };
+        typedef std::map<uint64_t, op> op_map_t;
+        // what a checking client knows of the puts to one of its keys
+        struct key_state
+        {
+            key_state() : issued(), acked(), writing(), doubtful() {}
+            uint64_t issued;
+            uint64_t acked;
+            bool writing;
+            // puts that failed or were lost, and so may yet be chosen
+            std::set<uint64_t> doubtful;
+        };
+        void issue();
+        void send(uint64_t to, uint8_t type, uint64_t nonce,
+                  const e::slice& k, const e::slice& v);
+        uint64_t replica(const op& o, unsigned i) const;
+        // give "it" a fresh nonce, so replies to its last step are ignored
+        op_map_t::iterator renew(op_map_t::iterator it);
+        void probe(op_map_t::iterator it);
+        void repair(op_map_t::iterator it);
+        void handle(uint64_t from, e::unpacker up);
+        void handle_consistent(op_map_t::iterator it, uint64_t from,
+                               pocdb_returncode rc, e::unpacker up);
+        void finish(op_map_t::iterator it, pocdb_returncode rc, const e::slice& v);
+        void verify(const op& o, pocdb_returncode rc, const e::slice& v);
+        void expire();
+
+    private:
+        const harness_options* const m_opts;
+        memory_network* const m_net;
+        const uint64_t m_id;
+        const uint64_t m_ops;
+        uint64_t m_issued;
+        uint64_t m_nonce;
+        op_map_t m_outstanding;
+        std::map<std::string, key_state> m_keys;
+        std::string m_value;
+        unsigned short m_rng[3];
+
+    private:
+        harness_client(const harness_client&);
+        harness_client& operator = (const harness_client&);
+};
+
+harness_client :: harness_client(const harness_options* opts, memory_network* net,
+                                 uint64_t id, uint64_t ops)
+    : puts()
+    , gets()
+    , errors(0)
+    , lost(0)
+    , violations(0)
+    , m_opts(opts)
+    , m_net(net)
+    , m_id(id)
+    , m_ops(ops)
+    , m_issued(0)
+    , m_nonce(0)
+    , m_outstanding()
+    , m_keys()
+    , m_value(1 + opts->value_size, 'v')
+{
+    // as the client library encodes a value it does not compress
+    m_value[0] = '\0';
+    m_rng[0] = id;
+    m_rng[1] = id >> 16;
+    m_rng[2] = 0x330e;
+}
+
+void
+harness_client :: run()
+{
+    while (m_issued < m_ops || !m_outstanding.empty())
+    {
+        while (m_issued < m_ops && m_outstanding.size() < size_t(m_opts->outstanding))
+        {
+            issue();
+        }
+
+        uint64_t from;
+        std::auto_ptr<e::buffer> msg;
+
+        if (m_net->recv(m_id, 10, &from, &msg) == BUSYBEE_SUCCESS)
+        {
+            e::unpacker up = msg->unpack_from(BUSYBEE_HEADER_SIZE);
+            uint64_t n;
+            uint32_t count;
+
+            if (!(e::unpacker(up) >> n).error() && n == BATCH_NONCE)
+            {
+                up = up >> n >> count;
+
+                for (uint32_t i = 0; !up.error() && i < count; ++i)
+                {
+                    e::slice m;
+                    up = up >> m;
+
+                    if (!up.error())
+                    {
+                        handle(from, e::unpacker(m));
+                    }
+                }
+            }
+            else
+            {
+                handle(from, up);
+            }
+
+            release_buffer(msg.release());
+        }
+
+        expire();
+    }
+}
+
+void
+harness_client :: issue()
+{
+    char k[48];
+    const uint64_t key = erand48(m_rng) * m_opts->keys;
+    // a checking client's keys are its own
+    const int k_sz = m_opts->check
+                   ? snprintf(k, sizeof(k), "key%016llu.%llu", (unsigned long long)key,
+                              (unsigned long long)m_id)
+                   : snprintf(k, sizeof(k), "key%016llu", (unsigned long long)key);
+    const e::slice ks(k, k_sz);
+    const bool is_get = erand48(m_rng) < m_opts->reads;
+    const uint64_t nonce = ++m_nonce;
+    op o;
+    o.began = po6::monotonic_time();
+    o.kind = is_get ? (m_opts->consistent ? CONSISTENT : GET) : PUT;
+    o.key.assign(k, k_sz);
+    o.start = nonce % REPLICAS;
+    std::string checked;
+
+    if (m_opts->check)
+    {
+        key_state* s = &m_keys[o.key];
+
+        // one put to a key at a time, so that acknowledged puts are chosen
+        // in the order they were sent
+        if (o.kind == PUT && s->writing)
+        {
+            o.kind = m_opts->consistent ? CONSISTENT : GET;
+        }
+
+        if (o.kind == PUT)
+        {
+            char seq[CHECK_DIGITS + 1];
+            o.seq = ++s->issued;
+            snprintf(seq, sizeof(seq), "%0*llu", CHECK_DIGITS, (unsigned long long)o.seq);
+            checked = m_value;
+            memmove(&checked[1], seq, CHECK_DIGITS);
+            s->writing = true;
+        }
+
+        o.floor = s->acked;
+    }
+
+    const uint8_t type = o.kind == PUT ? 'P' : o.kind == GET ? 'G' : 'Y';
+    const uint64_t to = replica(o, 0);
+    m_outstanding[nonce] = o;
+    ++m_issued;
+    send(to, type, nonce, ks, o.kind != PUT ? e::slice()
+                            : e::slice(m_opts->check ? checked : m_value));
+}
+
+void
+harness_client :: send(uint64_t to, uint8_t type, uint64_t nonce,
+                       const e::slice& k, const e::slice& v)
+{
+    const size_t sz = BUSYBEE_HEADER_SIZE + 1 + sizeof(uint64_t) + pack_size(k)
+                    + (type == 'P' ? pack_size(v) : 0);
+    std::auto_ptr<e::buffer> msg(acquire_buffer(sz));
+    e::packer pa = msg->pack_at(BUSYBEE_HEADER_SIZE) << type << nonce << k;
+
+    if (type == 'P')
+    {
+        pa = pa << v;
+    }
+
+    m_net->deliver(m_id, to, msg);
+}
+
+uint64_t
+harness_client :: replica(const op& o, unsigned i) const
+{
+    return slot_replica(key_slot(e::slice(o.key)), (o.start + o.attempt + i) % REPLICAS);
+}
+
+harness_client::op_map_t::iterator
+harness_client :: renew(op_map_t::iterator it)
+{
+    const op o(it->second);
+    m_outstanding.erase(it);
+    return m_outstanding.insert(std::make_pair(++m_nonce, o)).first;
+}
+
+void
+harness_client :: probe(op_map_t::iterator it)
+{
+    it = renew(it);
+    op& o = it->second;
+    o.phase = PROBE;
+    o.replies = 0;
+    o.agree = true;
+    o.in_flight = false;
+    o.newest_host = replica(o, 0);
+    o.newest_rc = POCDB_NOT_FOUND;
+    o.newest_ver = 0;
+    o.newest_val.clear();
+
+    for (unsigned i = 0; i < QUORUM; ++i)
+    {
+        send(replica(o, i), 'g', it->first, e::slice(o.key), e::slice());
+    }
+}
+
+void
+harness_client :: repair(op_map_t::iterator it)
+{
+    it = renew(it);
+    it->second.phase = REPAIR;
+    send(it->second.newest_host, 'C', it->first, e::slice(it->second.key), e::slice());
+}
+
+void
+harness_client :: handle(uint64_t from, e::unpacker up)
+{
+    uint64_t nonce;
+    pocdb_returncode rc;
+    up = up >> nonce >> e::unpack_uint8<pocdb_returncode>(rc);
+    op_map_t::iterator it = m_outstanding.find(nonce);
+
+    if (up.error() || it == m_outstanding.end())
+    {
+        return;
+    }
+
+    if (it->second.kind == CONSISTENT && rc != POCDB_BUSY)
+    {
+        return handle_consistent(it, from, rc, up);
+    }
+
+    finish(it, rc, e::slice());
+}
+
+void
+harness_client :: handle_consistent(op_map_t::iterator it, uint64_t from,
+                                    pocdb_returncode rc, e::unpacker up)
+{
+    op& o = it->second;
+    uint8_t leased;
+    uint8_t p;
+    uint64_t next;
+    uint64_t ver;
+    e::slice v;
+
+    switch (o.phase)
+    {
+        case LEASE:
+            up = up >> leased >> v;
+
+            if (up.error())
+            {
+                return finish(it, POCDB_SERVER_ERROR, e::slice());
+            }
+
+            // the replica holds no lease, though it has asked for one by now
+            return leased ? finish(it, rc, v) : probe(it);
+        case PROBE:
+            up = up >> ver >> p >> v;
+
+            if (up.error() || (rc != POCDB_SUCCESS && rc != POCDB_NOT_FOUND))
+            {
+                return finish(it, up.error() ? POCDB_SERVER_ERROR : rc, e::slice());
+            }
+
+            if (o.replies > 0 && (rc != o.newest_rc || ver != o.newest_ver))
+            {
+                o.agree = false;
+            }
+
+            if (o.replies == 0 ||
+                (rc == POCDB_SUCCESS && (o.newest_rc != POCDB_SUCCESS || ver > o.newest_ver)))
+            {
+                o.newest_host = from;
+                o.newest_rc = rc;
+                o.newest_ver = ver;
+                o.newest_val.assign(v.cdata(), v.size());
+            }
+
+            o.in_flight = o.in_flight || p;
+
+            if (++o.replies < QUORUM)
+            {
+                return;
+            }
+
+            if (o.agree && !o.in_flight)
+            {
+                return finish(it, o.newest_rc, e::slice(o.newest_val));
+            }
+
+            return repair(it);
+        case REPAIR:
+            up = up >> next >> ver >> v;
+
+            if (up.error() || (rc != POCDB_SUCCESS && rc != POCDB_NOT_FOUND))
+            {
+                return finish(it, up.error() ? POCDB_SERVER_ERROR : rc, e::slice());
+            }
+
+            // versions before "next" are the only ones that may be chosen
+            if (rc == POCDB_NOT_FOUND && next == 0)
+            {
+                return finish(it, POCDB_NOT_FOUND, e::slice());
+            }
+            else if (rc == POCDB_SUCCESS && ver + 1 >= next)
+            {
+                return finish(it, POCDB_SUCCESS, v);
+            }
+            else if (o.newest_rc == POCDB_SUCCESS && o.newest_ver + 1 >= next)
+            {
+                return finish(it, POCDB_SUCCESS, e::slice(o.newest_val));
+            }
+
+            // the server asked missed the newest version; ask elsewhere
+            if (++o.attempt >= REPLICAS)
+            {
+                return finish(it, POCDB_SERVER_ERROR, e::slice());
+            }
+
+            return probe(it);
+        default:
+            abort();
+    }
+}
+
+void
+harness_client :: finish(op_map_t::iterator it, pocdb_returncode rc, const e::slice& v)
+{
+    const op& o = it->second;
+    // latencies are recorded in microseconds
+    const uint64_t us = (po6::monotonic_time() - o.began) / PO6_MICROS;
+    (o.kind == PUT ? puts : gets).record(us);
+
+    if (rc != POCDB_SUCCESS && !(o.kind != PUT && rc == POCDB_NOT_FOUND))
+    {
+        ++errors;
+    }
+
+    verify(o, rc, v);
+    m_outstanding.erase(it);
+}
+
+void
+harness_client :: verify(const op& o, pocdb_returncode rc, const e::slice& v)
+{
+    if (!m_opts->check || o.kind == GET)
+    {
+        return;
+    }
+
+    key_state* s = &m_keys[o.key];
+
+    if (o.kind == PUT)
+    {
+        if (rc == POCDB_SUCCESS)
+        {
+            s->acked = std::max(s->acked, o.seq);
+        }
+        else
+        {
+            s->doubtful.insert(o.seq);
+        }
+
+        s->writing = false;
+        return;
+    }
+
+    uint64_t seq = 0;
+
+    if (rc == POCDB_SUCCESS)
+    {
+        bool ok = v.size() >= 1 + CHECK_DIGITS;
+
+        for (size_t i = 1; ok && i <= CHECK_DIGITS; ++i)
+        {
+            ok = v.cdata()[i] >= '0' && v.cdata()[i] <= '9';
+            seq = seq * 10 + (v.cdata()[i] - '0');
+        }
+
+        if (!ok)
+        {
+            fprintf(stderr, "%s: got a value no put wrote\n", o.key.c_str());
+            ++violations;
+            return;
+        }
+    }
+    else if (rc != POCDB_NOT_FOUND)
+    {
+        return;
+    }
+
+    if ((seq < o.floor && s->doubtful.find(seq) == s->doubtful.end()) || seq > s->issued)
+    {
+        fprintf(stderr, "%s: consistent get saw put %llu, but put %llu was acknowledged before it began\n",
+                o.key.c_str(), (unsigned long long)seq, (unsigned long long)o.floor);
+        ++violations;
+    }
+}
+
+void
+harness_client :: expire()
+{
+    const uint64_t cutoff = po6::monotonic_time() - m_opts->timeout * PO6_MILLIS;
+    op_map_t::iterator it = m_outstanding.begin();
+
+    while (it != m_outstanding.end())
+    {
+        if (it->second.began < cutoff)
+        {
+            // a lost put may be chosen yet
+            if (m_opts->check && it->second.kind == PUT)
+            {
+                key_state* s = &m_keys[it->second.key];
+                s->doubtful.insert(it->second.seq);
+                s->writing = false;
+            }
+
+            ++lost;
+            m_outstanding.erase(it++);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+static void
+report(const char* name, const histogram& h, double secs)
+{
+    if (h.total == 0)
+    {
+        return;
+    }
+
+    printf("%-4s %10llu ops %12.1f ops/s   p50 %8llu us   p99 %8llu us   p999 %8llu us   max %8llu us\n",
+           name, (unsigned long long)h.total, h.total / secs,
+           (unsigned long long)h.percentile(0.5),
+           (unsigned long long)h.percentile(0.99),
+           (unsigned long long)h.percentile(0.999),
+           (unsigned long long)h.maximum);
+}
+
+int
+main(int argc, const char* argv[])
+{
+    harness_options opts;
+    long threads = 1;
+    long latency = 0;
+    long jitter = 0;
+    double loss = 0;
+    long seed = 1;
+    long coalesce = 64;
+    const char* dir = "/tmp";
+    e::argparser ap;
+    ap.autohelp();
+    ap.option_string("[OPTIONS]");
+    ap.arg().name('k', "keys")
+            .description("distinct keys; fewer keys, more contention (default: 100000)")
+            .metavar("N")
+            .as_long(&opts.keys);
+    ap.arg().name('v', "value-size")
+            .description("bytes per value (default: 100)")
+            .metavar("B")
+            .as_long(&opts.value_size);
+    ap.arg().name('n', "ops")
+            .description("operations in total (default: 100000)")
+            .metavar("N")
+            .as_long(&opts.ops);
+    ap.arg().name('c', "clients")
+            .description("clients, each on its own thread (default: 4)")
+            .metavar("N")
+            .as_long(&opts.clients);
+    ap.arg().name('o', "outstanding")
+            .description("requests each client keeps in flight (default: 16)")
+            .metavar("N")
+            .as_long(&opts.outstanding);
+    ap.arg().name('r', "reads")
+            .description("fraction of operations that are gets (default: 0.5)")
+            .metavar("F")
+            .as_double(&opts.reads);
+    ap.arg().long_name("consistent")
+            .description("issue gets as pocdb_get_consistent does")
+            .set_true(&opts.consistent);
+    ap.arg().long_name("check")
+            .description("give each key one writer and fail if a consistent get misses an acknowledged put")
+            .set_true(&opts.check);
+    ap.arg().name('t', "threads")
+            .description("network threads per daemon (default: 1)")
+            .metavar("N")
+            .as_long(&threads);
+    ap.arg().long_name("coalesce")
+            .description("puts per Paxos round at most (default: 64)")
+            .metavar("N")
+            .as_long(&coalesce);
+    ap.arg().long_name("latency")
+            .description("one-way delay of every message in microseconds (default: 0)")
+            .metavar("US")
+            .as_long(&latency);
+    ap.arg().long_name("jitter")
+            .description("extra random delay of up to this many microseconds (default: 0)")
+            .metavar("US")
+            .as_long(&jitter);
+    ap.arg().long_name("loss")
+            .description("fraction of messages dropped (default: 0)")
+            .metavar("F")
+            .as_double(&loss);
+    ap.arg().long_name("timeout")
+            .description("milliseconds before an unanswered op counts as lost (default: 1000)")
+            .metavar("MS")
+            .as_long(&opts.timeout);
+    ap.arg().long_name("seed")
+            .description("seed for the network's loss and jitter (default: 1)")
+            .metavar("N")
+            .as_long(&seed);
+    ap.arg().long_name("dir")
+            .description("where to make the scratch leveldbs (default: /tmp)")
+            .metavar("DIR")
+            .as_string(&dir);
+
+    if (!ap.parse(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (ap.args_sz() != 0 || opts.keys <= 0 || opts.value_size < 0 ||
+        opts.ops <= 0 || opts.clients <= 0 || opts.outstanding <= 0 ||
+        opts.reads < 0 || opts.reads > 1 || threads <= 0 || coalesce <= 0 ||
+        latency < 0 || jitter < 0 || loss < 0 || loss >= 1 || opts.timeout <= 0 ||
+        (opts.check && opts.value_size < CHECK_DIGITS))
+    {
+        ap.usage();
+        return EXIT_FAILURE;
+    }
+
+    std::string path(dir);
+    path += "/pocdb-harness.XXXXXX";
+
+    if (!mkdtemp(&path[0]))
+    {
+        perror("could not make a scratch directory");
+        return EXIT_FAILURE;
+    }
+
+    memory_network net(latency * PO6_MICROS, jitter * PO6_MICROS, loss, seed);
+    std::vector<e::compat::shared_ptr<pocdaemon> > daemons;
+    std::vector<e::compat::shared_ptr<memory_transport> > transports;
+    std::vector<std::string> dirs;
+    store_config cfg;
+
+    for (unsigned i = 0; i < NUM_HOSTS; ++i)
+    {
+        net.add(HOSTS[i]);
+    }
+
+    for (long i = 0; i < opts.clients; ++i)
+    {
+        // client ids only need to be distinct from the hosts'
+        net.add(i + 1);
+    }
+
+    for (unsigned i = 0; i < NUM_HOSTS; ++i)
+    {
+        // the daemon's defaults, save for tracing and anti-entropy, which
+        // would muddy short runs
+        daemon_options dopts;
+        dopts.coalesce = coalesce;
+        dopts.trace_sample = 0;
+        dopts.ae_interval = 0;
+        e::compat::shared_ptr<pocdaemon> d(new pocdaemon(HOSTS[i], dopts));
+        e::compat::shared_ptr<memory_transport> t(new memory_transport(&net, HOSTS[i]));
+        d->net = t.get();
+        dirs.push_back(path + "/" + char('A' + i));
+
+        if (mkdir(dirs.back().c_str(), 0700) < 0 ||
+            !d->open_stores(dirs.back(), cfg, NULL))
+        {
+            perror("could not open a daemon's store");
+            return EXIT_FAILURE;
+        }
+
+        daemons.push_back(d);
+        transports.push_back(t);
+    }
+
+    for (size_t i = 0; i < daemons.size(); ++i)
+    {
+        daemons[i]->start(threads);
+    }
+
+    std::vector<e::compat::shared_ptr<harness_client> > clients;
+    std::vector<e::compat::shared_ptr<po6::threads::thread> > client_threads;
+
+    for (long i = 0; i < opts.clients; ++i)
+    {
+        const uint64_t s = opts.ops * i / opts.clients;
+        const uint64_t e = opts.ops * (i + 1) / opts.clients;
+        clients.push_back(e::compat::shared_ptr<harness_client>(new harness_client(&opts, &net, i + 1, e - s)));
+    }
+
+    const uint64_t began = po6::monotonic_time();
+
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        using namespace po6::threads;
+        e::compat::shared_ptr<thread> t(new thread(make_obj_func(&harness_client::run, clients[i].get())));
+        client_threads.push_back(t);
+        t->start();
+    }
+
+    for (size_t i = 0; i < client_threads.size(); ++i)
+    {
+        client_threads[i]->join();
+    }
+
+    const double secs = double(po6::monotonic_time() - began) / PO6_SECONDS;
+    histogram puts;
+    histogram gets;
+    histogram all;
+    uint64_t errors = 0;
+    uint64_t lost = 0;
+    uint64_t violations = 0;
+
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        puts.merge(clients[i]->puts);
+        gets.merge(clients[i]->gets);
+        errors += clients[i]->errors;
+        lost += clients[i]->lost;
+        violations += clients[i]->violations;
+    }
+
+    all.merge(puts);
+    all.merge(gets);
+    printf("%d hosts x %ld threads, %ld clients x %ld outstanding, %.3f s, %llu errors, %llu lost\n",
+           NUM_HOSTS, threads, opts.clients, opts.outstanding, secs,
+           (unsigned long long)errors, (unsigned long long)lost);
+    report("put", puts, secs);
+    report("get", gets, secs);
+    report("all", all, secs);
+    printf("%llu messages, %.1f per op, %llu dropped\n",
+           (unsigned long long)net.sent, double(net.sent) / opts.ops,
+           (unsigned long long)net.dropped);
+
+    if (opts.check)
+    {
+        printf("%llu consistency violations\n", (unsigned long long)violations);
+    }
+
+    for (size_t i = 0; i < daemons.size(); ++i)
+    {
+        daemons[i]->stop();
+    }
+
+    for (size_t i = 0; i < daemons.size(); ++i)
+    {
+        leveldb::Options lopts;
+        lopts.comparator = &daemons[i]->comparator;
+        delete daemons[i]->db;
+        daemons[i]->db = daemons[i]->learned_db = NULL;
+        leveldb::DestroyDB(dirs[i], lopts);
+        rmdir(dirs[i].c_str());
+    }
+
+    rmdir(path.c_str());
+    // a check runs under loss, where ops may fail without breaking anything
+    return violations || (errors && !opts.check) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+// Copyright (c) 2017, Robert Escriva
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of pocdb nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef pocdb_histogram_h_
+#define pocdb_histogram_h_
+
+// C
+#include <stdint.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1U << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// A log-linear histogram.  Values below 32 each get their own bucket, and
+// every power of two above that is split into 32 buckets, so a percentile is
+// reported to within about 3% of the true value.
+struct histogram
+{
+    histogram() : total(), maximum() { memset(counts, 0, sizeof(counts)); }
+
+    void record(uint64_t v);
+    void merge(const histogram& other);
+    // the smallest bucket bound not exceeded by fraction "p" of values
+    uint64_t percentile(double p) const;
+
+    static size_t bucket(uint64_t v);
+    static uint64_t bucket_bound(size_t b);
+
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t maximum;
+};
+
+inline size_t
+histogram :: bucket(uint64_t v)
+{
+    if (v < HISTOGRAM_SUB_BUCKETS)
+    {
+        return v;
+    }
+
+    const size_t e = 63 - __builtin_clzll(v);
+    const size_t sub = (v >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+inline uint64_t
+histogram :: bucket_bound(size_t b)
+{
+    if (b < HISTOGRAM_SUB_BUCKETS)
+    {
+        return b;
+    }
+
+    const size_t e = b / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    const uint64_t sub = b % HISTOGRAM_SUB_BUCKETS;
+    const uint64_t width = 1ULL << (e - HISTOGRAM_SUB_BITS);
+    return ((HISTOGRAM_SUB_BUCKETS + sub) << (e - HISTOGRAM_SUB_BITS)) + width - 1;
+}
+
+inline void
+histogram :: record(uint64_t v)
+{
+    ++counts[bucket(v)];
+    ++total;
+    maximum = v > maximum ? v : maximum;
+}
+
+inline void
+histogram :: merge(const histogram& other)
+{
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        counts[i] += other.counts[i];
+    }
+
+    total += other.total;
+    maximum = other.maximum > maximum ? other.maximum : maximum;
+}
+
+inline uint64_t
+histogram :: percentile(double p) const
+{
+    const uint64_t target = p * total;
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += counts[i];
+
+        if (seen > target)
+        {
+            const uint64_t bound = bucket_bound(i);
+            return bound < maximum ? bound : maximum;
+        }
+    }
+
+    return maximum;
+}
+
+#endif // pocdb_histogram_h_
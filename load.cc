@@ -28,22 +28,127 @@
 #define _WITH_GETLINE
 
 // C
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // STL
 #include <iostream>
+#include <map>
 #include <string>
+#include <vector>
+
+// po6
+#include <po6/threads/thread.h>
+#include <po6/time.h>
+
+// e
+#include <e/compat.h>
+#include <e/popt.h>
 
 // pocdb
 #include <pocdb.h>
+#include "histogram.h"
 
-int
-main(int argc, const char* argv[])
+// Keeps up to "slots" puts outstanding at once.
+struct loader
+{
+    loader(pocdb_client* c, size_t slots);
+
+    bool put(const char* key, size_t key_sz, const char* val, size_t val_sz);
+    bool complete_one();
+    bool drain();
+
+    pocdb_client* client;
+    std::vector<pocdb_returncode> status;
+    std::vector<size_t> free_slots;
+    std::map<int64_t, size_t> outstanding;
+};
+
+loader :: loader(pocdb_client* c, size_t slots)
+    : client(c)
+    , status(slots)
+    , free_slots()
+    , outstanding()
+{
+    for (size_t i = 0; i < slots; ++i)
+    {
+        free_slots.push_back(i);
+    }
+}
+
+bool
+loader :: put(const char* key, size_t key_sz, const char* val, size_t val_sz)
+{
+    if (free_slots.empty() && !complete_one())
+    {
+        return false;
+    }
+
+    const size_t slot = free_slots.back();
+    free_slots.pop_back();
+    int64_t id = pocdb_async_put(client, key, key_sz, val, val_sz, &status[slot]);
+
+    if (id < 0)
+    {
+        std::cerr << "write failure" << std::endl;
+        return false;
+    }
+
+    outstanding[id] = slot;
+    return true;
+}
+
+bool
+loader :: complete_one()
+{
+    pocdb_returncode lrc;
+    int64_t id = pocdb_loop(client, -1, &lrc);
+    std::map<int64_t, size_t>::iterator it = outstanding.find(id);
+
+    if (id < 0 || it == outstanding.end())
+    {
+        std::cerr << "loop failure" << std::endl;
+        return false;
+    }
+
+    const size_t slot = it->second;
+    outstanding.erase(it);
+    free_slots.push_back(slot);
+
+    if (status[slot] != POCDB_SUCCESS)
+    {
+        std::cerr << "write failure" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool
+loader :: drain()
+{
+    while (!outstanding.empty())
+    {
+        if (!complete_one())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int
+load_stdin(size_t slots)
 {
     pocdb_client* c = pocdb_create();
+    loader l(c, slots);
     std::string s;
+    int ret = EXIT_SUCCESS;
 
-    while (std::getline(std::cin, s))
+    while (ret == EXIT_SUCCESS && std::getline(std::cin, s))
     {
         const char* key = s.c_str();
         const char* val = strchr(key, ' ');
@@ -51,15 +156,433 @@ main(int argc, const char* argv[])
         if (!val++)
         {
             std::cerr << "invalid line" << std::endl;
-            return EXIT_FAILURE;
+            ret = EXIT_FAILURE;
+        }
+        else if (!l.put(key, val - key - 1, val, key + s.size() - val))
+        {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    if (!l.drain())
+    {
+        ret = EXIT_FAILURE;
+    }
+
+    pocdb_destroy(c);
+    return ret;
+}
+
+// xorshift64*
+struct rng
+{
+    rng(uint64_t seed) : x(seed | 1) {}
+    uint64_t next()
+    {
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        return x * 2685821657736338717ULL;
+    }
+    double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+    uint64_t x;
+};
+
+// Draws ranks in [0, n) with a Zipfian skew "theta" in (0, 1), after Gray et
+// al., "Quickly Generating Billion-Record Synthetic Databases".  A theta of
+// zero draws uniformly.
+struct zipf
+{
+    zipf(uint64_t n, double theta);
+    uint64_t next(rng* r) const;
+
+    uint64_t n;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+};
+
+zipf :: zipf(uint64_t _n, double _theta)
+    : n(_n)
+    , theta(_theta)
+    , zetan()
+    , alpha()
+    , eta()
+{
+    if (theta <= 0)
+    {
+        return;
+    }
+
+    for (uint64_t i = 1; i <= n; ++i)
+    {
+        zetan += 1.0 / pow(i, theta);
+    }
+
+    const double zeta2 = 1.0 + 1.0 / pow(2, theta);
+    alpha = 1.0 / (1.0 - theta);
+    eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+}
+
+uint64_t
+zipf :: next(rng* r) const
+{
+    if (theta <= 0)
+    {
+        return r->next() % n;
+    }
+
+    const double u = r->uniform();
+    const double uz = u * zetan;
+
+    if (uz < 1.0)
+    {
+        return 0;
+    }
+
+    if (uz < 1.0 + pow(0.5, theta))
+    {
+        return 1;
+    }
+
+    const uint64_t x = n * pow(eta * u - eta + 1.0, alpha);
+    return x < n ? x : n - 1;
+}
+
+struct bench_options
+{
+    bench_options()
+        : threads(1), outstanding(64), keys(100000), value_size(100)
+        , ops(1000000), reads(0.5), theta(0), consistent(false), hedge(false), preload(false)
+        , compress(0) {}
+
+    long threads;
+    long outstanding;
+    long keys;
+    long value_size;
+    long ops;
+    double reads;
+    double theta;
+    bool consistent;
+    bool hedge;
+    bool preload;
+    long compress;
+};
+
+// One client, keeping "outstanding" operations in flight.
+struct bench_thread
+{
+    bench_thread(const bench_options* opts, const zipf* z, size_t idx, uint64_t start, uint64_t ops);
+    void run();
+    bool issue(uint64_t key, bool read);
+    bool complete_one();
+
+    const bench_options* const opts;
+    const zipf* const z;
+    const size_t idx;
+    // the keys preloaded, or the operations run, are [start, start + ops)
+    const uint64_t start;
+    const uint64_t ops;
+    rng r;
+    std::string value;
+    pocdb_client* client;
+    std::vector<pocdb_returncode> status;
+    std::vector<char*> vals;
+    std::vector<size_t> val_szs;
+    std::vector<uint64_t> began;
+    std::vector<bool> is_read;
+    std::vector<size_t> free_slots;
+    std::map<int64_t, size_t> outstanding;
+    histogram puts;
+    histogram gets;
+    uint64_t errors;
+    bool failed;
+
+    private:
+        bench_thread(const bench_thread&);
+        bench_thread& operator = (const bench_thread&);
+};
+
+bench_thread :: bench_thread(const bench_options* o, const zipf* _z, size_t i, uint64_t s, uint64_t n)
+    : opts(o)
+    , z(_z)
+    , idx(i)
+    , start(s)
+    , ops(n)
+    , r(po6::monotonic_time() ^ (i + 1) * 0x9e3779b97f4a7c15ULL)
+    , value(o->value_size, '\0')
+    , client(NULL)
+    , status(o->outstanding)
+    , vals(o->outstanding)
+    , val_szs(o->outstanding)
+    , began(o->outstanding)
+    , is_read(o->outstanding)
+    , free_slots()
+    , outstanding()
+    , puts()
+    , gets()
+    , errors()
+    , failed()
+{
+    for (size_t j = 0; j < value.size(); ++j)
+    {
+        value[j] = 'a' + r.next() % 26;
+    }
+
+    for (size_t j = 0; j < status.size(); ++j)
+    {
+        free_slots.push_back(j);
+    }
+}
+
+void
+bench_thread :: run()
+{
+    client = pocdb_create();
+    pocdb_hedge_gets(client, opts->hedge);
+    // compression needs tagged values
+    pocdb_tag_values(client, opts->compress > 0);
+    pocdb_compress_values(client, opts->compress);
+
+    for (uint64_t i = 0; !failed && i < ops; ++i)
+    {
+        if (free_slots.empty() && !complete_one())
+        {
+            break;
         }
 
-        if (pocdb_put(c, key, val - key - 1, val, key + s.size() - val) != POCDB_SUCCESS)
+        if (opts->preload)
+        {
+            issue(start + i, false);
+        }
+        else
         {
-            std::cerr << "write failure" << std::endl;
-            return EXIT_FAILURE;
+            issue(z->next(&r), r.uniform() < opts->reads);
         }
     }
 
-    return EXIT_SUCCESS;
+    while (!failed && !outstanding.empty() && complete_one())
+        ;
+
+    pocdb_destroy(client);
+    client = NULL;
+}
+
+bool
+bench_thread :: issue(uint64_t key, bool read)
+{
+    char k[32];
+    const int k_sz = snprintf(k, sizeof(k), "key%016llu", (unsigned long long)key);
+    const size_t slot = free_slots.back();
+    int64_t id;
+
+    if (read && opts->consistent)
+    {
+        id = pocdb_async_get_consistent(client, k, k_sz, &status[slot], &vals[slot], &val_szs[slot]);
+    }
+    else if (read)
+    {
+        id = pocdb_async_get(client, k, k_sz, &status[slot], &vals[slot], &val_szs[slot]);
+    }
+    else
+    {
+        id = pocdb_async_put(client, k, k_sz, value.data(), value.size(), &status[slot]);
+    }
+
+    if (id < 0)
+    {
+        ++errors;
+        return false;
+    }
+
+    free_slots.pop_back();
+    began[slot] = po6::monotonic_time();
+    is_read[slot] = read;
+    vals[slot] = NULL;
+    outstanding[id] = slot;
+    return true;
+}
+
+bool
+bench_thread :: complete_one()
+{
+    pocdb_returncode lrc;
+    int64_t id = pocdb_loop(client, -1, &lrc);
+    const uint64_t now = po6::monotonic_time();
+    std::map<int64_t, size_t>::iterator it = outstanding.find(id);
+
+    if (id < 0 || it == outstanding.end())
+    {
+        std::cerr << "thread " << idx << ": loop failure " << lrc << std::endl;
+        failed = true;
+        return false;
+    }
+
+    const size_t slot = it->second;
+    outstanding.erase(it);
+    free_slots.push_back(slot);
+    // latencies are recorded in microseconds
+    (is_read[slot] ? gets : puts).record((now - began[slot]) / PO6_MICROS);
+
+    if (status[slot] != POCDB_SUCCESS &&
+        !(is_read[slot] && status[slot] == POCDB_NOT_FOUND))
+    {
+        ++errors;
+    }
+
+    free(vals[slot]);
+    vals[slot] = NULL;
+    return true;
+}
+
+static void
+report(const char* name, const histogram& h, double secs)
+{
+    if (h.total == 0)
+    {
+        return;
+    }
+
+    printf("%-4s %10llu ops %12.1f ops/s   p50 %8llu us   p99 %8llu us   p999 %8llu us   max %8llu us\n",
+           name, (unsigned long long)h.total, h.total / secs,
+           (unsigned long long)h.percentile(0.5),
+           (unsigned long long)h.percentile(0.99),
+           (unsigned long long)h.percentile(0.999),
+           (unsigned long long)h.maximum);
+}
+
+static int
+bench(const bench_options& opts)
+{
+    const zipf z(opts.keys, opts.preload ? 0 : opts.theta);
+    const uint64_t total = opts.preload ? opts.keys : opts.ops;
+    std::vector<e::compat::shared_ptr<bench_thread> > workers;
+    std::vector<e::compat::shared_ptr<po6::threads::thread> > threads;
+
+    for (long i = 0; i < opts.threads; ++i)
+    {
+        const uint64_t s = total * i / opts.threads;
+        const uint64_t e = total * (i + 1) / opts.threads;
+        workers.push_back(e::compat::shared_ptr<bench_thread>(new bench_thread(&opts, &z, i, s, e - s)));
+    }
+
+    const uint64_t began = po6::monotonic_time();
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        using namespace po6::threads;
+        e::compat::shared_ptr<thread> t(new thread(make_obj_func(&bench_thread::run, workers[i].get())));
+        threads.push_back(t);
+        t->start();
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        threads[i]->join();
+    }
+
+    const double secs = double(po6::monotonic_time() - began) / PO6_SECONDS;
+    histogram puts;
+    histogram gets;
+    histogram all;
+    uint64_t errors = 0;
+    bool failed = false;
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        puts.merge(workers[i]->puts);
+        gets.merge(workers[i]->gets);
+        errors += workers[i]->errors;
+        failed = failed || workers[i]->failed;
+    }
+
+    all.merge(puts);
+    all.merge(gets);
+    printf("%ld threads x %ld outstanding, %.3f s, %llu errors\n",
+           opts.threads, opts.outstanding, secs, (unsigned long long)errors);
+    report("put", puts, secs);
+    report("get", gets, secs);
+    report("all", all, secs);
+    return failed || errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int
+main(int argc, const char* argv[])
+{
+    bench_options opts;
+    bool benchmark = false;
+    e::argparser ap;
+    ap.autohelp();
+    ap.option_string("[OPTIONS]");
+    ap.arg().name('o', "outstanding")
+            .description("requests each client keeps in flight (default: 64)")
+            .metavar("N")
+            .as_long(&opts.outstanding);
+    ap.arg().name('b', "bench")
+            .description("generate a workload instead of loading \"key value\" lines from stdin")
+            .set_true(&benchmark);
+    ap.arg().name('t', "threads")
+            .description("benchmark client threads, each with its own client (default: 1)")
+            .metavar("N")
+            .as_long(&opts.threads);
+    ap.arg().name('k', "keys")
+            .description("number of distinct keys (default: 100000)")
+            .metavar("N")
+            .as_long(&opts.keys);
+    ap.arg().name('v', "value-size")
+            .description("bytes per value written (default: 100)")
+            .metavar("BYTES")
+            .as_long(&opts.value_size);
+    ap.arg().name('n', "ops")
+            .description("total operations across all threads (default: 1000000)")
+            .metavar("N")
+            .as_long(&opts.ops);
+    ap.arg().name('r', "reads")
+            .description("fraction of operations that are gets (default: 0.5)")
+            .metavar("F")
+            .as_double(&opts.reads);
+    ap.arg().name('z', "zipf")
+            .description("Zipfian skew in [0, 1) over keys; 0 is uniform (default: 0)")
+            .metavar("THETA")
+            .as_double(&opts.theta);
+    ap.arg().long_name("consistent")
+            .description("issue gets as pocdb_get_consistent")
+            .set_true(&opts.consistent);
+    ap.arg().long_name("hedge")
+            .description("hedge gets with a second request to another replica")
+            .set_true(&opts.hedge);
+    ap.arg().long_name("compress")
+            .description("tag values and compress those of at least N bytes (default: 0, none)")
+            .metavar("N")
+            .as_long(&opts.compress);
+    ap.arg().long_name("preload")
+            .description("write every key once, instead of a read/write mix")
+            .set_true(&opts.preload);
+
+    if (!ap.parse(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (ap.args_sz() != 0 || opts.outstanding <= 0)
+    {
+        ap.usage();
+        return EXIT_FAILURE;
+    }
+
+    if (!benchmark)
+    {
+        return load_stdin(opts.outstanding);
+    }
+
+    if (opts.threads <= 0 || opts.keys <= 0 || opts.value_size < 0 || opts.ops < 0 || opts.compress < 0 ||
+        opts.reads < 0 || opts.reads > 1 || opts.theta < 0 || opts.theta >= 1)
+    {
+        std::cerr << "invalid benchmark parameters" << std::endl;
+        ap.usage();
+        return EXIT_FAILURE;
+    }
+
+    return bench(opts);
 }
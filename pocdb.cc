@@ -25,752 +25,302 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
-// POSIX
-#include <signal.h>
-
-// Google Log
-#include <glog/logging.h>
-#include <glog/raw_logging.h>
-
-// LevelDB
-#include <leveldb/comparator.h>
-#include <leveldb/db.h>
-#include <leveldb/filter_policy.h>
-
-// po6
-#include <po6/threads/thread.h>
-#include <po6/time.h>
-
 // e
-#include <e/daemon.h>
-#include <e/compat.h>
-#include <e/guard.h>
-#include <e/state_hash_table.h>
-#include <e/strescape.h>
+#include <e/popt.h>
 
 // pocdb
-#include <pocdb.h>
-#include "common.h"
-
-#define CHECK_UNPACK(UNPACKER) \
-    do \
-    { \
-        if (UNPACKER.error()) \
-        { \
-            LOG(WARNING) << __FILE__ << ":" << __LINE__ << " received corrupt message"; \
-            return; \
-        } \
-    } while (0)
-
-struct pocdaemon;
-
-struct ballot
-{
-    uint64_t number;
-    uint64_t leader;
-
-    bool operator < (const ballot& rhs) const
-    { return number < rhs.number ||
-             (number == rhs.number && leader < rhs.leader); }
-    bool operator == (const ballot& rhs) const
-    { return number == rhs.number && leader == rhs.leader; }
-    bool operator != (const ballot& rhs) const
-    { return !(*this == rhs); }
-    bool operator > (const ballot& rhs) const
-    { return rhs < *this; }
-};
-
-e::packer
-operator << (e::packer pa, const ballot& rhs)
-{
-    return pa << rhs.number << rhs.leader;
-}
-
-e::unpacker
-operator >> (e::unpacker up, ballot& rhs)
-{
-    return up >> rhs.number >> rhs.leader;
-}
-
-size_t
-pack_size(const ballot&)
-{
-    return 2 * sizeof(uint64_t);
-}
-
-struct pvalue
-{
-    pvalue() : b(), v() {}
-
-    ballot b;
-    std::string v;
-};
-
-e::packer
-operator << (e::packer pa, const pvalue& rhs)
-{
-    return pa << rhs.b << e::slice(rhs.v);
-}
-
-e::unpacker
-operator >> (e::unpacker up, pvalue& rhs)
-{
-    e::slice v;
-    up = up >> rhs.b >> v;
-    rhs.v.assign(v.cdata(), v.size());
-    return up;
-}
-
-size_t
-pack_size(const pvalue& p)
-{
-    return pack_size(p.b) + pack_size(e::slice(p.v));
-}
-
-struct write_state_machine
-{
-    write_state_machine(const std::string& k);
-
-    const std::string& state_key();
-    bool finished();
-    void write(uint64_t c, const e::slice& v, pocdaemon* d);
-    void phase1b(uint64_t c, uint64_t ver, const ballot& b, const pvalue& v, pocdaemon* d);
-    void phase2b(uint64_t c, uint64_t ver, const ballot& b, pocdaemon* d);
-    void retry(pocdaemon* d);
-
-    void work_state_machine(pocdaemon* d);
-
-    const std::string key;
-    po6::threads::mutex mtx;
-    std::list<std::pair<uint64_t, std::string> > values;
-
-    // paxos state
-    bool executing_paxos;
-    ballot leading;
-    std::vector<uint64_t> promises;
-    std::vector<uint64_t> accepted;
-    pvalue max_accepted;
-    uint64_t version;
-
-    private:
-        write_state_machine(const write_state_machine&);
-        write_state_machine& operator = (const write_state_machine&);
-};
-
-struct pocdaemon
-{
-    pocdaemon(uint64_t host);
-    int run();
-
-    void process_put(uint64_t c, std::auto_ptr<e::buffer> msg, e::unpacker up);
-    void process_get(uint64_t c, std::auto_ptr<e::buffer> msg, e::unpacker up);
-    void process_phase1a(uint64_t c, std::auto_ptr<e::buffer> msg, e::unpacker up);
-    void process_phase1b(uint64_t c, std::auto_ptr<e::buffer> msg, e::unpacker up);
-    void process_phase2a(uint64_t c, std::auto_ptr<e::buffer> msg, e::unpacker up);
-    void process_phase2b(uint64_t c, std::auto_ptr<e::buffer> msg, e::unpacker up);
-    void process_learn(uint64_t c, std::auto_ptr<e::buffer> msg, e::unpacker up);
-    void process_retry(uint64_t c, std::auto_ptr<e::buffer> msg, e::unpacker up);
-
-    pocdb_returncode get_acceptor_state(const e::slice& k, uint64_t* ver,
-                                        ballot* b, pvalue* v);
-    pocdb_returncode save_acceptor_state(const e::slice& k, uint64_t ver,
-                                         const ballot& b, const pvalue& v);
-
-    uint64_t host;
-    e::garbage_collector gc;
-    controller control;
-    const std::auto_ptr<busybee_server> busybee;
-    leveldb::DB* db;
-    typedef e::state_hash_table<std::string, write_state_machine> write_map_t;
-    write_map_t writes;
-
-    private:
-        pocdaemon(const pocdaemon&);
-        pocdaemon& operator = (const pocdaemon&);
-};
-
-uint32_t s_interrupts = 0;
-
-static void
-exit_on_signal(int /*signum*/)
-{
-    RAW_LOG(ERROR, "interrupted: exiting");
-    e::atomic::increment_32_nobarrier(&s_interrupts, 1);
-}
+#include "daemon.h"
 
-int
-main(int argc, const char* argv[])
-{
-    assert(argc == 2);
-    uint64_t host = 0;
-
-    if (strcmp("A", argv[1]) == 0) host = HOSTA;
-    if (strcmp("B", argv[1]) == 0) host = HOSTB;
-    if (strcmp("C", argv[1]) == 0) host = HOSTC;
-    if (strcmp("D", argv[1]) == 0) host = HOSTD;
-    if (strcmp("E", argv[1]) == 0) host = HOSTE;
-    assert(host > 0);
-
-    pocdaemon d(host);
-    return d.run();
-}
-
-pocdaemon :: pocdaemon(uint64_t h)
-    : host(h)
-    , gc()
-    , control()
-    , busybee(busybee_server::create(&control, host, control.lookup(host), &gc))
-    , db(NULL)
-    , writes(&gc)
-{
-}
-
-int
-pocdaemon :: run()
+static bool
+valid_store_config(const store_config& cfg)
 {
-    if (!e::block_all_signals())
+    if (cfg.block_cache < 0 || cfg.bloom_bits < 0 ||
+        cfg.write_buffer <= 0 || cfg.block_size <= 0)
     {
-        std::cerr << "could not block signals; exiting" << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    if (!e::install_signal_handler(SIGHUP, exit_on_signal) ||
-        !e::install_signal_handler(SIGINT, exit_on_signal) ||
-        !e::install_signal_handler(SIGTERM, exit_on_signal) ||
-        !e::install_signal_handler(SIGQUIT, exit_on_signal))
-    {
-        PLOG(ERROR) << "could not install signal handlers";
-        return EXIT_FAILURE;
+        std::cerr << "leveldb sizes must be positive (caches and filters may be zero)" << std::endl;
+        return false;
     }
 
-    leveldb::Options opts;
-    opts.create_if_missing = true;
-    opts.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    opts.max_open_files = std::max(sysconf(_SC_OPEN_MAX) >> 1, 1024L);
-    leveldb::Status st = leveldb::DB::Open(opts, ".", &db);
-
-    if (!st.ok())
+    if (strcmp(cfg.compression, "snappy") != 0 && strcmp(cfg.compression, "none") != 0)
     {
-        LOG(ERROR) << "could not open leveldb: " << st.ToString();
-        return EXIT_FAILURE;
+        std::cerr << "compression must be snappy or none" << std::endl;
+        return false;
     }
 
-    e::garbage_collector::thread_state ts;
-    gc.register_thread(&ts);
-
-    while (s_interrupts == 0)
-    {
-        uint64_t id;
-        std::auto_ptr<e::buffer> msg;
-        busybee_returncode rc = busybee->recv(&ts, -1, &id, &msg);
-
-        if (rc != BUSYBEE_SUCCESS)
-        {
-            LOG(ERROR) << "busybee: " << rc;
-            continue;
-        }
-
-        e::unpacker up(msg->unpack_from(BUSYBEE_HEADER_SIZE));
-        uint8_t type;
-        up = up >> type;
-
-        if (up.error())
-        {
-            LOG(ERROR) << "bad message";
-            continue;
-        }
-
-        switch (type)
-        {
-            case uint8_t('P'):
-                process_put(id, msg, up);
-                continue;
-            case uint8_t('G'):
-                process_get(id, msg, up);
-                continue;
-            case uint8_t('a'):
-                process_phase1a(id, msg, up);
-                continue;
-            case uint8_t('b'):
-                process_phase1b(id, msg, up);
-                continue;
-            case uint8_t('A'):
-                process_phase2a(id, msg, up);
-                continue;
-            case uint8_t('B'):
-                process_phase2b(id, msg, up);
-                continue;
-            case uint8_t('L'):
-                process_learn(id, msg, up);
-                continue;
-            case uint8_t('R'):
-                process_retry(id, msg, up);
-                continue;
-            default:
-                LOG(ERROR) << "bad message";
-                continue;
-        }
-    }
-
-    return EXIT_SUCCESS;
+    return true;
 }
 
-void
-pocdaemon :: process_get(uint64_t c, std::auto_ptr<e::buffer> msg, e::unpacker up)
-{
-    e::slice k;
-    up = up >> k;
-    CHECK_UNPACK(up);
-    std::string key(k.cdata(), k.size());
-    key.append("L");
-    std::string val;
-    leveldb::Status st = db->Get(leveldb::ReadOptions(), key, &val);
-    pocdb_returncode rc = POCDB_SUCCESS;
-
-    if (st.IsNotFound())
-    {
-        rc = POCDB_NOT_FOUND;
-    }
-    else if (st.ok())
-    {
-        rc = POCDB_SUCCESS;
-    }
-    else
-    {
-        rc = POCDB_SERVER_ERROR;
-    }
-
-    if (val.size() > 8) val.resize(val.size() - 8);
-    const size_t sz = BUSYBEE_HEADER_SIZE
-                    + 8 + pack_size(e::slice(val));
-    msg.reset(e::buffer::create(sz));
-    msg->pack_at(BUSYBEE_HEADER_SIZE)
-        << e::pack_uint8<pocdb_returncode>(rc) << e::slice(val);
-    busybee->send(c, msg);
-}
-
-void
-pocdaemon :: process_put(uint64_t c, std::auto_ptr<e::buffer>, e::unpacker up)
-{
-    e::slice k;
-    e::slice v;
-    up = up >> k >> v;
-    CHECK_UNPACK(up);
-
-    write_map_t::state_reference sr;
-    write_state_machine* sm = writes.get_or_create_state(k.str(), &sr);
-    sm->write(c, v, this);
-}
-
-void
-pocdaemon :: process_phase1a(uint64_t c, std::auto_ptr<e::buffer> msg, e::unpacker up)
+int
+main(int argc, const char* argv[])
 {
-    e::slice k;
-    uint64_t ver;
-    ballot b;
-    up = up >> k >> ver >> b;
-    CHECK_UNPACK(up);
-
-    uint64_t cur_ver;
-    ballot cur_b;
-    pvalue cur_v;
-
-    if (get_acceptor_state(k, &cur_ver, &cur_b, &cur_v) != POCDB_SUCCESS)
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    e::argparser ap;
+    ap.autohelp();
+    ap.option_string("[OPTIONS] <A|B|C|D|E>");
+    ap.arg().name('t', "threads")
+            .description("number of threads handling network traffic (default: one per core)")
+            .metavar("N")
+            .as_long(&threads);
+    bool stable_ballots = true;
+    ap.arg().long_name("stable-ballots")
+            .description("skip Phase 1 for keys this host already leads (default)")
+            .set_true(&stable_ballots);
+    ap.arg().long_name("no-stable-ballots")
+            .description("run a full Phase 1 for every version written")
+            .set_false(&stable_ballots);
+    long coalesce = 64;
+    ap.arg().long_name("coalesce")
+            .description("most queued puts to one key that commit in a single round (default: 64)")
+            .metavar("N")
+            .as_long(&coalesce);
+    long commit_delay = 0;
+    ap.arg().long_name("commit-delay")
+            .description("microseconds to wait for more writes before syncing a batch (default: 0)")
+            .metavar("US")
+            .as_long(&commit_delay);
+    long cache_size = 64;
+    ap.arg().long_name("cache-size")
+            .description("megabytes of recently learned values to cache in memory (default: 64)")
+            .metavar("MB")
+            .as_long(&cache_size);
+    long max_queued = 256;
+    ap.arg().long_name("max-queued")
+            .description("megabytes of put values queued before puts are refused as busy (default: 256)")
+            .metavar("MB")
+            .as_long(&max_queued);
+    long retry_backoff = 500;
+    ap.arg().long_name("retry-backoff")
+            .description("microseconds a preempted proposer first backs off, doubling while contended; 0 retries at once (default: 500)")
+            .metavar("US")
+            .as_long(&retry_backoff);
+    long ae_interval = 60;
+    ap.arg().long_name("anti-entropy-interval")
+            .description("seconds between anti-entropy rounds; 0 disables them (default: 60)")
+            .metavar("S")
+            .as_long(&ae_interval);
+    long ae_rate = 50000;
+    ap.arg().long_name("anti-entropy-rate")
+            .description("learned records scanned per second by anti-entropy (default: 50000)")
+            .metavar("N")
+            .as_long(&ae_rate);
+    long lease_term = 1000;
+    ap.arg().long_name("read-lease")
+            .description("milliseconds a read lease lasts; 0 disables leases, so consistent gets always read a quorum (default: 1000)")
+            .metavar("MS")
+            .as_long(&lease_term);
+    long lease_skew = 50;
+    ap.arg().long_name("lease-skew")
+            .description("milliseconds that clocks may drift apart over one lease (default: 50)")
+            .metavar("MS")
+            .as_long(&lease_skew);
+    long client_rate = 0;
+    ap.arg().long_name("client-rate")
+            .description("puts a second each client may make; 0 for no limit (default: 0)")
+            .metavar("N")
+            .as_long(&client_rate);
+    long client_burst = 1000;
+    ap.arg().long_name("client-burst")
+            .description("puts a client may make at once before its rate applies (default: 1000)")
+            .metavar("N")
+            .as_long(&client_burst);
+    long client_queue = 64;
+    ap.arg().long_name("client-queue")
+            .description("megabytes of requests queued for one client before its puts are refused as busy (default: 64)")
+            .metavar("MB")
+            .as_long(&client_queue);
+    long commit_batch = 1024;
+    ap.arg().long_name("commit-batch")
+            .description("maximum number of writes to sync in one batch (default: 1024)")
+            .metavar("N")
+            .as_long(&commit_batch);
+
+    long trace_sample = 1024;
+    ap.arg().long_name("trace-sample")
+            .description("trace one in N learned writes; 0 disables tracing (default: 1024)")
+            .metavar("N")
+            .as_long(&trace_sample);
+    bool trace_values = false;
+    ap.arg().long_name("trace-values")
+            .description("include value bytes in traces")
+            .set_true(&trace_values);
+    bool trace_all = false;
+    ap.arg().long_name("trace-all")
+            .description("trace every learned write with its value, for debugging")
+            .set_true(&trace_all);
+
+    store_config acceptor;
+    store_config learned;
+    learned.block_cache = -1;
+    learned.write_buffer = -1;
+    learned.block_size = -1;
+    learned.bloom_bits = -1;
+    learned.compression = NULL;
+    bool split_learned = false;
+    ap.arg().long_name("block-cache")
+            .description("megabytes of leveldb block cache; 0 disables it (default: 64)")
+            .metavar("MB")
+            .as_long(&acceptor.block_cache);
+    ap.arg().long_name("write-buffer")
+            .description("megabytes of leveldb write buffer (default: 4)")
+            .metavar("MB")
+            .as_long(&acceptor.write_buffer);
+    ap.arg().long_name("block-size")
+            .description("kilobytes per leveldb block (default: 4)")
+            .metavar("KB")
+            .as_long(&acceptor.block_size);
+    ap.arg().long_name("bloom-bits")
+            .description("bloom filter bits per key; 0 disables it (default: 10)")
+            .metavar("N")
+            .as_long(&acceptor.bloom_bits);
+    ap.arg().long_name("compression")
+            .description("leveldb block compression, snappy or none (default: snappy)")
+            .metavar("CODEC")
+            .as_string(&acceptor.compression);
+    ap.arg().long_name("split-learned")
+            .description("keep learned values in a separate leveldb under ./learned")
+            .set_true(&split_learned);
+    ap.arg().long_name("learned-block-cache")
+            .description("--block-cache for the learned store (default: same)")
+            .metavar("MB")
+            .as_long(&learned.block_cache);
+    ap.arg().long_name("learned-write-buffer")
+            .description("--write-buffer for the learned store (default: same)")
+            .metavar("MB")
+            .as_long(&learned.write_buffer);
+    ap.arg().long_name("learned-block-size")
+            .description("--block-size for the learned store (default: same)")
+            .metavar("KB")
+            .as_long(&learned.block_size);
+    ap.arg().long_name("learned-bloom-bits")
+            .description("--bloom-bits for the learned store (default: same)")
+            .metavar("N")
+            .as_long(&learned.bloom_bits);
+    ap.arg().long_name("learned-compression")
+            .description("--compression for the learned store (default: same)")
+            .metavar("CODEC")
+            .as_string(&learned.compression);
+
+    if (!ap.parse(argc, argv))
     {
-        LOG(ERROR) << "could not get acceptor state";
-        return;
-    }
-
-    if (c == b.leader && b > cur_b && ver >= cur_ver)
-    {
-        cur_ver = ver;
-        cur_b = b;
-
-        if (save_acceptor_state(k, cur_ver, cur_b, cur_v) != POCDB_SUCCESS)
-        {
-            LOG(ERROR) << "could not save acceptor state";
-            return;
-        }
+        return EXIT_FAILURE;
     }
 
-    const size_t sz = BUSYBEE_HEADER_SIZE
-                    + 1 + sizeof(uint64_t)
-                    + pack_size(k)
-                    + pack_size(cur_b)
-                    + pack_size(cur_v);
-    msg.reset(e::buffer::create(sz));
-    msg->pack_at(BUSYBEE_HEADER_SIZE)
-        << uint8_t('b') << k << cur_ver << cur_b << cur_v;
-    busybee->send(c, msg);
-}
-
-void
-pocdaemon :: process_phase1b(uint64_t c, std::auto_ptr<e::buffer>, e::unpacker up)
-{
-    e::slice k;
-    uint64_t ver;
-    ballot b;
-    pvalue v;
-    up = up >> k >> ver >> b >> v;
-    CHECK_UNPACK(up);
-
-    write_map_t::state_reference sr;
-    write_state_machine* sm = writes.get_or_create_state(k.str(), &sr);
-    sm->phase1b(c, ver, b, v, this);
-}
-
-void
-pocdaemon :: process_phase2a(uint64_t c, std::auto_ptr<e::buffer> msg, e::unpacker up)
-{
-    e::slice k;
-    uint64_t ver;
-    ballot b;
-    pvalue v;
-    up = up >> k >> ver >> b >> v;
-    CHECK_UNPACK(up);
-
-    uint64_t cur_ver;
-    ballot cur_b;
-    pvalue cur_v;
+    if (learned.block_cache < 0) learned.block_cache = acceptor.block_cache;
+    if (learned.write_buffer < 0) learned.write_buffer = acceptor.write_buffer;
+    if (learned.block_size < 0) learned.block_size = acceptor.block_size;
+    if (learned.bloom_bits < 0) learned.bloom_bits = acceptor.bloom_bits;
+    if (!learned.compression) learned.compression = acceptor.compression;
 
-    if (get_acceptor_state(k, &cur_ver, &cur_b, &cur_v) != POCDB_SUCCESS)
+    if (!valid_store_config(acceptor) || !valid_store_config(learned))
     {
-        LOG(ERROR) << "could not get acceptor state";
-        return;
+        return EXIT_FAILURE;
     }
 
-    if (ver == cur_ver && b == cur_b)
-    {
-        if (save_acceptor_state(k, ver, b, v) != POCDB_SUCCESS)
-        {
-            LOG(ERROR) << "could not save acceptor state";
-            return;
-        }
-
-        const size_t sz = BUSYBEE_HEADER_SIZE
-                        + 1 + sizeof(uint64_t)
-                        + pack_size(k)
-                        + pack_size(cur_b);
-        msg.reset(e::buffer::create(sz));
-        msg->pack_at(BUSYBEE_HEADER_SIZE)
-            << uint8_t('B') << k << cur_ver << cur_b;
-        busybee->send(c, msg);
-    }
-    else
+    if (ap.args_sz() != 1)
     {
-        const size_t sz = BUSYBEE_HEADER_SIZE
-                        + 1
-                        + pack_size(k);
-        msg.reset(e::buffer::create(sz));
-        msg->pack_at(BUSYBEE_HEADER_SIZE)
-            << uint8_t('R') << k;
-        busybee->send(c, msg);
-        return;
+        std::cerr << "specify exactly one host to run as" << std::endl;
+        ap.usage();
+        return EXIT_FAILURE;
     }
-}
 
-void
-pocdaemon :: process_phase2b(uint64_t c, std::auto_ptr<e::buffer>, e::unpacker up)
-{
-    e::slice k;
-    uint64_t ver;
-    ballot b;
-    up = up >> k >> ver >> b;
-    CHECK_UNPACK(up);
-
-    write_map_t::state_reference sr;
-    write_state_machine* sm = writes.get_or_create_state(k.str(), &sr);
-    sm->phase2b(c, ver, b, this);
-}
-
-void
-pocdaemon :: process_learn(uint64_t, std::auto_ptr<e::buffer>, e::unpacker up)
-{
-    e::slice k;
-    uint64_t ver;
-    e::slice v;
-    up = up >> k >> ver >> v;
-    CHECK_UNPACK(up);
-    // XXX there's a race condition here; should only write to leveldb if newly
-    // learned value has (ver) higher than previously learned value
+    const char* name = ap.args()[0];
+    uint64_t host = 0;
 
-    std::string key(k.cdata(), k.size());
-    std::string val(v.cdata(), v.size());
-    key.append("L", 1);
-    val.append((const char*)&ver, sizeof(ver));
-    leveldb::WriteOptions opts;
-    opts.sync = true;
-    leveldb::Status st = db->Put(opts, key, val);
+    if (strcmp("A", name) == 0) host = HOSTA;
+    if (strcmp("B", name) == 0) host = HOSTB;
+    if (strcmp("C", name) == 0) host = HOSTC;
+    if (strcmp("D", name) == 0) host = HOSTD;
+    if (strcmp("E", name) == 0) host = HOSTE;
 
-    if (!st.ok())
+    if (host == 0)
     {
-        LOG(ERROR) << "leveldb error: " << st.ToString();
+        std::cerr << "host must be one of A, B, C, D, or E" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    LOG(INFO) << "put \"" << e::strescape(k.str()) << "\" (" << ver << ") ->\"" << e::strescape(v.str()) << "\""; 
-}
-
-void
-pocdaemon :: process_retry(uint64_t, std::auto_ptr<e::buffer>, e::unpacker up)
-{
-    e::slice k;
-    CHECK_UNPACK(up);
-
-    write_map_t::state_reference sr;
-    write_state_machine* sm = writes.get_or_create_state(k.str(), &sr);
-    sm->retry(this);
-}
-
-pocdb_returncode
-pocdaemon :: get_acceptor_state(const e::slice& k, uint64_t* ver,
-                                ballot* b, pvalue* v)
-{
-    *ver = 0;
-    *b = ballot();
-    *v = pvalue();
-
-    std::string key(k.cdata(), k.size());
-    key.append("A");
-    std::string val;
-    leveldb::Status st = db->Get(leveldb::ReadOptions(), key, &val);
-
-    if (st.IsNotFound())
-    {
-        return POCDB_SUCCESS;
-    }
-    else if (!st.ok())
+    if (threads <= 0)
     {
-        LOG(ERROR) << "error: " << st.ToString();
-        return POCDB_SERVER_ERROR;
+        std::cerr << "must run with at least one thread" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    e::unpacker up(val);
-    up = up >> *ver >> *b >> *v;
-
-    if (up.error())
+    if (coalesce <= 0)
     {
-        LOG(ERROR) << "corrupt acceptor";
-        return POCDB_SERVER_ERROR;
+        std::cerr << "must coalesce at least one put per round" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    key = std::string(k.cdata(), k.size());
-    key.append("L");
-    st = db->Get(leveldb::ReadOptions(), key, &val);
-    uint64_t written = 0;
-
-    if (st.ok())
+    if (commit_delay < 0 || commit_batch <= 0)
     {
-        written = *(uint64_t*)(val.data() + val.size() - 8);
+        std::cerr << "commit delay must be non-negative and commit batch positive" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    if (*ver == written)
+    if (retry_backoff < 0)
     {
-        ++*ver;
-        *b = ballot();
-        *v = pvalue();
+        std::cerr << "retry backoff must be non-negative" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    return POCDB_SUCCESS;
-}
-
-pocdb_returncode
-pocdaemon :: save_acceptor_state(const e::slice& k, uint64_t ver,
-                                 const ballot& b, const pvalue& v)
-{
-    std::string key;
-    std::string val;
-    key.assign(k.cdata(), k.size());
-    key.append("A");
-    e::packer(&val) << ver << b << v;
-    leveldb::WriteOptions opts;
-    opts.sync = true;
-    leveldb::Status st = db->Put(opts, key, val);
-
-    if (!st.ok())
+    if (ae_interval < 0 || ae_rate <= 0)
     {
-        LOG(ERROR) << "error: " << st.ToString();
-        return POCDB_SERVER_ERROR;
+        std::cerr << "anti-entropy interval must be non-negative and rate positive" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    return POCDB_SUCCESS;
-}
-
-write_state_machine :: write_state_machine(const std::string& k)
-    : key(k)
-    , mtx()
-    , values()
-    , executing_paxos()
-    , leading()
-    , promises()
-    , accepted()
-    , max_accepted()
-    , version()
-{
-}
-
-const std::string&
-write_state_machine :: state_key()
-{
-    po6::threads::mutex::hold hold(&mtx);
-    return key;
-}
-
-bool
-write_state_machine :: finished()
-{
-    po6::threads::mutex::hold hold(&mtx);
-    return values.empty();
-}
-
-void
-write_state_machine :: write(uint64_t c, const e::slice& v, pocdaemon* d)
-{
-    po6::threads::mutex::hold hold(&mtx);
-    values.push_back(std::make_pair(c, v.str()));
-    work_state_machine(d);
-}
-
-void
-write_state_machine :: phase1b(uint64_t c, uint64_t ver, const ballot& b, const pvalue& v, pocdaemon* d)
-{
-    po6::threads::mutex::hold hold(&mtx);
-
-    if ((version != 0 && ver > version) || b > leading)
+    if (lease_term < 0 || lease_skew < 0)
     {
-        executing_paxos = false;
-        version = ver;
-        return work_state_machine(d);
+        std::cerr << "read lease and lease skew must be non-negative" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    version = ver;
-
-    if (v.b != ballot() && v.b > max_accepted.b)
+    if (client_rate < 0 || client_burst <= 0 || client_queue <= 0)
     {
-        max_accepted = v;
+        std::cerr << "client rate must be non-negative, and burst and queue positive" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    promises.push_back(c);
-    work_state_machine(d);
-}
-
-void
-write_state_machine :: phase2b(uint64_t c, uint64_t ver, const ballot& b, pocdaemon* d)
-{
-    po6::threads::mutex::hold hold(&mtx);
-
-    if (ver != version || b != leading)
+    if (max_queued <= 0)
     {
-        return;
+        std::cerr << "must allow some queued puts" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    accepted.push_back(c);
-    work_state_machine(d);
-}
-
-void
-write_state_machine :: retry(pocdaemon* d)
-{
-    po6::threads::mutex::hold hold(&mtx);
-    executing_paxos = false;
-    ++version;
-    return work_state_machine(d);
-}
-
-void
-write_state_machine :: work_state_machine(pocdaemon* d)
-{
-    if (!executing_paxos && values.empty())
-    {
-        return;
-    }
-    else if (!executing_paxos)
+    if (cache_size < 0)
     {
-        executing_paxos = true;
-
-        leading = ballot();
-        leading.number = po6::wallclock_time();
-        leading.leader = d->host;
-        promises.clear();
-        accepted.clear();
-        max_accepted.b = ballot();
-        max_accepted.v = values.begin()->second;
+        std::cerr << "cache size must be non-negative" << std::endl;
+        return EXIT_FAILURE;
     }
 
-    if (max_accepted.b > leading)
+    if (trace_all)
     {
-        executing_paxos = false;
-        return work_state_machine(d);
+        trace_sample = 1;
+        trace_values = true;
     }
 
-    if (promises.size() < QUORUM)
+    if (trace_sample < 0)
     {
-        const size_t sz = BUSYBEE_HEADER_SIZE
-                        + 1 + sizeof(uint64_t)
-                        + pack_size(e::slice(key))
-                        + pack_size(leading);
-
-        for (size_t i = 0; i < NUM_HOSTS; ++i)
-        {
-            if (std::find(promises.begin(), promises.end(), HOSTS[i]) != promises.end())
-            {
-                continue;
-            }
-
-            std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
-            msg->pack_at(BUSYBEE_HEADER_SIZE)
-                << uint8_t('a') << e::slice(key) << version << leading;
-            d->busybee->send(HOSTS[i], msg);
-        }
+        std::cerr << "trace sample must be non-negative" << std::endl;
+        return EXIT_FAILURE;
     }
-    else if (accepted.size() < QUORUM)
-    {
-        max_accepted.b = leading;
-        const size_t sz = BUSYBEE_HEADER_SIZE
-                        + 1 + sizeof(uint64_t)
-                        + pack_size(e::slice(key))
-                        + pack_size(leading)
-                        + pack_size(max_accepted);
 
-        for (size_t i = 0; i < NUM_HOSTS; ++i)
-        {
-            if (std::find(accepted.begin(), accepted.end(), HOSTS[i]) != accepted.end())
-            {
-                continue;
-            }
-
-            std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
-            msg->pack_at(BUSYBEE_HEADER_SIZE)
-                << uint8_t('A') << e::slice(key) << version << leading << max_accepted;
-            d->busybee->send(HOSTS[i], msg);
-        }
-    }
-    else
-    {
-        const size_t sz = BUSYBEE_HEADER_SIZE
-                        + 1 + sizeof(uint64_t)
-                        + pack_size(e::slice(key))
-                        + pack_size(e::slice(max_accepted.v));
-
-        for (size_t i = 0; i < NUM_HOSTS; ++i)
-        {
-            std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
-            msg->pack_at(BUSYBEE_HEADER_SIZE)
-                << uint8_t('L') << e::slice(key) << version << e::slice(max_accepted.v);
-            d->busybee->send(HOSTS[i], msg);
-        }
-
-        executing_paxos = false;
-        ++version;
-
-        if (max_accepted.v == values.front().second)
-        {
-            std::auto_ptr<e::buffer> msg(e::buffer::create(sz));
-            msg->pack_at(BUSYBEE_HEADER_SIZE)
-                << e::pack_uint8<pocdb_returncode>(POCDB_SUCCESS);
-            d->busybee->send(values.begin()->first, msg);
-            values.pop_front();
-        }
-
-        work_state_machine(d);
-    }
+    daemon_options opts;
+    opts.stable_ballots = stable_ballots;
+    opts.coalesce = coalesce;
+    opts.commit_delay = commit_delay * PO6_MICROS;
+    opts.commit_batch = commit_batch;
+    opts.cache_bytes = uint64_t(cache_size) << 20;
+    opts.trace_sample = trace_sample;
+    opts.trace_values = trace_values;
+    opts.max_queued = uint64_t(max_queued) << 20;
+    opts.ae_interval = ae_interval * PO6_SECONDS;
+    opts.ae_rate = ae_rate;
+    opts.retry_backoff = retry_backoff * PO6_MICROS;
+    opts.lease_term = lease_term * PO6_MILLIS;
+    opts.lease_skew = lease_skew * PO6_MILLIS;
+    opts.client_rate = client_rate;
+    opts.client_burst = client_burst;
+    opts.client_queue = uint64_t(client_queue) << 20;
+    pocdaemon d(host, opts);
+    return d.run(threads, acceptor, split_learned ? &learned : NULL);
 }
@@ -46,6 +46,9 @@ enum pocdb_returncode
     POCDB_SEE_ERRNO,
     POCDB_SERVER_ERROR,
     POCDB_INTERNAL,
+    POCDB_TIMEOUT,
+    POCDB_NONE_PENDING,
+    POCDB_BUSY,
     POCDB_GARBAGE
 };
 
@@ -54,14 +57,128 @@ struct pocdb_client;
 struct pocdb_client* pocdb_create();
 void pocdb_destroy(struct pocdb_client* client);
 
+/* put fails with POCDB_BUSY, and may be retried later, when the server it was
+ * sent to already has too many bytes of puts queued.  Any request, gets
+ * included, fails so when the server has too many of this client's requests
+ * waiting.
+ */
 enum pocdb_returncode pocdb_put(struct pocdb_client* client,
                                 const char* key, size_t key_sz,
                                 const char* val, size_t val_sz);
-// get is not consistent---done to save time (no, you cannot just read from one
-// replica to get a consistent read)
+/* get is not consistent---done to save time (no, you cannot just read from one
+ * replica to get a consistent read)
+ */
 enum pocdb_returncode pocdb_get(struct pocdb_client* client,
                                 const char* key, size_t key_sz,
                                 char** val, size_t* val_sz);
+/* consistent get is answered by one replica if it holds a read lease on the
+ * key; otherwise it reads from a quorum and, when replicas disagree or a write
+ * is in flight, has a server complete the write before answering.  Either way
+ * it observes every put that completed before it was called.
+ */
+enum pocdb_returncode pocdb_get_consistent(struct pocdb_client* client,
+                                           const char* key, size_t key_sz,
+                                           char** val, size_t* val_sz);
+
+/* Hedged gets (off by default):  a pocdb_get or pocdb_async_get not answered
+ * within this client's recent 95th percentile get latency is also sent to
+ * another replica, and the first reply wins.  Requests of every kind are
+ * routed to the replica with the lowest latency for its outstanding load.
+ */
+void pocdb_hedge_gets(struct pocdb_client* client, int enable);
+
+/* Values are stored exactly as given unless the client tags them (off by
+ * default).  A tagged value begins with a byte naming how the rest of it is
+ * encoded, which compression and chunking need, and gets decode it.  Tagged
+ * and untagged values cannot be told apart, so every client of a store,
+ * including any that wrote it before tags existed, must agree on one.
+ */
+void pocdb_tag_values(struct pocdb_client* client, int enable);
+
+/* Compress the values of puts that are at least min_size bytes (zero, the
+ * default, compresses none).  Values are compressed once by the client; the
+ * servers replicate and store them compressed, and gets decompress them.
+ * Only a client that tags values compresses them.
+ */
+void pocdb_compress_values(struct pocdb_client* client, size_t min_size);
+
+/* A client that tags values splits values larger than 256 KiB into chunks,
+ * each stored under a key of its own; only a small manifest naming them is
+ * put under the key itself, and only once every chunk is stored.  Gets
+ * reassemble the value.  Once a put replaces such a value, or fails, the
+ * chunks no manifest names are emptied.  A reader streams a value instead,
+ * holding no more than two chunks of it at a time:  pocdb_reader_read copies
+ * the value's next bytes into buf and returns how many it copied, zero at the
+ * end of the value, or -1 with *status set, as when the value is replaced
+ * while being read.
+ */
+struct pocdb_reader;
+struct pocdb_reader* pocdb_reader_open(struct pocdb_client* client,
+                                       const char* key, size_t key_sz,
+                                       enum pocdb_returncode* status);
+uint64_t pocdb_reader_size(struct pocdb_reader* reader);
+int64_t pocdb_reader_read(struct pocdb_reader* reader, char* buf, size_t buf_sz,
+                          enum pocdb_returncode* status);
+void pocdb_reader_close(struct pocdb_reader* reader);
+
+/* Asynchronous operations return a request id, or -1 with *status set if the
+ * request could not be sent.  Keys and values are copied before returning.
+ * *status (and *val, *val_sz for gets) must remain valid until the request
+ * completes; it completes when pocdb_loop or pocdb_wait returns its id, and
+ * only then is *status meaningful.
+ */
+int64_t pocdb_async_put(struct pocdb_client* client,
+                        const char* key, size_t key_sz,
+                        const char* val, size_t val_sz,
+                        enum pocdb_returncode* status);
+int64_t pocdb_async_get(struct pocdb_client* client,
+                        const char* key, size_t key_sz,
+                        enum pocdb_returncode* status,
+                        char** val, size_t* val_sz);
+int64_t pocdb_async_get_consistent(struct pocdb_client* client,
+                                   const char* key, size_t key_sz,
+                                   enum pocdb_returncode* status,
+                                   char** val, size_t* val_sz);
+
+/* Batched operations send all n requests to one server in a single message
+ * and wait for every one of them.  statuses[i] (and vals[i], val_szs[i]) is
+ * the outcome of request i.  The return value is POCDB_SUCCESS once all
+ * requests have completed, even if some individual statuses are errors.
+ */
+enum pocdb_returncode pocdb_multi_put(struct pocdb_client* client, size_t n,
+                                      const char* const* keys, const size_t* key_szs,
+                                      const char* const* vals, const size_t* val_szs,
+                                      enum pocdb_returncode* statuses);
+enum pocdb_returncode pocdb_multi_get(struct pocdb_client* client, size_t n,
+                                      const char* const* keys, const size_t* key_szs,
+                                      enum pocdb_returncode* statuses,
+                                      char** vals, size_t* val_szs);
+
+/* Complete any one outstanding request and return its id.  Returns -1 and
+ * sets *status to POCDB_TIMEOUT, POCDB_NONE_PENDING, or an error otherwise.
+ * A negative timeout waits forever.
+ */
+int64_t pocdb_loop(struct pocdb_client* client, int timeout,
+                   enum pocdb_returncode* status);
+/* Like pocdb_loop, but returns only once request "id" completes. */
+int64_t pocdb_wait(struct pocdb_client* client, int64_t id, int timeout,
+                   enum pocdb_returncode* status);
+
+/* Counters a server keeps: operation counts, cache hits and misses, and
+ * count/p50/p99/p999/max summaries of its latency (in microseconds) and
+ * batching histograms.
+ */
+struct pocdb_stat
+{
+    const char* name;
+    uint64_t value;
+};
+
+/* Fetch the counters of server "server", one of "A" through "E".  *stats is
+ * a single malloc'd block, names included; release it with free().
+ */
+enum pocdb_returncode pocdb_stats(struct pocdb_client* client, const char* server,
+                                  struct pocdb_stat** stats, size_t* stats_sz);
 
 #ifdef __cplusplus
 } /* extern "C" */
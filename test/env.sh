@@ -0,0 +1,6 @@
+# Sourced ahead of every test by make check, with the source and build
+# directories and the version as arguments.
+export POCDB_SRCDIR="$1"
+export POCDB_BUILDDIR="$2"
+export POCDB_VERSION="$3"
+export PATH="${POCDB_BUILDDIR}:${PATH}"
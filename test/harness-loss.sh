@@ -0,0 +1,12 @@
+#!/bin/sh
+# Puts and consistent gets on an in-process cluster whose network drops one
+# message in fifty and reorders the rest.  Few keys keep rounds contending
+# and leases in play; pocdb-harness --check fails the run if a consistent get
+# misses a put acknowledged before it began.
+set -e
+
+for seed in 1 2 3; do
+    pocdb-harness --check --consistent --loss 0.02 --latency 100 --jitter 200 \
+        --keys 64 --ops 4000 --clients 4 --outstanding 8 --reads 0.5 \
+        --timeout 250 --seed ${seed} --dir "${TMPDIR:-/tmp}"
+done
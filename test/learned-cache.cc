@@ -0,0 +1,182 @@
+// Copyright (c) 2017, Robert Escriva
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of pocdb nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// The cache of learned values:  versions only move forward, shards stay
+// within their share of the budget, least recently used first out.
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+
+// pocdb
+#include "daemon.h"
+
+// each shard holds SHARD bytes of keys and values
+#define SHARD 1000
+
+// "n" distinct keys that share a shard
+static std::vector<std::string>
+same_shard(learned_cache* c, size_t n)
+{
+    std::vector<std::string> keys;
+    learned_cache::shard* s = NULL;
+
+    for (unsigned i = 0; keys.size() < n; ++i)
+    {
+        char k[32];
+        const int k_sz = snprintf(k, sizeof(k), "key%u", i);
+        const std::string key(k, k_sz);
+
+        if (!s)
+        {
+            s = c->get_shard(e::slice(key));
+        }
+
+        if (c->get_shard(e::slice(key)) == s)
+        {
+            keys.push_back(key);
+        }
+    }
+
+    return keys;
+}
+
+static void
+check_versions()
+{
+    learned_cache c(SHARD * LEARNED_CACHE_SHARDS);
+    const e::slice k("key");
+    uint64_t ver;
+    std::string val;
+    CHECK(!c.get(k, &ver, &val));
+
+    c.put(k, 5, e::slice("five"));
+    CHECK(c.get(k, &ver, &val));
+    CHECK_EQ(ver, 5U);
+    CHECK_EQ(val, "five");
+
+    // an older version never replaces a newer one
+    c.put(k, 4, e::slice("four"));
+    CHECK(c.get(k, &ver, &val));
+    CHECK_EQ(ver, 5U);
+    CHECK_EQ(val, "five");
+
+    c.put(k, 6, e::slice("six"));
+    CHECK(c.get(k, &ver, &val));
+    CHECK_EQ(ver, 6U);
+    CHECK_EQ(val, "six");
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes;
+    c.stats(&hits, &misses, &bytes);
+    CHECK_EQ(hits, 3U);
+    CHECK_EQ(misses, 1U);
+    CHECK_EQ(bytes, k.size() + 3);
+}
+
+static void
+check_oversized()
+{
+    learned_cache c(SHARD * LEARNED_CACHE_SHARDS);
+    const e::slice k("key");
+    const std::string big(SHARD, 'b');
+    uint64_t ver;
+    std::string val;
+
+    // a value too big to cache is not cached
+    c.put(k, 1, e::slice(big));
+    CHECK(!c.get(k, &ver, &val));
+
+    // but evicts the older value it replaces, which would otherwise be
+    // served in its stead
+    c.put(k, 2, e::slice("small"));
+    c.put(k, 3, e::slice(big));
+    CHECK(!c.get(k, &ver, &val));
+
+    // and leaves a newer one be
+    c.put(k, 5, e::slice("small"));
+    c.put(k, 4, e::slice(big));
+    CHECK(c.get(k, &ver, &val));
+    CHECK_EQ(ver, 5U);
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes;
+    c.stats(&hits, &misses, &bytes);
+    CHECK_EQ(bytes, k.size() + 5);
+}
+
+static void
+check_eviction()
+{
+    learned_cache c(SHARD * LEARNED_CACHE_SHARDS);
+    const std::vector<std::string> keys(same_shard(&c, 4));
+    const std::string v(SHARD / 4, 'v');
+    uint64_t ver;
+    std::string val;
+
+    for (size_t i = 0; i < 3; ++i)
+    {
+        c.put(e::slice(keys[i]), 1, e::slice(v));
+    }
+
+    // a get makes keys[0] the most recently used, so keys[1] goes first
+    CHECK(c.get(e::slice(keys[0]), &ver, &val));
+    c.put(e::slice(keys[3]), 1, e::slice(v));
+    c.put(e::slice(keys[3]), 2, e::slice(v + v));
+    CHECK(c.get(e::slice(keys[0]), &ver, &val));
+    CHECK(!c.get(e::slice(keys[1]), &ver, &val));
+    CHECK(!c.get(e::slice(keys[2]), &ver, &val));
+    CHECK(c.get(e::slice(keys[3]), &ver, &val));
+    CHECK_EQ(ver, 2U);
+
+    learned_cache::shard* s = c.get_shard(e::slice(keys[0]));
+    CHECK_LE(s->bytes, uint64_t(SHARD));
+    CHECK_EQ(s->entries.size(), s->lru.size());
+}
+
+static void
+check_disabled()
+{
+    learned_cache c(0);
+    uint64_t ver;
+    std::string val;
+    c.put(e::slice("key"), 1, e::slice("value"));
+    CHECK(!c.get(e::slice("key"), &ver, &val));
+}
+
+int
+main(int, const char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    check_versions();
+    check_oversized();
+    check_eviction();
+    check_disabled();
+    return EXIT_SUCCESS;
+}
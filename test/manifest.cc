@@ -0,0 +1,129 @@
+// Copyright (c) 2017, Robert Escriva
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of pocdb nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// The manifest a chunked value is stored as, and the keys of its chunks.
+
+// C
+#include <stdlib.h>
+
+// STL
+#include <set>
+
+// Google Log
+#include <glog/logging.h>
+
+// pocdb
+#include "chunk.h"
+
+static void
+check_sizes()
+{
+    chunk_manifest m(CHUNK_SIZE + 1, 7);
+    CHECK_EQ(m.count, 2U);
+    CHECK_EQ(m.chunk_size(0), size_t(CHUNK_SIZE));
+    CHECK_EQ(m.chunk_size(1), 1U);
+
+    m = chunk_manifest(3ULL * CHUNK_SIZE, 7);
+    CHECK_EQ(m.count, 3U);
+    CHECK_EQ(m.chunk_size(2), size_t(CHUNK_SIZE));
+
+    // larger than a uint32_t of bytes
+    m = chunk_manifest(5ULL << 30, 7);
+    CHECK_EQ(m.count, uint32_t((5ULL << 30) / CHUNK_SIZE));
+    CHECK_EQ(m.chunk_size(m.count - 1), size_t(CHUNK_SIZE));
+}
+
+static void
+check_codec()
+{
+    const chunk_manifest m(10ULL * CHUNK_SIZE + 12345, 0x0102030405060708ULL);
+    std::string enc;
+    encode_manifest(m, &enc);
+    CHECK_EQ(enc.size(), MANIFEST_SIZE);
+    CHECK_EQ(enc[0], char(CODEC_CHUNKED));
+    CHECK(is_manifest(e::slice(enc)));
+
+    chunk_manifest d;
+    CHECK(decode_manifest(e::slice(enc), &d));
+    CHECK_EQ(d.size, m.size);
+    CHECK_EQ(d.count, m.count);
+    CHECK_EQ(d.id, m.id);
+
+    // a tagged value of the manifest's size, or a manifest cut short or
+    // run long, is not a manifest
+    std::string other(enc);
+    other[0] = '\0';
+    CHECK(!is_manifest(e::slice(other)));
+    CHECK(!decode_manifest(e::slice(other), &d));
+    other = enc.substr(0, MANIFEST_SIZE - 1);
+    CHECK(!is_manifest(e::slice(other)));
+    other = enc + 'x';
+    CHECK(!is_manifest(e::slice(other)));
+    CHECK(!is_manifest(e::slice()));
+
+    // a count that disagrees with the size
+    chunk_manifest bad(m);
+    ++bad.count;
+    encode_manifest(bad, &enc);
+    CHECK(is_manifest(e::slice(enc)));
+    CHECK(!decode_manifest(e::slice(enc), &d));
+}
+
+static void
+check_chunk_keys()
+{
+    const std::string key("key");
+    const std::string ck(chunk_key(key, 0x0102030405060708ULL, 0x0a0b0c0dU));
+    CHECK_EQ(ck.size(), key.size() + 1 + 8 + 4);
+    CHECK_EQ(ck.substr(0, key.size()), key);
+    CHECK_EQ(ck[key.size()], '\0');
+    CHECK_EQ(ck.substr(key.size() + 1), std::string("\x01\x02\x03\x04\x05\x06\x07\x08"
+                                                    "\x0a\x0b\x0c\x0d", 12));
+
+    // chunks of one value, of another value of the key, and of a key that
+    // extends this one, never collide
+    std::set<std::string> keys;
+
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        CHECK(keys.insert(chunk_key(key, 1, i)).second);
+        CHECK(keys.insert(chunk_key(key, 2, i)).second);
+        CHECK(keys.insert(chunk_key(key + '\0', 1, i)).second);
+    }
+
+    CHECK(keys.find(key) == keys.end());
+}
+
+int
+main(int, const char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    check_sizes();
+    check_codec();
+    check_chunk_keys();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+// Copyright (c) 2017, Robert Escriva
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of pocdb nor the names of its contributors may be
+//       used to endorse or promote products derived from this software without
+//       specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+// The on-disk record format:  the tagged keys records live under, the varint
+// fields of acceptor and learned records, and the order the comparator puts
+// tagged keys in.
+
+// C
+#include <stdlib.h>
+
+// pocdb
+#include "daemon.h"
+
+static void
+check_varints()
+{
+    const uint64_t xs[] = { 0, 1, 0x7f, 0x80, 0x3fff, 0x4000,
+                            1ULL << 32, ~0ULL >> 1, ~0ULL };
+
+    for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i)
+    {
+        std::string s;
+        pack_varint(&s, xs[i]);
+        CHECK_LE(s.size(), 10U);
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(s.data());
+        const uint8_t* end = p + s.size();
+        uint64_t x;
+        CHECK(unpack_varint(&p, end, &x));
+        CHECK_EQ(x, xs[i]);
+        CHECK(p == end);
+
+        // every prefix is short a byte
+        p = reinterpret_cast<const uint8_t*>(s.data());
+        CHECK(!unpack_varint(&p, end - 1, &x));
+    }
+}
+
+static void
+check_acceptor()
+{
+    ballot b;
+    b.number = 300;
+    b.leader = HOSTC;
+    pvalue v;
+    v.b.number = 299;
+    v.b.leader = HOSTA;
+    v.v = e::slice("accepted\0value", 14);
+    std::string rec;
+    encode_acceptor(&rec, 1ULL << 40, b, v);
+    CHECK_EQ(rec[0], char(RECORD_FORMAT));
+
+    uint64_t ver;
+    ballot rb;
+    pvalue rv;
+    CHECK(decode_acceptor(e::slice(rec), &ver, &rb, &rv));
+    CHECK_EQ(ver, 1ULL << 40);
+    CHECK(rb == b);
+    CHECK(rv.b == v.b);
+    CHECK(rv.v == v.v);
+
+    // an empty accepted value, as an acceptor that only promised stores
+    encode_acceptor(&rec, 0, b, pvalue());
+    CHECK(decode_acceptor(e::slice(rec), &ver, &rb, &rv));
+    CHECK_EQ(ver, 0U);
+    CHECK(rv.b == ballot());
+    CHECK_EQ(rv.v.size(), 0U);
+
+    // truncated, empty, or of another format
+    CHECK(!decode_acceptor(e::slice(rec.data(), 3), &ver, &rb, &rv));
+    CHECK(!decode_acceptor(e::slice(), &ver, &rb, &rv));
+    rec[0] = char(RECORD_FORMAT + 1);
+    CHECK(!decode_acceptor(e::slice(rec), &ver, &rb, &rv));
+}
+
+static void
+check_learned()
+{
+    std::string rec;
+    encode_learned(&rec, 200, e::slice("learned"));
+    uint64_t ver;
+    size_t off;
+    CHECK(decode_learned(e::slice(rec), &ver, &off));
+    CHECK_EQ(ver, 200U);
+    CHECK_EQ(rec.substr(off), "learned");
+
+    // a learned delete is an empty value
+    encode_learned(&rec, 201, e::slice());
+    CHECK(decode_learned(e::slice(rec), &ver, &off));
+    CHECK_EQ(ver, 201U);
+    CHECK_EQ(off, rec.size());
+
+    CHECK(!decode_learned(e::slice(rec.data(), 1), &ver, &off));
+    CHECK(!decode_learned(e::slice(), &ver, &off));
+    rec[0] = char(RECORD_FORMAT + 1);
+    CHECK(!decode_learned(e::slice(rec), &ver, &off));
+}
+
+static int
+compare(const tagged_key_comparator& c, const std::string& a, const std::string& b)
+{
+    const int cmp = c.Compare(leveldb::Slice(a), leveldb::Slice(b));
+    return cmp < 0 ? -1 : cmp > 0 ? 1 : 0;
+}
+
+static void
+check_comparator()
+{
+    tagged_key_comparator c;
+    const std::string a_acc(record_key(e::slice("a"), ACCEPTOR_TAG));
+    const std::string a_lrn(record_key(e::slice("a"), LEARNED_TAG));
+    const std::string ab_acc(record_key(e::slice("aB"), ACCEPTOR_TAG));
+    const std::string b_lrn(record_key(e::slice("b"), LEARNED_TAG));
+    const std::string empty_key(record_key(e::slice(), ACCEPTOR_TAG));
+    const std::string format(record_key(e::slice(), FORMAT_TAG));
+
+    CHECK_EQ(a_acc, std::string("aA"));
+    CHECK_EQ(compare(c, a_acc, a_acc), 0);
+    CHECK_EQ(compare(c, a_acc, a_lrn), -1);
+    CHECK_EQ(compare(c, a_lrn, a_acc), 1);
+
+    // a key's records sort together, ahead of those of any key it prefixes;
+    // bytewise, "aBA" would fall between "aA" and "aL"
+    CHECK_EQ(compare(c, a_lrn, ab_acc), -1);
+    CHECK_EQ(compare(c, ab_acc, b_lrn), -1);
+    CHECK_EQ(compare(c, b_lrn, a_acc), 1);
+
+    // the empty key's records, the format record among them, come first
+    CHECK_EQ(compare(c, empty_key, format), -1);
+    CHECK_EQ(compare(c, format, a_acc), -1);
+    CHECK_EQ(compare(c, std::string(), format), -1);
+    CHECK_EQ(compare(c, std::string(), std::string()), 0);
+
+    // keys hold any byte, and compare unsigned
+    const std::string hi(record_key(e::slice("\xff", 1), ACCEPTOR_TAG));
+    const std::string nul(record_key(e::slice("\0", 1), LEARNED_TAG));
+    CHECK_EQ(compare(c, nul, a_acc), -1);
+    CHECK_EQ(compare(c, hi, b_lrn), 1);
+}
+
+int
+main(int, const char* argv[])
+{
+    google::InitGoogleLogging(argv[0]);
+    check_varints();
+    check_acceptor();
+    check_learned();
+    check_comparator();
+    return EXIT_SUCCESS;
+}